@@ -0,0 +1,228 @@
+#!/bin/bash
+#
+# Compile-time scaling benchmark.
+#
+# Each generator below writes a synthetic C program of a given size
+# to stdout. Every shape is compiled at sizes n and 4n with
+# `chibicc --stats=json`, which reports compile time and peak RSS.
+# If time grows faster than linearly with the input size, the shape
+# is reported as superlinear.
+#
+# Wall times depend on the host, so they are not compared directly.
+# Before compiling anything, the script times a fixed awk loop, and
+# compile times are recorded in multiples of that loop. The growth
+# time(4n) / time(n) is a ratio already and is recorded as is.
+#
+# Results are compared against bench/compile-baseline.json. A shape
+# regresses if it became superlinear or grows faster than it did in
+# the baseline, or if it got more than $BENCH_TOLERANCE times slower
+# or bigger than the baseline. `-o file` writes the results to a
+# file; `make bench-baseline` uses it to accept the current numbers
+# as the new baseline.
+
+cd "$(dirname "$0")/.."
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+results=$tmp/results.json
+baseline=bench/compile-baseline.json
+tolerance=${BENCH_TOLERANCE:-1.5}
+output=
+
+while getopts o: opt; do
+  case $opt in
+  o) output=$OPTARG ;;
+  *) echo "usage: $0 [-o results.json]" >&2; exit 1 ;;
+  esac
+done
+
+# 1+1+1+...+1
+gen_long_expr() {
+  echo "int main() { return 0"
+  for ((i = 0; i < $1; i++)); do echo "+1"; done
+  echo "; }"
+}
+
+# (1+(1+(1+...)))
+gen_deep_expr() {
+  echo "int main() { return "
+  for ((i = 0; i < $1; i++)); do printf "(1+"; done
+  printf "0"
+  for ((i = 0; i < $1; i++)); do printf ")"; done
+  echo "; }"
+}
+
+# Many small function definitions.
+gen_many_funcs() {
+  for ((i = 0; i < $1; i++)); do
+    echo "int f$i(int x, int y) { return x * $i + y; }"
+  done
+  echo "int main() { return f0(1, 2); }"
+}
+
+# One function with many local variables.
+gen_many_locals() {
+  echo "int main() {"
+  for ((i = 0; i < $1; i++)); do echo "  int v$i = $i;"; done
+  echo "  return v0;"
+  echo "}"
+}
+
+# Deeply nested block scopes, each declaring a variable.
+gen_nested_scopes() {
+  echo "int main() { int x0 = 0;"
+  for ((i = 1; i <= $1; i++)); do echo "{ int x$i = x$((i - 1)) + 1;"; done
+  for ((i = 1; i <= $1; i++)); do printf "}"; done
+  echo "return x0; }"
+}
+
+# A single huge string literal.
+gen_big_string() {
+  printf 'int main() { char *p = "'
+  for ((i = 0; i < $1 / 64; i++)); do
+    printf '0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\\n'
+  done
+  echo '"; return p[0]; }'
+}
+
+# A struct with many members, each of them initialized once.
+gen_big_struct() {
+  echo "struct S {"
+  for ((i = 0; i < $1; i++)); do echo "  long m$i;"; done
+  echo "};"
+  echo "int init(struct S *p) {"
+  for ((i = 0; i < $1; i++)); do echo "  p->m$i = $i;"; done
+  echo "  return 0;"
+  echo "}"
+  echo "int main() { struct S s; return init(&s); }"
+}
+
+# A large header of typedefs followed by a small amount of code.
+gen_typedef_header() {
+  for ((i = 0; i < $1; i++)); do
+    echo "typedef struct { int a; long b; } s$i;"
+    echo "typedef s$i *p$i;"
+    echo "int g$i(p$i x);"
+  done
+  echo "int main() { s0 x; p0 y = &x; y->a = 1; return x.a; }"
+}
+
+shapes="long_expr:8000 deep_expr:2000 many_funcs:2500 many_locals:1000
+        nested_scopes:500 big_string:131072 big_struct:2000 typedef_header:1000"
+
+# Extract a numeric field from chibicc's --stats=json output.
+field() {
+  sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p"
+}
+
+# Prints the fastest of three runs of a fixed CPU-bound loop, in ns.
+calibrate() {
+  local best=
+  for i in 1 2 3; do
+    local start=$(date +%s%N)
+    awk 'BEGIN { for (i = 0; i < 3000000; i++) s += i }'
+    local ns=$(($(date +%s%N) - start))
+    [ -z "$best" ] || [ $ns -lt $best ] && best=$ns
+  done
+  echo $best
+}
+
+# Compiles a shape of size n three times and prints the fastest
+# time, peak RSS and the size of the generated assembly.
+run() {
+  local shape=$1 n=$2 best=
+  gen_$shape $n > $tmp/$shape.c
+  for i in 1 2 3; do
+    local json
+    json=$(./chibicc --stats=json -o $tmp/out.s $tmp/$shape.c 2>&1 >/dev/null)
+    if [ $? -ne 0 ]; then
+      echo "$shape: compile failed at n=$n" >&2
+      echo "$json" >&2
+      exit 1
+    fi
+    local ns=$(echo "$json" | sed 's/.*"total"://' | field wall_ns)
+    [ -z "$best" ] || [ $ns -lt $best ] && best=$ns
+  done
+  local rss=$(echo "$json" | field max_rss_kb)
+  local bytes=$(echo "$json" | field asm_bytes)
+  echo "$best $rss $bytes"
+}
+
+# Returns a field of a shape from a results file.
+lookup() {
+  grep "\"shape\":\"$2\"" $1 2>/dev/null | field $3
+}
+
+fail=0
+first=1
+echo "[" > $results
+
+calib=$(calibrate)
+printf "calibration loop: %.3f ms\n" $(awk "BEGIN { print $calib / 1e6 }")
+
+printf "%-16s %8s %10s %8s %10s %10s %8s\n" \
+  shape n "time(ms)" time "rss(KiB)" "asm(B)" growth
+for s in $shapes; do
+  shape=${s%%:*}
+  n=${s##*:}
+
+  # `read ... <<< "$(run ...)"` would not see a failure of run.
+  out=$(run $shape $n) || exit 1
+  read ns1 rss1 bytes1 <<< "$out"
+  out=$(run $shape $((n * 4))) || exit 1
+  read ns4 rss4 bytes4 <<< "$out"
+
+  # Linear growth means time(4n) / time(n) is about 4. Anything
+  # above 6 is flagged as superlinear.
+  growth=$(awk "BEGIN { printf \"%.2f\", $ns4 / ($ns1 ? $ns1 : 1) }")
+  linear=$(awk "BEGIN { print ($growth <= 6.0) ? \"true\" : \"false\" }")
+  ms=$(awk "BEGIN { printf \"%.3f\", $ns4 / 1e6 }")
+  time=$(awk "BEGIN { printf \"%.3f\", $ns4 / $calib }")
+
+  printf "%-16s %8d %10s %8s %10d %10d %8s" \
+    $shape $((n * 4)) $ms $time $rss4 $bytes4 $growth
+  [ $linear = true ] || printf "  superlinear"
+
+  if [ -f $baseline ] && [ "$(lookup $baseline $shape n)" = $((n * 4)) ]; then
+    base_time=$(lookup $baseline $shape time)
+    base_rss=$(lookup $baseline $shape max_rss_kb)
+    base_growth=$(lookup $baseline $shape growth)
+
+    # Differences below 10ms on this host are treated as noise.
+    if awk "BEGIN { exit !($time > $base_time * $tolerance &&
+                           ($time - $base_time) * $calib > 1e7) }"; then
+      printf "  REGRESSION: time %s -> %s" $base_time $time
+      fail=1
+    fi
+    if awk "BEGIN { exit !($rss4 > $base_rss * $tolerance) }"; then
+      printf "  REGRESSION: rss %s -> %s KiB" $base_rss $rss4
+      fail=1
+    fi
+
+    # A shape that was superlinear already regresses only if it got
+    # noticeably worse.
+    if awk "BEGIN { exit !($growth > 6.0 &&
+                           $growth > $base_growth * $tolerance) }"; then
+      printf "  REGRESSION: growth %s -> %s" $base_growth $growth
+      fail=1
+    fi
+  fi
+  echo
+
+  [ $first = 1 ] || echo "," >> $results
+  first=0
+  printf '  {"shape":"%s","n":%d,"time":%s,"max_rss_kb":%d,"asm_bytes":%d,"growth":%s,"linear":%s}' \
+    $shape $((n * 4)) $time $rss4 $bytes4 $growth $linear >> $results
+done
+
+echo >> $results
+echo "]" >> $results
+[ -z "$output" ] || cp $results "$output"
+
+if [ ! -f $baseline ]; then
+  echo "no baseline; run 'make bench-baseline' to create one"
+elif [ $fail = 0 ]; then
+  echo OK
+fi
+exit $fail
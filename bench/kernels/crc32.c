@@ -0,0 +1,58 @@
+// Bitwise CRC-32 (IEEE 802.3). chibicc has no bitwise operators yet,
+// so bits are extracted and combined with division and multiplication.
+
+int printf();
+
+char buf[256];
+long poly[32];
+long pow2[33];
+
+// Returns crc ^ 0xEDB88320.
+long xor_poly(long crc) {
+  long r = 0;
+  int k;
+  for (k = 0; k < 32; k = k + 1) {
+    long bit = crc / pow2[k] - crc / pow2[k + 1] * 2;
+    if (bit != poly[k])
+      r = r + pow2[k];
+  }
+  return r;
+}
+
+long crc32(char *p, int len) {
+  long crc = 4294967295;
+  int i;
+  for (i = 0; i < len; i = i + 1) {
+    int byte = p[i];
+    int k;
+    for (k = 0; k < 8; k = k + 1) {
+      long lsb = crc - crc / 2 * 2;
+      long b = byte - byte / 2 * 2;
+      byte = byte / 2;
+      crc = crc / 2;
+      if (lsb != b)
+        crc = xor_poly(crc);
+    }
+  }
+  return 4294967295 - crc;
+}
+
+int main() {
+  int i;
+  pow2[0] = 1;
+  for (i = 1; i <= 32; i = i + 1)
+    pow2[i] = pow2[i - 1] * 2;
+
+  // 0xEDB88320, least significant bit first.
+  long p = 3988292384;
+  for (i = 0; i < 32; i = i + 1) {
+    poly[i] = p - p / 2 * 2;
+    p = p / 2;
+  }
+
+  for (i = 0; i < 256; i = i + 1)
+    buf[i] = i;
+
+  printf("%ld\n", crc32(buf, 256));
+  return 0;
+}
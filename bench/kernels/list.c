@@ -0,0 +1,45 @@
+// Linked-list traversal over nodes linked in a scrambled order.
+// chibicc cannot declare self-referential structs yet, so links are
+// node indices rather than pointers.
+
+int printf();
+
+struct Node {
+  long next;
+  long val;
+};
+
+struct Node nodes[1001];
+
+long walk(struct Node *list, long head, long end) {
+  long sum = 0;
+  long i;
+  for (i = head; i != end; i = list[i].next)
+    sum = sum + list[i].val;
+  return sum;
+}
+
+int main() {
+  int n = 1000;
+  int i;
+
+  // 7 and 1000 are coprime, so this visits every node exactly once.
+  long prev = 0;
+  nodes[0].val = 0;
+  long k = 0;
+  for (i = 1; i < n; i = i + 1) {
+    k = k + 7;
+    k = k - k / n * n;
+    nodes[k].val = i;
+    nodes[prev].next = k;
+    prev = k;
+  }
+  nodes[prev].next = n;
+
+  long sum = 0;
+  int r;
+  for (r = 0; r < 20; r = r + 1)
+    sum = sum + walk(nodes, 0, n) * (r + 1);
+  printf("%ld\n", sum);
+  return 0;
+}
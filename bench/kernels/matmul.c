@@ -0,0 +1,37 @@
+// Dense integer matrix multiplication.
+
+int printf();
+
+long a[24][24];
+long b[24][24];
+long c[24][24];
+
+int main() {
+  int n = 24;
+  int i;
+  int j;
+  int k;
+
+  for (i = 0; i < n; i = i + 1) {
+    for (j = 0; j < n; j = j + 1) {
+      a[i][j] = i + j;
+      b[i][j] = i - j + n;
+    }
+  }
+
+  for (i = 0; i < n; i = i + 1) {
+    for (j = 0; j < n; j = j + 1) {
+      long sum = 0;
+      for (k = 0; k < n; k = k + 1)
+        sum = sum + a[i][k] * b[k][j];
+      c[i][j] = sum;
+    }
+  }
+
+  long check = 0;
+  for (i = 0; i < n; i = i + 1)
+    for (j = 0; j < n; j = j + 1)
+      check = check + c[i][j] * (i + 1) - j;
+  printf("%ld\n", check);
+  return 0;
+}
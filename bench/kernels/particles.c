@@ -0,0 +1,72 @@
+// Struct-heavy particle simulation with struct assignment.
+
+int printf();
+
+typedef struct {
+  long x;
+  long y;
+} Vec;
+
+typedef struct {
+  Vec pos;
+  Vec vel;
+  long mass;
+} Particle;
+
+Particle parts[64];
+
+int step(Particle *p, int n, long size) {
+  int bounces = 0;
+  int i;
+  for (i = 0; i < n; i = i + 1) {
+    Particle q;
+    q = p[i];
+    q.pos.x = q.pos.x + q.vel.x;
+    q.pos.y = q.pos.y + q.vel.y;
+    if (q.pos.x < 0) {
+      q.pos.x = -q.pos.x;
+      q.vel.x = -q.vel.x;
+      bounces = bounces + 1;
+    }
+    if (q.pos.x > size) {
+      q.pos.x = size * 2 - q.pos.x;
+      q.vel.x = -q.vel.x;
+      bounces = bounces + 1;
+    }
+    if (q.pos.y < 0) {
+      q.pos.y = -q.pos.y;
+      q.vel.y = -q.vel.y;
+      bounces = bounces + 1;
+    }
+    if (q.pos.y > size) {
+      q.pos.y = size * 2 - q.pos.y;
+      q.vel.y = -q.vel.y;
+      bounces = bounces + 1;
+    }
+    p[i] = q;
+  }
+  return bounces;
+}
+
+int main() {
+  int n = 64;
+  int i;
+  for (i = 0; i < n; i = i + 1) {
+    parts[i].pos.x = i * 13;
+    parts[i].pos.y = i * 29;
+    parts[i].vel.x = i - 32;
+    parts[i].vel.y = 17 - i;
+    parts[i].mass = i + 1;
+  }
+
+  long bounces = 0;
+  int t;
+  for (t = 0; t < 200; t = t + 1)
+    bounces = bounces + step(parts, n, 1000);
+
+  long check = bounces;
+  for (i = 0; i < n; i = i + 1)
+    check = check + (parts[i].pos.x + parts[i].pos.y * 3) * parts[i].mass;
+  printf("%ld\n", check);
+  return 0;
+}
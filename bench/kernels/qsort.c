@@ -0,0 +1,56 @@
+// Quicksort of pseudo-random numbers.
+
+int printf();
+
+long data[2000];
+long seed;
+
+long rand31() {
+  seed = seed * 1103515245 + 12345;
+  seed = seed - seed / 2147483648 * 2147483648;
+  return seed;
+}
+
+int sort(long *p, int lo, int hi) {
+  if (hi <= lo)
+    return 0;
+
+  long pivot = p[(lo + hi) / 2];
+  int i = lo;
+  int j = hi;
+  while (i <= j) {
+    while (p[i] < pivot)
+      i = i + 1;
+    while (pivot < p[j])
+      j = j - 1;
+    if (i <= j) {
+      long t = p[i];
+      p[i] = p[j];
+      p[j] = t;
+      i = i + 1;
+      j = j - 1;
+    }
+  }
+  sort(p, lo, j);
+  sort(p, i, hi);
+  return 0;
+}
+
+int main() {
+  int n = 2000;
+  int i;
+  seed = 42;
+  for (i = 0; i < n; i = i + 1)
+    data[i] = rand31() / 65536;
+
+  sort(data, 0, n - 1);
+
+  long check = 0;
+  for (i = 0; i < n; i = i + 1)
+    check = check + data[i] * (i + 1);
+  for (i = 1; i < n; i = i + 1)
+    if (data[i] < data[i - 1])
+      return 1;
+  printf("%ld\n", check);
+  return 0;
+}
@@ -0,0 +1,31 @@
+// Sieve of Eratosthenes.
+
+int printf();
+
+char flags[8193];
+
+int sieve(int n) {
+  int count = 0;
+  int i;
+  for (i = 0; i <= n; i = i + 1)
+    flags[i] = 0;
+
+  for (i = 2; i <= n; i = i + 1) {
+    if (flags[i] == 0) {
+      count = count + 1;
+      int j;
+      for (j = i * i; j <= n; j = j + i)
+        flags[j] = 1;
+    }
+  }
+  return count;
+}
+
+int main() {
+  long sum = 0;
+  int r;
+  for (r = 0; r < 4; r = r + 1)
+    sum = sum + sieve(8192);
+  printf("%ld\n", sum);
+  return 0;
+}
@@ -0,0 +1,41 @@
+// Naive substring search.
+
+int printf();
+
+char text[4096];
+
+int count_matches(char *s, int n, char *pat, int m) {
+  int count = 0;
+  int i;
+  for (i = 0; i + m <= n; i = i + 1) {
+    int j = 0;
+    while (j < m) {
+      if (s[i + j] != pat[j])
+        j = m + 1;
+      else
+        j = j + 1;
+    }
+    if (j == m)
+      count = count + 1;
+  }
+  return count;
+}
+
+int main() {
+  char *alphabet = "abcab";
+  long seed = 7;
+  int i;
+  for (i = 0; i < 4096; i = i + 1) {
+    seed = seed * 1103515245 + 12345;
+    seed = seed - seed / 2147483648 * 2147483648;
+    long r = seed / 65536;
+    text[i] = alphabet[r - r / 5 * 5];
+  }
+
+  long sum = 0;
+  sum = sum + count_matches(text, 4096, "ab", 2);
+  sum = sum + count_matches(text, 4096, "abca", 4) * 100;
+  sum = sum + count_matches(text, 4096, "cabba", 5) * 10000;
+  printf("%ld\n", sum);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#!/bin/bash
+#
+# Runtime benchmark for the code chibicc generates.
+#
+# Each kernel in bench/kernels is compiled by chibicc and by GCC at
+# -O0 and -O1, and run under qemu-aarch64-static just like `make
+# test` does. The primary metric is the number of dynamically
+# executed instructions, which unlike wall time is stable and does
+# not depend on the host machine. If $QEMU_PLUGIN points to qemu's
+# libinsn.so, it is used to count instructions. Otherwise, qemu runs
+# in single-step mode and the executed instructions are counted from
+# its execution trace, which is slower but needs no plugin.
+#
+# The report shows, per kernel, the instruction counts and wall times
+# of each compiler and the ratio of chibicc to GCC. Results are also
+# written to bench/run-results.json.
+
+cd "$(dirname "$0")/.."
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+cross_cc=${CROSS_CC:-aarch64-linux-gnu-gcc}
+qemu=${QEMU:-qemu-aarch64-static}
+results=bench/run-results.json
+configs="chibicc gcc-O0 gcc-O1"
+
+build() {
+  local config=$1 src=$2 exe=$3
+  case $config in
+  chibicc)
+    $cross_cc -o- -E -P -C $src | ./chibicc $CHIBICC_FLAGS -o $tmp/out.s - &&
+      $cross_cc -static -o $exe $tmp/out.s
+    ;;
+  gcc-O*)
+    $cross_cc ${config#gcc} -w -static -o $exe $src
+    ;;
+  esac
+}
+
+# Prints the number of instructions executed by a given program.
+count_insns() {
+  if [ -n "$QEMU_PLUGIN" ]; then
+    $qemu -plugin $QEMU_PLUGIN -d plugin -D $tmp/plugin.log $1 > /dev/null &&
+      grep -o 'insns: [0-9]*' $tmp/plugin.log | tail -1 | cut -d' ' -f2
+  else
+    $qemu -singlestep -d nochain,exec $1 2>&1 > /dev/null | grep -c '^Trace'
+  fi
+}
+
+# Prints the fastest wall time of three runs in nanoseconds.
+wall_ns() {
+  local best=
+  for i in 1 2 3; do
+    local start=$(date +%s%N)
+    $qemu $1 > /dev/null
+    local ns=$(( $(date +%s%N) - start ))
+    [ -z "$best" ] || [ $ns -lt $best ] && best=$ns
+  done
+  echo $best
+}
+
+ratio() {
+  awk "BEGIN { printf \"%.2f\", $1 / ($2 ? $2 : 1) }"
+}
+
+fail=0
+first=1
+echo "[" > $results
+
+printf "%-12s" kernel
+for c in $configs; do printf " %14s" "$c"; done
+printf " %9s %9s %12s\n" "vs gcc-O0" "vs gcc-O1" "time vs O1"
+
+declare -A insns ns
+
+for src in bench/kernels/*.c; do
+  kernel=$(basename $src .c)
+  json="{\"kernel\":\"$kernel\""
+
+  for c in $configs; do
+    exe=$tmp/$kernel-$c
+    if ! build $c $src $exe; then
+      echo "$kernel: $c: build failed"
+      exit 1
+    fi
+
+    if ! $qemu $exe > $tmp/$c.out; then
+      echo "$kernel: $c: exited with non-zero status"
+      exit 1
+    fi
+
+    insns[$c]=$(count_insns $exe)
+    ns[$c]=$(wall_ns $exe)
+    json="$json,\"$c\":{\"insns\":${insns[$c]},\"wall_ns\":${ns[$c]}}"
+  done
+
+  # All compilers must agree on the result.
+  for c in $configs; do
+    if ! cmp -s $tmp/$c.out $tmp/gcc-O0.out; then
+      echo "$kernel: $c: output differs from gcc-O0"
+      fail=1
+    fi
+  done
+
+  r0=$(ratio ${insns[chibicc]} ${insns[gcc-O0]})
+  r1=$(ratio ${insns[chibicc]} ${insns[gcc-O1]})
+  t1=$(ratio ${ns[chibicc]} ${ns[gcc-O1]})
+
+  printf "%-12s" $kernel
+  for c in $configs; do printf " %14d" ${insns[$c]}; done
+  printf " %9s %9s %12s\n" $r0 $r1 $t1
+
+  [ $first = 1 ] || echo "," >> $results
+  first=0
+  printf '  %s,"ratio_gcc_O0":%s,"ratio_gcc_O1":%s}' "$json" $r0 $r1 >> $results
+done
+
+echo >> $results
+echo "]" >> $results
+exit $fail
@@ -7,11 +7,28 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdnoreturn.h>
 #include <string.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Member Member;
+typedef struct BB BB;
+typedef struct Reg Reg;
+typedef struct Store Store;
+
+//
+// main.c
+//
+
+extern bool opt_peephole;
+extern bool opt_omit_frame_pointer;
+extern bool opt_optimize_sibling_calls;
+extern bool opt_if_conversion;
+extern bool opt_vectorize;
+extern int opt_memcpy_threshold;
+extern int opt_inline_limit;
+extern int opt_unroll_factor;
 
 //
 // strings.c
@@ -19,6 +36,67 @@ typedef struct Member Member;
 
 char *format(char *fmt, ...);
 
+//
+// stats.c
+//
+
+typedef enum {
+  STATS_NONE,
+  STATS_TABLE,
+  STATS_JSON,
+} StatsFormat;
+
+// Compiler phases reported by -ftime-report. More phases, such as
+// optimization passes, can be registered with add_phase().
+typedef enum {
+  PHASE_READ_FILE,
+  PHASE_TOKENIZE,
+  PHASE_PARSE,
+  PHASE_ADD_TYPE,
+  PHASE_GEN_IR,
+  PHASE_REGALLOC,
+  PHASE_CODEGEN,
+  PHASE_END, // Number of predefined phases
+} Phase;
+
+// Event counters. These are always updated because incrementing
+// an integer is cheaper than checking whether stats are enabled.
+typedef struct {
+  int64_t tokens;
+  int64_t nodes;
+  int64_t types;
+  int64_t scopes;
+  int64_t insns;
+  int64_t asm_bytes;
+} Counters;
+
+extern Counters counters;
+
+// Code size of a function, reported by --size-report.
+typedef struct FuncSize FuncSize;
+struct FuncSize {
+  FuncSize *next;
+  char *name;
+  int stack_size;
+  int max_depth; // Maximum stack depth reached by push()
+  int insns;
+  int loads;
+  int stores;
+  int alu;
+  int branches;
+  int calls;
+};
+
+void stats_enable(StatsFormat fmt);
+int add_phase(char *name);
+void phase_begin(int phase);
+int64_t *add_counter(char *name);
+void phase_end(void);
+void print_stats(FILE *out);
+FuncSize *new_func_size(char *name);
+void count_insn(FuncSize *fs, char *insn);
+void print_size_report(FILE *out);
+
 //
 // tokenize.c
 //
@@ -30,6 +108,7 @@ typedef enum {
   TK_KEYWORD, // Keywords
   TK_STR,     // String literals
   TK_NUM,     // Numeric literals
+  TK_PRAGMA,  // #pragma lines
   TK_EOF,     // End-of-file markers
 } TokenKind;
 
@@ -47,9 +126,9 @@ struct Token {
   int line_no;    // Line number
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+noreturn void error(char *fmt, ...);
+noreturn void error_at(char *loc, char *fmt, ...);
+noreturn void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
@@ -72,10 +151,17 @@ struct Obj {
 
   // Local variable
   int offset;
+  bool addr_taken; // True if its address may be taken
+  int refs;        // Number of references, counted by dce.c
+  Store *stores;   // Assignments whose values are unused, listed by dce.c
+  Node *block;     // Block that declares it, or NULL for a parameter
+  Reg *reg;        // Virtual register if promoted to a register
 
   // Global variable or function
   bool is_function;
   bool is_definition;
+  bool is_static;
+  bool is_live; // False if a static one is never referenced
 
   // Global variable
   char *init_data;
@@ -85,6 +171,12 @@ struct Obj {
   Node *body;
   Obj *locals;
   int stack_size;
+
+  // Function in IR form. Used only if optimization is enabled.
+  BB *bbs;
+  int nregs;
+  int nspills;
+  uint32_t used_regs; // Bitmap of machine registers used
 };
 
 // AST node
@@ -143,10 +235,27 @@ struct Node {
 
   Obj *var;      // Used if kind == ND_VAR
   int64_t val;   // Used if kind == ND_NUM
+  bool exact;    // ND_DIV whose remainder is known to be zero
+
+  // "for" statement: unroll factor given by #pragma unroll, 1 for
+  // #pragma nounroll, or -1 for full unrolling
+  int unroll;
 };
 
 Obj *parse(Token *tok);
 
+//
+// inline.c
+//
+
+void inline_functions(Obj *prog, char *path, FILE *report);
+
+//
+// dce.c
+//
+
+void eliminate_dead_code(Obj *prog, int level);
+
 //
 // type.c
 //
@@ -216,9 +325,209 @@ Type *func_type(Type *return_ty);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
+//
+// ir.c
+//
+
+// Virtual register
+struct Reg {
+  int vn; // Virtual register number
+  int rn;   // Real register number, or -1 if spilled
+  int slot; // Stack slot index if spilled
+  bool vector; // Holds a 128-bit SIMD vector
+};
+
+typedef enum {
+  IR_IMM,    // d = imm
+  IR_MOV,    // d = a
+  IR_ADD,    // d = a + b, or a + imm if b is NULL
+  IR_SUB,    // d = a - b, or a - imm if b is NULL
+  IR_MUL,    // d = a * b (or imm)
+  IR_DIV,    // d = a / b (or imm)
+  IR_MADD,   // d = a + b * c
+  IR_MSUB,   // d = a - b * c
+  IR_NEG,    // d = -a
+  IR_MNEG,   // d = -(a * b)
+  IR_ZEXT,   // d = a truncated to `size` bytes and zero-extended
+  IR_EQ,     // d = a == b (or imm, like IR_ADD)
+  IR_NE,     // d = a != b (or imm)
+  IR_LT,     // d = a < b (or imm)
+  IR_LE,     // d = a <= b (or imm)
+  IR_SEL,    // d = a ? b : c (see below)
+  IR_LVAR,   // d = address of a local variable
+  IR_GVAR,   // d = address of a global variable
+  IR_LOAD,   // d = *address
+  IR_STORE,  // *address = b
+  IR_MEMCPY, // Copy `size` bytes from b to a
+  IR_CALL,   // d = funcname(args...)
+  IR_ARG,    // d = imm'th argument of the current function
+  IR_VDUP,   // d = a in every lane
+  IR_VADD,   // d = a + b in each lane
+  IR_VSUB,   // d = a - b in each lane
+  IR_VMUL,   // d = a * b in each lane
+  IR_VMAX,   // d = max(a, b) in each lane
+  IR_VMIN,   // d = min(a, b) in each lane
+  IR_VEQ,    // d = a == b in each lane (all ones or zero)
+  IR_VLT,    // d = a < b in each lane
+  IR_VLE,    // d = a <= b in each lane
+  IR_VSEL,   // d = a ? b : c, bit by bit
+  IR_VSUMW,  // d = a + the lanes of b added into two 64-bit lanes
+  IR_VSUM,   // d = sum of the two 64-bit lanes of a
+  IR_VHMAX,  // d = max of the lanes of a
+  IR_VHMIN,  // d = min of the lanes of a
+  IR_JMP,    // goto bb1
+  IR_BR,     // if (a) goto bb1 else goto bb2
+  IR_RET,    // return a
+} IrKind;
+
+// IR instruction
+typedef struct Ir Ir;
+struct Ir {
+  IrKind kind;
+  Ir *next;
+  Ir *prev;
+  int line_no;
+
+  Reg *d;
+  Reg *a;
+  Reg *b;
+  Reg *c;
+
+  int64_t imm;  // IR_IMM, IR_ARG or an immediate operand
+  int size;     // Access size of IR_LOAD, IR_STORE, IR_MEMCPY or IR_ZEXT,
+                // or lane size of a vector instruction
+  Obj *var;     // IR_LVAR or IR_GVAR
+  bool exact;   // IR_DIV whose remainder is known to be zero
+
+  // IR_SEL picks b if a is nonzero, or c otherwise. c is incremented
+  // first if imm is 1, or negated if imm is -1. A NULL b or c stands
+  // for zero. With `invert`, the condition is that a is zero. If size
+  // is 4, the result is computed in 32 bits and zero-extended.
+  bool invert;
+
+  // Vector instructions work on registers of 16 bytes divided into
+  // lanes of `size` bytes. Lanes are unsigned, except that 8-byte
+  // lanes are compared as signed like scalar values. A vector is
+  // loaded and stored by IR_LOAD and IR_STORE of size 16.
+
+  // The address of IR_LOAD or IR_STORE is one of
+  //
+  //   a + imm
+  //   a + (index << shift)
+  //   x29 + var->offset + imm  (if var is set)
+  //
+  // With pre_index, a is incremented by imm before the access and the
+  // access is to the new a. With post_index, a is incremented after
+  // the access to the old a.
+  //
+  // b of IR_ADD and IR_SUB is shifted left by `shift` bits and, if
+  // `size` is not zero, zero-extended from `size` bytes first.
+  Reg *index;
+  int shift;
+  bool pre_index;
+  bool post_index;
+
+  // Function call
+  char *funcname;
+  Reg **args;
+  int nargs;
+
+  // Jump targets
+  BB *bb1;
+  BB *bb2;
+};
+
+// Basic block
+struct BB {
+  BB *next;
+  int label;
+  Ir *first;
+  Ir *last;
+
+  // Used by optimization passes
+  bool reachable;
+  int npreds;
+  int index; // Position in the function
+  int unroll; // Unroll factor of the loop headed by this block (see Node)
+
+  // Used by the register allocator
+  uint64_t *live_in;
+  uint64_t *live_out;
+};
+
+Reg *new_reg(Obj *fn);
+BB *new_bb(void);
+Ir *new_ir(IrKind kind);
+void insert_ir(BB *bb, Ir *pos, Ir *ir);
+void remove_ir(BB *bb, Ir *ir);
+bool is_terminator(Ir *ir);
+
+#define MAX_ARGS 32
+#define MAX_OPERANDS (MAX_ARGS + 4)
+int get_operands(Ir *ir, Reg ***ops);
+int get_defs(Ir *ir, Reg **defs);
+void gen_ir(Obj *prog);
+void dump_ir(Obj *prog, FILE *out);
+
+//
+// opt.c
+//
+
+void optimize(Obj *prog, int level);
+
+//
+// peephole.c
+//
+
+// A line of assembly
+typedef struct Insn Insn;
+struct Insn {
+  Insn *next;
+  Insn *prev;
+  char *text;
+
+  // Mnemonic and operands if the line is an instruction
+  char *op;
+  char *opnd[4];
+  int nopnds;
+};
+
+Insn *add_insn(Insn *tail, char *text);
+void peephole(Insn *head);
+
+//
+// regalloc.c
+//
+
+void alloc_regs(Obj *prog);
+
 //
 // codegen.c
 //
 
 void codegen(Obj *prog, FILE *out);
+bool takes_local_addr(Node *node);
+bool is_add_imm(int64_t val);
+bool is_cheap_mul(int64_t val);
 int align_to(int n, int align);
+
+//
+// hashmap.c
+//
+
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
+
+typedef struct {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
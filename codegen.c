@@ -2,19 +2,66 @@
 
 static FILE *output_file;
 static int depth;
-static char *argreg8[] = {"w0", "w1", "w2", "w3", "w4", "w5"};
-static char *argreg64[] = {"x0", "x1", "x2", "x3", "x4", "x5"};
+static char *argreg8[] = {"w0", "w1", "w2", "w3", "w4", "w5", "w6", "w7"};
+static char *argreg64[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
 static Obj *current_fn;
+static FuncSize *current_size;
 
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
+static int gen_args(Node *node);
+static void gen_epilogue(void);
+
+// If the peephole optimizer is enabled, the lines of a function are
+// collected to this list until the end of the function.
+static Insn insn_head;
+static Insn *insn_tail;
+
+static void write_line(char *line) {
+  counters.asm_bytes += fprintf(output_file, "%s\n", line);
+
+  // Lines other than labels and directives are instructions.
+  if (line[0] == ' ' && line[2] != '.') {
+    counters.insns++;
+    if (current_size)
+      count_insn(current_size, line + 2);
+  }
+}
 
 static void println(char *fmt, ...) {
+  char buf[256];
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
   va_end(ap);
-  fprintf(output_file, "\n");
+
+  char *line = buf;
+  if (len >= sizeof(buf)) {
+    line = calloc(1, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(line, len + 1, fmt, ap);
+    va_end(ap);
+  }
+
+  if (insn_tail)
+    insn_tail = add_insn(insn_tail, strdup(line));
+  else
+    write_line(line);
+}
+
+// Optimize and write out the lines collected for a function.
+static void flush_lines(void) {
+  if (!insn_tail)
+    return;
+
+  phase_begin(add_phase("peephole"));
+  peephole(&insn_head);
+  phase_end();
+
+  for (Insn *insn = insn_head.next; insn; insn = insn->next)
+    write_line(insn->text);
+  insn_head.next = NULL;
+  insn_tail = NULL;
 }
 
 static int count(void) {
@@ -25,6 +72,8 @@ static int count(void) {
 static void push(void) {
   println("  str x0, [sp, #-8]!");
   depth++;
+  if (current_size->max_depth < depth)
+    current_size->max_depth = depth;
 }
 
 static void pop(char *arg) {
@@ -32,6 +81,242 @@ static void pop(char *arg) {
   depth--;
 }
 
+// Returns true if a value can be an immediate operand of add, sub or
+// cmp, which is 12 bits optionally shifted left by 12 bits.
+bool is_add_imm(int64_t val) {
+  return (0 <= val && val < 4096) || (val % 4096 == 0 && 0 <= val && val < (1 << 24));
+}
+
+// Returns true if a value can be an immediate operand of a logical
+// instruction such as orr. Such a value is a rotated run of ones in an
+// element of 2, 4, 8, 16, 32 or 64 bits repeated to fill 64 bits.
+static bool is_logical_imm(uint64_t val) {
+  if (val == 0 || val == ~0ULL)
+    return false;
+
+  int size = 64;
+  while (size > 2) {
+    uint64_t mask = (1ULL << (size / 2)) - 1;
+    if ((val & mask) != ((val >> (size / 2)) & mask))
+      break;
+    size /= 2;
+  }
+
+  uint64_t mask = (size == 64) ? ~0ULL : (1ULL << size) - 1;
+  uint64_t elem = val & mask;
+  for (int r = 0; r < size; r++) {
+    uint64_t rot = r ? ((elem >> r) | (elem << (size - r))) & mask : elem;
+    if ((rot & (rot + 1)) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Load an arbitrary 64-bit value to a register without using a
+// literal pool. A value that fits in a single movz, movn or orr is
+// loaded by one mov, which the assembler encodes as one of them.
+// Otherwise, the value is built 16 bits at a time starting with movz,
+// or with movn if most of the 16-bit chunks are 0xffff.
+static void gen_mov_imm(char *reg, int64_t val) {
+  uint64_t v = val;
+  int zeros = 0;
+  int ones = 0;
+  for (int i = 0; i < 64; i += 16) {
+    zeros += ((v >> i) & 0xffff) == 0;
+    ones += ((v >> i) & 0xffff) == 0xffff;
+  }
+
+  if (zeros >= 3 || ones >= 3) {
+    println("  mov %s, #%ld", reg, val);
+    return;
+  }
+
+  if (is_logical_imm(v)) {
+    println("  mov %s, #0x%lx", reg, v);
+    return;
+  }
+
+  bool inverted = (ones > zeros);
+  uint64_t skip = inverted ? 0xffff : 0;
+  bool first = true;
+
+  for (int i = 0; i < 64; i += 16) {
+    uint64_t chunk = (v >> i) & 0xffff;
+    if (chunk == skip)
+      continue;
+
+    char *op = first ? (inverted ? "movn" : "movz") : "movk";
+    if (first && inverted)
+      chunk = ~chunk & 0xffff;
+
+    if (i == 0)
+      println("  %s %s, #%lu", op, reg, chunk);
+    else
+      println("  %s %s, #%lu, lsl #%d", op, reg, chunk, i);
+    first = false;
+  }
+}
+
+// Emit `dst = src + val` for an arbitrary 24-bit value. add and sub
+// take only a 12-bit immediate optionally shifted left by 12 bits.
+static void gen_add_imm(char *dst, char *src, int64_t val) {
+  char *op = (val < 0) ? "sub" : "add";
+  int64_t abs = (val < 0) ? -val : val;
+  assert(abs < (1 << 24));
+
+  if (abs < 4096) {
+    println("  %s %s, %s, #%ld", op, dst, src, abs);
+    return;
+  }
+
+  println("  %s %s, %s, #%ld, lsl #12", op, dst, src, abs >> 12);
+  if (abs & 4095)
+    println("  %s %s, %s, #%ld", op, dst, dst, abs & 4095);
+}
+
+// Returns true if ldr and str can take a given offset. The offset is
+// either a 9-bit signed value or a 12-bit unsigned value scaled by the
+// access size.
+static bool is_mem_offset(int64_t off, int size) {
+  if (-256 <= off && off <= 255)
+    return true;
+  return off >= 0 && off % size == 0 && off / size < 4096;
+}
+
+// Returns k if val is 2^k, or -1 otherwise.
+static int log2_of(uint64_t val) {
+  if (val == 0 || (val & (val - 1)))
+    return -1;
+  return __builtin_ctzll(val);
+}
+
+// Returns true if multiplication by `val` needs no mul, which is
+// the case for the multipliers handled by gen_mul_imm() below.
+bool is_cheap_mul(int64_t val) {
+  if (val == 0 || val == 1 || log2_of(val) > 0)
+    return true;
+  if (val < 0 && (log2_of(-(uint64_t)val) >= 0 || log2_of(1 - (uint64_t)val) >= 0))
+    return true;
+  return val > 0 && log2_of(((uint64_t)val >> __builtin_ctzll(val)) - 1) > 0;
+}
+
+// Emit `xd = xa * val`. Multiplication by a power of two is a shift,
+// and by 2^j+1 or -(2^j-1), possibly followed by a shift, is an add or
+// a sub with a shifted operand. `tmp` must differ from `a`.
+static void gen_mul_imm(int d, int a, int64_t val, int tmp) {
+  int k = log2_of(val);
+
+  if (val == 0) {
+    println("  mov x%d, xzr", d);
+  } else if (val == 1) {
+    if (d != a)
+      println("  mov x%d, x%d", d, a);
+  } else if (k > 0) {
+    println("  lsl x%d, x%d, #%d", d, a, k);
+  } else if (val < 0 && (k = log2_of(-(uint64_t)val)) >= 0) {
+    println("  neg x%d, x%d, lsl #%d", d, a, k);
+  } else if (val < 0 && (k = log2_of(1 - (uint64_t)val)) >= 0) {
+    println("  sub x%d, x%d, x%d, lsl #%d", d, a, a, k);
+  } else {
+    int shift = __builtin_ctzll(val);
+    int j = log2_of(((uint64_t)val >> shift) - 1);
+    if (val > 0 && j > 0) {
+      println("  add x%d, x%d, x%d, lsl #%d", d, a, a, j);
+      if (shift)
+        println("  lsl x%d, x%d, #%d", d, d, shift);
+      return;
+    }
+
+    gen_mov_imm(format("x%d", tmp), val);
+    println("  mul x%d, x%d, x%d", d, a, tmp);
+  }
+}
+
+// Compute a magic number and a shift amount with which division by
+// `div` becomes multiplication. See Hacker's Delight, 10-1.
+static void signed_magic(int64_t div, int64_t *magic, int *shift) {
+  uint64_t two63 = 1ULL << 63;
+  uint64_t ad = (div < 0) ? -(uint64_t)div : div;
+  uint64_t t = two63 + ((uint64_t)div >> 63);
+  uint64_t anc = t - 1 - t % ad;
+  uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+  uint64_t delta;
+  int p = 63;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *magic = q2 + 1;
+  if (div < 0)
+    *magic = -*magic;
+  *shift = p - 64;
+}
+
+// Emit `xd = xa / val` for signed division. Division by a power of
+// two is an arithmetic shift, which rounds toward negative infinity,
+// so 2^k-1 is added to a negative dividend first. That is unnecessary
+// if the division is known to be exact. Division by other constants
+// is multiplication by a magic number. `tmp` must differ from `a`.
+static void gen_div_imm(int d, int a, int64_t val, int tmp, bool exact) {
+  if (val == 1) {
+    if (d != a)
+      println("  mov x%d, x%d", d, a);
+    return;
+  }
+  if (val == -1) {
+    println("  neg x%d, x%d", d, a);
+    return;
+  }
+  if (val == INT64_MIN) {
+    gen_mov_imm(format("x%d", tmp), val);
+    println("  sdiv x%d, x%d, x%d", d, a, tmp);
+    return;
+  }
+
+  int k = log2_of((val < 0) ? -val : val);
+  if (k > 0) {
+    if (exact) {
+      println("  asr x%d, x%d, #%d", d, a, k);
+    } else {
+      println("  asr x%d, x%d, #63", tmp, a);
+      println("  add x%d, x%d, x%d, lsr #%d", tmp, a, tmp, 64 - k);
+      println("  asr x%d, x%d, #%d", d, tmp, k);
+    }
+    if (val < 0)
+      println("  neg x%d, x%d", d, d);
+    return;
+  }
+
+  int64_t magic;
+  int shift;
+  signed_magic(val, &magic, &shift);
+
+  gen_mov_imm(format("x%d", tmp), magic);
+  println("  smulh x%d, x%d, x%d", tmp, a, tmp);
+  if (val > 0 && magic < 0)
+    println("  add x%d, x%d, x%d", tmp, tmp, a);
+  if (val < 0 && magic > 0)
+    println("  sub x%d, x%d, x%d", tmp, tmp, a);
+  if (shift)
+    println("  asr x%d, x%d, #%d", tmp, tmp, shift);
+  println("  add x%d, x%d, x%d, lsr #63", d, tmp, tmp);
+}
+
 // Round up `n` to the nearest multiple of `align`. For instance,
 // align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
 int align_to(int n, int align) {
@@ -45,7 +330,7 @@ static void gen_addr(Node *node) {
   case ND_VAR:
     if (node->var->is_local) {
       // Local variable
-      println("  add x0, x29, %d", node->var->offset);
+      gen_add_imm("x0", "x29", node->var->offset);
     } else {
       // Global variable
       println("  adrp x0, %s", node->var->name);
@@ -90,15 +375,84 @@ static void load(Type *ty) {
     println("  ldr x0, [x0]");
 }
 
+// Copy `size` bytes from [x<src>] to [x<dst>, #off] with unrolled
+// loads and stores, widest first. Each chunk is no wider than the
+// preceding ones, so every offset is a multiple of the chunk size and
+// fits in the scaled offset field of ldr, str, ldp and stp.
+// Aggregates may not be aligned to the chunk size, but AArch64 allows
+// unaligned access to normal memory.
+static void copy_chunks(int dst, int src, int off, int size) {
+  for (; off + 32 <= size; off += 32) {
+    println("  ldp q0, q1, [x%d, #%d]", src, off);
+    println("  stp q0, q1, [x%d, #%d]", dst, off);
+  }
+  for (; off + 16 <= size; off += 16) {
+    println("  ldp x2, x3, [x%d, #%d]", src, off);
+    println("  stp x2, x3, [x%d, #%d]", dst, off);
+  }
+  for (; off + 8 <= size; off += 8) {
+    println("  ldr x2, [x%d, #%d]", src, off);
+    println("  str x2, [x%d, #%d]", dst, off);
+  }
+  for (; off + 4 <= size; off += 4) {
+    println("  ldr w2, [x%d, #%d]", src, off);
+    println("  str w2, [x%d, #%d]", dst, off);
+  }
+  for (; off + 2 <= size; off += 2) {
+    println("  ldrh w2, [x%d, #%d]", src, off);
+    println("  strh w2, [x%d, #%d]", dst, off);
+  }
+  for (; off < size; off++) {
+    println("  ldrb w2, [x%d, #%d]", src, off);
+    println("  strb w2, [x%d, #%d]", dst, off);
+  }
+}
+
+// Copy a struct or a union of `size` bytes from [x<src>] to
+// [x<dst>]. Up to 64 bytes are copied with straight-line code, and a
+// larger object with a loop moving 32 bytes per iteration followed
+// by the remainder. Objects larger than opt_memcpy_threshold are
+// copied by memcpy, which the caller has to call itself because of
+// the registers it clobbers. x2-x7, q0 and q1 are used as scratch
+// registers.
+static void gen_copy(int dst, int src, int size) {
+  if (size <= 64) {
+    copy_chunks(dst, src, 0, size);
+    return;
+  }
+
+  int c = count();
+  println("  mov x3, x%d", src);
+  println("  mov x4, x%d", dst);
+  gen_mov_imm("x5", size / 32);
+  println(".L.copy.%d:", c);
+  println("  ldp q0, q1, [x3], #32");
+  println("  stp q0, q1, [x4], #32");
+  println("  subs x5, x5, #1");
+  println("  b.ne .L.copy.%d", c);
+  copy_chunks(4, 3, 0, size % 32);
+}
+
 // Store %rax to an address that the stack top is pointing to.
 static void store(Type *ty) {
   pop("x1");
 
   if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    for (int i = 0; i < ty->size; i++) {
-      println("  ldrb w2, [x0, #%d]", i);
-      println("  strb w2, [x1, #%d]", i);
+    if (ty->size <= opt_memcpy_threshold) {
+      gen_copy(1, 0, ty->size);
+      return;
     }
+
+    // memcpy(x1, x0, size). sp has to be 16-byte aligned at a call.
+    println("  mov x2, x0");
+    println("  mov x0, x1");
+    println("  mov x1, x2");
+    gen_mov_imm("x2", ty->size);
+    if (depth % 2)
+      println("  sub sp, sp, #8");
+    println("  bl memcpy");
+    if (depth % 2)
+      println("  add sp, sp, #8");
     return;
   }
 
@@ -112,13 +466,66 @@ static void store(Type *ty) {
     println("  str x0, [x1]");
 }
 
+// Evaluate the operands of a binary operator to x0 and the returned
+// operand. A small constant on the right-hand side of add, sub or a
+// comparison becomes an immediate operand.
+static char *gen_operands(Node *node) {
+  if (node->rhs->kind == ND_NUM && is_add_imm(node->rhs->val) &&
+      node->kind != ND_MUL && node->kind != ND_DIV) {
+    gen_expr(node->lhs);
+    return format("#%ld", node->rhs->val);
+  }
+
+  gen_expr(node->rhs);
+  push();
+  gen_expr(node->lhs);
+  pop("x1");
+  return "x1";
+}
+
+// Returns true if an argument is a constant or a local scalar
+// variable, which can be loaded to an argument register without
+// touching other registers.
+static bool is_simple_arg(Node *node) {
+  if (node->kind == ND_NUM)
+    return true;
+  if (node->kind != ND_VAR || !node->var->is_local)
+    return false;
+  TypeKind kind = node->ty->kind;
+  return kind != TY_ARRAY && kind != TY_STRUCT && kind != TY_UNION;
+}
+
+static void gen_simple_arg(Node *node, int r) {
+  if (node->kind == ND_NUM) {
+    gen_mov_imm(argreg64[r], node->val);
+    return;
+  }
+
+  int size = node->ty->size;
+  int off = node->var->offset;
+  char *addr = format("[x29, #%d]", off);
+  if (!is_mem_offset(off, size)) {
+    gen_add_imm(argreg64[r], "x29", off);
+    addr = format("[%s]", argreg64[r]);
+  }
+
+  if (size == 1)
+    println("  ldrb %s, %s", argreg8[r], addr);
+  else if (size == 2)
+    println("  ldrh %s, %s", argreg8[r], addr);
+  else if (size == 4)
+    println("  ldr %s, %s", argreg8[r], addr);
+  else
+    println("  ldr %s, %s", argreg64[r], addr);
+}
+
 // Generate code for a given node.
 static void gen_expr(Node *node) {
   println("  .loc 1 %d", node->tok->line_no);
 
   switch (node->kind) {
   case ND_NUM:
-    println("  ldr x0, =%ld", node->val);
+    gen_mov_imm("x0", node->val);
     return;
   case ND_NEG:
     gen_expr(node->lhs);
@@ -150,33 +557,39 @@ static void gen_expr(Node *node) {
     gen_expr(node->lhs);
     gen_expr(node->rhs);
     return;
-  case ND_FUNCALL: {
-    int nargs = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen_expr(arg);
-      push();
-      nargs++;
+  case ND_MUL:
+  case ND_DIV:
+    // Multiplication and division by a constant do not need mul or
+    // sdiv in most cases.
+    if (node->rhs->kind == ND_NUM && node->rhs->val != 0) {
+      gen_expr(node->lhs);
+      if (node->kind == ND_MUL)
+        gen_mul_imm(0, 0, node->rhs->val, 1);
+      else
+        gen_div_imm(0, 0, node->rhs->val, 1, node->exact);
+      return;
     }
-
-    for (int i = nargs - 1; i >= 0; i--)
-      pop(argreg64[i]);
-
+    break;
+  case ND_FUNCALL: {
+    int nslots = gen_args(node);
     println("  bl %s", node->funcname);
+
+    if (nslots) {
+      gen_add_imm("sp", "sp", nslots * 8);
+      depth -= nslots;
+    }
     return;
   }
   }
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("x1");
+  char *rhs = gen_operands(node);
 
   switch (node->kind) {
   case ND_ADD:
-    println("  add x0, x0, x1");
+    println("  add x0, x0, %s", rhs);
     return;
   case ND_SUB:
-    println("  sub x0, x0, x1");
+    println("  sub x0, x0, %s", rhs);
     return;
   case ND_MUL:
     println("  mul x0, x0, x1");
@@ -188,7 +601,7 @@ static void gen_expr(Node *node) {
   case ND_NE:
   case ND_LT:
   case ND_LE:
-    println("  cmp x0, x1");
+    println("  cmp x0, %s", rhs);
 
     if (node->kind == ND_EQ)
       println("  cset x0, eq");
@@ -205,14 +618,202 @@ static void gen_expr(Node *node) {
   error_tok(node->tok, "invalid expression");
 }
 
+// Evaluate the arguments of a function call to x0-x7 and the stack.
+// Returns the number of stack slots reserved for them.
+static int gen_args(Node *node) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+
+  Node **args = calloc(nargs, sizeof(Node *));
+  nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[nargs++] = arg;
+
+  // Arguments beyond the eighth are passed on the stack. Their area
+  // is reserved first, with padding to keep sp 16-byte aligned at
+  // the call.
+  int nstack = (nargs > 8) ? nargs - 8 : 0;
+  int nslots = nstack + (depth + nstack) % 2;
+  if (nslots) {
+    gen_add_imm("sp", "sp", -nslots * 8);
+    depth += nslots;
+  }
+
+  for (int i = 8; i < nargs; i++) {
+    gen_expr(args[i]);
+    println("  str x0, [sp, #%d]", (i - 8) * 8);
+  }
+
+  // Register arguments that take code to evaluate are computed
+  // first. All but the last one are pushed and popped, and the rest
+  // are loaded directly to their registers.
+  int nregs = (nargs < 8) ? nargs : 8;
+  int last = -1;
+  for (int i = 0; i < nregs; i++)
+    if (!is_simple_arg(args[i]))
+      last = i;
+
+  for (int i = 0; i < last; i++) {
+    if (!is_simple_arg(args[i])) {
+      gen_expr(args[i]);
+      push();
+    }
+  }
+
+  if (last >= 0) {
+    gen_expr(args[last]);
+    if (last != 0)
+      println("  mov %s, x0", argreg64[last]);
+  }
+
+  for (int i = last - 1; i >= 0; i--)
+    if (!is_simple_arg(args[i]))
+      pop(argreg64[i]);
+
+  for (int i = 0; i < nregs; i++)
+    if (is_simple_arg(args[i]))
+      gen_simple_arg(args[i], i);
+
+  return nslots;
+}
+
+static bool is_zero(Node *node) {
+  return node->kind == ND_NUM && node->val == 0;
+}
+
+// Jump to `label` if `cond` is false. A comparison sets the flags and
+// is followed by a conditional branch rather than being turned into 0
+// or 1 first. A comparison against zero becomes cbz, cbnz or a test
+// of the sign bit.
+static void gen_branch_if_false(Node *cond, char *label) {
+  if (cond->kind == ND_EQ || cond->kind == ND_NE || cond->kind == ND_LT ||
+      cond->kind == ND_LE) {
+    println("  .loc 1 %d", cond->tok->line_no);
+
+    if (cond->kind == ND_EQ && is_zero(cond->rhs)) {
+      gen_expr(cond->lhs);
+      println("  cbnz x0, %s", label);
+      return;
+    }
+    if (cond->kind == ND_NE && is_zero(cond->rhs)) {
+      gen_expr(cond->lhs);
+      println("  cbz x0, %s", label);
+      return;
+    }
+    if (cond->kind == ND_LT && is_zero(cond->rhs)) {
+      gen_expr(cond->lhs);
+      println("  tbz x0, #63, %s", label);
+      return;
+    }
+    if (cond->kind == ND_LE && is_zero(cond->lhs)) {
+      gen_expr(cond->rhs);
+      println("  tbnz x0, #63, %s", label);
+      return;
+    }
+
+    char *rhs = gen_operands(cond);
+    println("  cmp x0, %s", rhs);
+    if (cond->kind == ND_EQ)
+      println("  b.ne %s", label);
+    else if (cond->kind == ND_NE)
+      println("  b.eq %s", label);
+    else if (cond->kind == ND_LT)
+      println("  b.ge %s", label);
+    else
+      println("  b.gt %s", label);
+    return;
+  }
+
+  gen_expr(cond);
+  println("  cbz x0, %s", label);
+}
+
+//
+// Sibling calls
+//
+// A call whose value is returned right away can reuse the frame of the
+// caller: the caller's epilogue runs first, and the callee returns
+// directly to the caller's caller. Tail recursion then runs in
+// constant stack space. This is done only if the arguments fit in
+// registers and no pointer into the caller's frame may exist, because
+// the frame is gone by the time the callee runs.
+//
+
+static bool sibling_calls;
+
+// Returns the local variable that a given lvalue is in, or NULL if it
+// is not in the frame of the current function.
+static Obj *local_lvalue(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    return node->var->is_local ? node->var : NULL;
+  case ND_COMMA:
+    return local_lvalue(node->rhs);
+  case ND_MEMBER:
+    return local_lvalue(node->lhs);
+  case ND_DEREF:
+    // An element of a local array
+    for (Node *n = node->lhs;; n = n->lhs) {
+      if (n->ty->kind == TY_ARRAY)
+        return local_lvalue(n);
+      if (n->kind != ND_ADD && n->kind != ND_SUB)
+        return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Returns true if the address of a local variable, or of a part of
+// one, is taken anywhere in a given tree.
+bool takes_local_addr(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_ADDR && local_lvalue(node->lhs))
+    return true;
+
+  if (takes_local_addr(node->lhs) || takes_local_addr(node->rhs) ||
+      takes_local_addr(node->cond) || takes_local_addr(node->then) ||
+      takes_local_addr(node->els) || takes_local_addr(node->init) ||
+      takes_local_addr(node->inc))
+    return true;
+  for (Node *n = node->body; n; n = n->next)
+    if (takes_local_addr(n))
+      return true;
+  for (Node *n = node->args; n; n = n->next)
+    if (takes_local_addr(n))
+      return true;
+  return false;
+}
+
+// Returns true if a pointer into the frame of a given function may be
+// computed. An array decays to a pointer without ND_ADDR, so a local
+// array or struct counts as well.
+static bool frame_escapes(Obj *fn) {
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->ty->kind == TY_ARRAY || var->ty->kind == TY_STRUCT ||
+        var->ty->kind == TY_UNION)
+      return true;
+  return takes_local_addr(fn->body);
+}
+
+static bool is_sibling_call(Node *node) {
+  if (!sibling_calls || node->kind != ND_FUNCALL || depth != 0)
+    return false;
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  return nargs <= 8;
+}
+
 static void gen_stmt(Node *node) {
   println("  .loc 1 %d", node->tok->line_no);
 
   switch (node->kind) {
   case ND_IF: {
     int c = count();
-    gen_expr(node->cond);
-    println("  cbz x0, .L.else.%d", c);
+    gen_branch_if_false(node->cond, format(".L.else.%d", c));
     gen_stmt(node->then);
     println("  b .L.end.%d", c);
     println(".L.else.%d:", c);
@@ -226,10 +827,8 @@ static void gen_stmt(Node *node) {
     if (node->init)
       gen_stmt(node->init);
     println(".L.begin.%d:", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      println("  cbz x0, .L.end.%d", c);
-    }
+    if (node->cond)
+      gen_branch_if_false(node->cond, format(".L.end.%d", c));
     gen_stmt(node->then);
     if (node->inc)
       gen_expr(node->inc);
@@ -242,6 +841,12 @@ static void gen_stmt(Node *node) {
       gen_stmt(n);
     return;
   case ND_RETURN:
+    if (is_sibling_call(node->lhs)) {
+      gen_args(node->lhs);
+      gen_epilogue();
+      println("  b %s", node->lhs->funcname);
+      return;
+    }
     gen_expr(node->lhs);
     println("  b .L.return.%s", current_fn->name);
     return;
@@ -253,29 +858,268 @@ static void gen_stmt(Node *node) {
   error_tok(node->tok, "invalid statement");
 }
 
+// Returns true if code generated for a given node calls a function.
+static bool has_call(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_FUNCALL)
+    return true;
+
+  // A large struct is copied by memcpy.
+  if (node->kind == ND_ASSIGN && node->ty->size > opt_memcpy_threshold &&
+      (node->ty->kind == TY_STRUCT || node->ty->kind == TY_UNION))
+    return true;
+
+  if (has_call(node->lhs) || has_call(node->rhs) || has_call(node->cond) ||
+      has_call(node->then) || has_call(node->els) || has_call(node->init) ||
+      has_call(node->inc))
+    return true;
+  for (Node *n = node->body; n; n = n->next)
+    if (has_call(n))
+      return true;
+  return false;
+}
+
+//
+// Frame layout
+//
+// Blocks that are not nested in each other are never active at the
+// same time, so their variables share stack space: the variables of a
+// block are placed below those of the enclosing blocks, and sibling
+// blocks start at the same offset. Within a block, variables are
+// sorted by alignment to avoid padding. A block in which the address
+// of a variable is taken keeps declaration order instead, because
+// code may step from that variable to its neighbors by pointer
+// arithmetic.
+//
+
+// The variables that need stack slots, sorted by the block that
+// declares them. The variables of a block stay in the order of
+// fn->locals.
+static Obj **layout_vars;
+static bool *layout_in_tree;
+static int layout_nvars;
+
+// All local variables of the function, sorted by address
+static Obj **layout_members;
+static int layout_nmembers;
+
+static int cmp_block(const void *a, const void *b) {
+  Obj *x = *(Obj **)a;
+  Obj *y = *(Obj **)b;
+  if (x->block != y->block)
+    return (uintptr_t)x->block < (uintptr_t)y->block ? -1 : 1;
+
+  // Until a variable is placed, its offset is its position in
+  // fn->locals.
+  return x->offset - y->offset;
+}
+
+static int cmp_addr(const void *a, const void *b) {
+  Obj *x = *(Obj **)a;
+  Obj *y = *(Obj **)b;
+  if (x == y)
+    return 0;
+  return (uintptr_t)x < (uintptr_t)y ? -1 : 1;
+}
+
+// Returns the index of the first variable of a given block in
+// layout_vars, and sets `end` to the index after its last one.
+static int find_vars(Node *block, int *end) {
+  int lo = 0, hi = layout_nvars;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((uintptr_t)layout_vars[mid]->block < (uintptr_t)block)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *end = lo;
+  while (*end < layout_nvars && layout_vars[*end]->block == block)
+    (*end)++;
+  return lo;
+}
+
+// Find the blocks that are in the function and mark the variables
+// whose addresses are taken. A variable that is referenced but not in
+// the function would have no slot, so that is reported here rather
+// than left to overwrite the frame record.
+static void check_vars(Node *node) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_BLOCK || node->kind == ND_STMT_EXPR) {
+    int end;
+    for (int i = find_vars(node, &end); i < end; i++)
+      layout_in_tree[i] = true;
+  }
+
+  if (node->kind == ND_VAR && node->var->is_local && !node->var->reg &&
+      !bsearch(&node->var, layout_members, layout_nmembers, sizeof(Obj *),
+               cmp_addr))
+    unreachable();
+
+  if (node->kind == ND_ADDR) {
+    Obj *var = local_lvalue(node->lhs);
+    if (var)
+      var->addr_taken = true;
+  }
+
+  check_vars(node->lhs);
+  check_vars(node->rhs);
+  check_vars(node->cond);
+  check_vars(node->then);
+  check_vars(node->els);
+  check_vars(node->init);
+  check_vars(node->inc);
+  for (Node *n = node->body; n; n = n->next)
+    check_vars(n);
+  for (Node *n = node->args; n; n = n->next)
+    check_vars(n);
+}
+
+static int place_var(Obj *var, int offset) {
+  offset += var->ty->size;
+  offset = align_to(offset, var->ty->align);
+  var->offset = -offset;
+  return offset;
+}
+
+// Assign offsets below `offset` to the `n` variables from `vars` and
+// return the new bottom of the frame.
+static int place_vars(Obj **vars, int n, int offset) {
+  bool keep_order = false;
+  int max_align = 1;
+  for (int i = 0; i < n; i++) {
+    keep_order |= vars[i]->addr_taken;
+    if (max_align < vars[i]->ty->align)
+      max_align = vars[i]->ty->align;
+  }
+
+  if (keep_order) {
+    for (int i = 0; i < n; i++)
+      offset = place_var(vars[i], offset);
+    return offset;
+  }
+
+  // Alignments are powers of two. Variables of equal alignment stay
+  // in order.
+  for (int align = max_align; align; align /= 2)
+    for (int i = 0; i < n; i++)
+      if (vars[i]->ty->align == align)
+        offset = place_var(vars[i], offset);
+  return offset;
+}
+
+static int place_block(Node *block, int offset);
+
+// Lay out the outermost blocks nested in a given node, and return the
+// bottom of the deepest one.
+static int place_nested(Node *node, int offset) {
+  if (!node)
+    return offset;
+  if (node->kind == ND_BLOCK || node->kind == ND_STMT_EXPR)
+    return place_block(node, offset);
+
+  Node *kids[] = {node->lhs, node->rhs, node->cond, node->then,
+                  node->els, node->init, node->inc};
+  int bottom = offset;
+  for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+    int o = place_nested(kids[i], offset);
+    if (bottom < o)
+      bottom = o;
+  }
+  for (Node *n = node->args; n; n = n->next) {
+    int o = place_nested(n, offset);
+    if (bottom < o)
+      bottom = o;
+  }
+  return bottom;
+}
+
+static int place_block(Node *block, int offset) {
+  int end;
+  int start = find_vars(block, &end);
+  offset = place_vars(layout_vars + start, end - start, offset);
+
+  // The statements of a block run one after another, so the blocks
+  // nested in them can share space.
+  int bottom = offset;
+  for (Node *n = block->body; n; n = n->next) {
+    int o = place_nested(n, offset);
+    if (bottom < o)
+      bottom = o;
+  }
+  return bottom;
+}
+
 // Assign offsets to local variables.
 static void assign_lvar_offsets(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function)
+    if (!fn->is_function || !fn->is_definition)
       continue;
 
+    // Parameters beyond the eighth are passed on the stack above the
+    // frame record, so they don't need slots of their own. They are
+    // at the end of the list of local variables.
+    Obj *stack_params = fn->params;
+    for (int i = 0; i < 8 && stack_params; i++)
+      stack_params = stack_params->next;
+
+    int i = 0;
+    for (Obj *var = stack_params; var; var = var->next)
+      var->offset = 16 + i++ * 8;
+
+    layout_nmembers = 0;
+    for (Obj *var = fn->locals; var; var = var->next)
+      layout_nmembers++;
+    layout_members = calloc(layout_nmembers, sizeof(Obj *));
+    layout_vars = calloc(layout_nmembers, sizeof(Obj *));
+    layout_in_tree = calloc(layout_nmembers, sizeof(bool));
+
+    i = 0;
+    for (Obj *var = fn->locals; var; var = var->next)
+      layout_members[i++] = var;
+    qsort(layout_members, layout_nmembers, sizeof(Obj *), cmp_addr);
+
+    layout_nvars = 0;
+    for (Obj *var = fn->locals; var != stack_params; var = var->next) {
+      if (var->reg)
+        continue;
+      var->offset = layout_nvars;
+      layout_vars[layout_nvars++] = var;
+    }
+    qsort(layout_vars, layout_nvars, sizeof(Obj *), cmp_block);
+
+    check_vars(fn->body);
+
+    // The parameters come first. A variable whose block is no longer
+    // in the function, because the block has been copied or replaced,
+    // is placed with them.
     int offset = 0;
-    for (Obj *var = fn->locals; var; var = var->next) {
-      offset += var->ty->size;
-      offset = align_to(offset, var->ty->align);
-      var->offset = -offset;
+    for (int i = 0, end; i < layout_nvars; i = end) {
+      end = i + 1;
+      while (end < layout_nvars &&
+             layout_vars[end]->block == layout_vars[i]->block)
+        end++;
+      if (!layout_in_tree[i])
+        offset = place_vars(layout_vars + i, end - i, offset);
     }
+    offset = place_block(fn->body, offset);
+
     fn->stack_size = align_to(offset, 16);
   }
 }
 
 static void emit_data(Obj *prog) {
   for (Obj *var = prog; var; var = var->next) {
-    if (var->is_function)
+    if (var->is_function || (var->is_static && !var->is_live))
       continue;
  
     println("  .data");
-    println("  .globl %s", var->name);
+    if (!var->is_static)
+      println("  .globl %s", var->name);
     println("%s:", var->name);
 
     if (var->init_data) {
@@ -287,43 +1131,776 @@ static void emit_data(Obj *prog) {
   }
 }
 
+// Local variables are at fixed offsets from x29, or from sp plus
+// frame_bias if the frame pointer is omitted.
+static char *frame_reg = "x29";
+static int frame_bias;
+
+// The frame of the current function has frame_size bytes below the
+// frame record, which is saved if save_fp is true. Callee-saved
+// registers are saved above the spill slots.
+static int frame_size;
+static bool save_fp;
+static bool omit_fp;
+static int saved[10];
+static int nsaved;
+
 static void store_gp(int r, int offset, int sz) {
   switch (sz) {
   case 1:
-    println("  strb %s, [x29, #%d]", argreg8[r], offset);
+    println("  strb %s, [%s, #%d]", argreg8[r], frame_reg, offset + frame_bias);
     return;
   case 2:
-    println("  strh %s, [x29, #%d]", argreg8[r], offset);
+    println("  strh %s, [%s, #%d]", argreg8[r], frame_reg, offset + frame_bias);
     return;
   case 4:
-    println("  str %s, [x29, #%d]", argreg8[r], offset);
+    println("  str %s, [%s, #%d]", argreg8[r], frame_reg, offset + frame_bias);
     return;
   case 8:
-    println("  str %s, [x29, #%d]", argreg64[r], offset);
+    println("  str %s, [%s, #%d]", argreg64[r], frame_reg, offset + frame_bias);
     return;
   }
   unreachable();
 }
 
+// Save parameters passed in registers to their stack slots, except
+// those promoted to registers. Neighboring slots of the same size are
+// written by one stp.
+static void store_params(Obj *fn) {
+  int i = 0;
+  for (Obj *var = fn->params; var && i < 8; var = var->next, i++) {
+    if (var->reg)
+      continue;
+
+    Obj *next = var->next;
+    int sz = var->ty->size;
+    if (i < 7 && next && !next->reg && next->ty->size == sz &&
+        (sz == 4 || sz == 8) && next->offset + sz == var->offset) {
+      int off = frame_bias + next->offset;
+      if (off % sz == 0 && -64 * sz <= off && off < 64 * sz) {
+        char **regs = (sz == 8) ? argreg64 : argreg8;
+        println("  stp %s, %s, [%s, #%d]", regs[i + 1], regs[i], frame_reg, off);
+        var = next;
+        i++;
+        continue;
+      }
+    }
+
+    store_gp(i, var->offset, sz);
+  }
+}
+
+//
+// Code generation from IR
+//
+// Virtual registers are mapped to machine registers by regalloc.c.
+// A spilled value lives in a stack slot at sp+8*slot and is loaded to
+// x16 or x17 when it is used. A result that belongs in a stack slot is
+// computed in x16 and then stored.
+//
+
+static int last_line_no;
+
+// Spill slots start at this offset from sp.
+static int spill_base;
+
+// Returns the address of a given stack slot. ldr and str take an
+// offset of up to 32760, so `tmp` is used to compute an address
+// beyond that.
+static char *slot_addr(int slot, int tmp) {
+  int off = spill_base + slot * 8;
+  if (off <= 32760)
+    return format("[sp, #%d]", off);
+  gen_add_imm(format("x%d", tmp), "sp", off);
+  return format("[x%d]", tmp);
+}
+
+static void gen_epilogue(void) {
+  for (int i = 0; i < nsaved; i++)
+    println("  ldr x%d, %s", saved[i], slot_addr(current_fn->nspills + i, 16));
+  if (save_fp && !omit_fp)
+    println("  mov sp, x29");
+  else if (frame_size)
+    gen_add_imm("sp", "sp", frame_size);
+  if (save_fp)
+    println("  ldp x29, x30, [sp], #16");
+}
+
+// Returns true if a given call is followed by a return of its value
+// and can be made a sibling call.
+static bool is_sibling_call_ir(Ir *ir) {
+  return sibling_calls && ir->kind == IR_CALL && ir->nargs <= 8 &&
+         ir->next && ir->next->kind == IR_RET && ir->next->a == ir->d;
+}
+
+// Returns the register holding a given value. A spilled value is
+// loaded to `tmp` first.
+static int use_reg(Reg *r, int tmp) {
+  if (r->rn >= 0)
+    return r->rn;
+  println("  ldr x%d, %s", tmp, slot_addr(r->slot, tmp));
+  return tmp;
+}
+
+// Returns the register to which a result should be written.
+static int def_reg(Reg *r) {
+  return (r->rn >= 0) ? r->rn : 16;
+}
+
+// Write back a result if it belongs in a stack slot.
+static void finish_def(Reg *r) {
+  if (r->rn < 0)
+    println("  str x16, %s", slot_addr(r->slot, 17));
+}
+
+// Returns the memory operand of a load or a store. A base register
+// updated by the access is loaded to x17 if spilled and written back
+// by finish_writeback().
+static char *mem_operand(Ir *ir) {
+  if (ir->var) {
+    int64_t off = frame_bias + ir->var->offset + ir->imm;
+    if (is_mem_offset(off, ir->size))
+      return format("[%s, #%ld]", frame_reg, off);
+    gen_add_imm("x16", frame_reg, off);
+    return "[x16]";
+  }
+
+  if (ir->pre_index)
+    return format("[x%d, #%ld]!", use_reg(ir->a, 17), ir->imm);
+  if (ir->post_index)
+    return format("[x%d], #%ld", use_reg(ir->a, 17), ir->imm);
+
+  int base = use_reg(ir->a, 16);
+
+  if (ir->index) {
+    int index = use_reg(ir->index, 17);
+    if (ir->shift)
+      return format("[x%d, x%d, lsl #%d]", base, index, ir->shift);
+    return format("[x%d, x%d]", base, index);
+  }
+
+  if (ir->imm == 0)
+    return format("[x%d]", base);
+  if (is_mem_offset(ir->imm, ir->size))
+    return format("[x%d, #%ld]", base, ir->imm);
+  gen_add_imm("x16", format("x%d", base), ir->imm);
+  return "[x16]";
+}
+
+// Returns the memory operand of a vector load or a store. ld1 and
+// st1 take only a base register, which may be incremented after the
+// access.
+static char *vec_mem_operand(Ir *ir) {
+  if (ir->post_index)
+    return format("[x%d], #%ld", use_reg(ir->a, 17), ir->imm);
+  if (ir->var || ir->index || ir->pre_index || ir->imm)
+    unreachable();
+  return format("[x%d]", use_reg(ir->a, 16));
+}
+
+// Returns the arrangement of a vector with lanes of `size` bytes.
+static char *lanes(int size) {
+  switch (size) {
+  case 1: return "16b";
+  case 2: return "8h";
+  case 4: return "4s";
+  }
+  return "2d";
+}
+
+static void finish_writeback(Ir *ir) {
+  if ((ir->pre_index || ir->post_index) && ir->a->rn < 0)
+    println("  str x17, %s", slot_addr(ir->a->slot, 8));
+}
+
+static char *cond_name(IrKind kind) {
+  switch (kind) {
+  case IR_EQ: return "eq";
+  case IR_NE: return "ne";
+  case IR_LT: return "lt";
+  case IR_LE: return "le";
+  }
+  unreachable();
+}
+
+static char *inverse_cond(IrKind kind) {
+  switch (kind) {
+  case IR_EQ: return "ne";
+  case IR_NE: return "eq";
+  case IR_LT: return "ge";
+  case IR_LE: return "gt";
+  }
+  unreachable();
+}
+
+// A comparison whose result is only tested by the branch that follows
+// it is not materialized. It is held here until the branch is emitted.
+static Ir *fused_cmp;
+
+static bool is_live_out(BB *bb, Reg *r) {
+  return bb->live_out[r->vn / 64] & (1ULL << (r->vn % 64));
+}
+
+static bool reads_reg(Ir *ir, Reg *r) {
+  Reg **ops[MAX_OPERANDS];
+  int nops = get_operands(ir, ops);
+  for (int i = 0; i < nops; i++)
+    if (*ops[i] == r)
+      return true;
+  return false;
+}
+
+static bool is_fusible(Ir *ir, BB *bb) {
+  Ir *next = ir->next;
+  if (next && next->kind == IR_BR)
+    return next->a == ir->d && !is_live_out(bb, ir->d);
+
+  // A comparison can also be shared by the selects that follow it if
+  // nothing else reads its result.
+  if (!next || next->kind != IR_SEL || next->a != ir->d)
+    return false;
+  for (; next && next->kind == IR_SEL && next->a == ir->d; next = next->next)
+    if (next->b == ir->d || next->c == ir->d || next->d == ir->d)
+      return false;
+  for (; next; next = next->next)
+    if (reads_reg(next, ir->d))
+      return false;
+  return !is_live_out(bb, ir->d);
+}
+
+// Returns true if a comparison is against zero and can be done by
+// cbz, cbnz or tbnz on the sign bit.
+static bool is_zero_test(Ir *ir) {
+  return !ir->b && ir->imm == 0 && ir->kind != IR_LE;
+}
+
+// Jump to `label` if the fused comparison is true, or false if
+// `neg` is true.
+static void branch_if(Ir *cmp, bool neg, char *label) {
+  if (is_zero_test(cmp)) {
+    int a = use_reg(cmp->a, 16);
+    if (cmp->kind == IR_LT)
+      println("  %s x%d, #63, %s", neg ? "tbz" : "tbnz", a, label);
+    else if ((cmp->kind == IR_EQ) != neg)
+      println("  cbz x%d, %s", a, label);
+    else
+      println("  cbnz x%d, %s", a, label);
+    return;
+  }
+
+  char *cond = neg ? inverse_cond(cmp->kind) : cond_name(cmp->kind);
+  println("  b.%s %s", cond, label);
+}
+
+// Returns the condition under which a select picks its first operand,
+// or the opposite if `neg` is true. `cmp` is the fused comparison, or
+// NULL if the condition register has been compared with zero.
+static char *sel_cond(Ir *cmp, bool neg) {
+  if (!cmp)
+    return neg ? "eq" : "ne";
+  return neg ? inverse_cond(cmp->kind) : cond_name(cmp->kind);
+}
+
+static void emit_loc(Ir *ir) {
+  if (ir->line_no && ir->line_no != last_line_no) {
+    println("  .loc 1 %d", ir->line_no);
+    last_line_no = ir->line_no;
+  }
+}
+
+static void emit_args(Ir *ir) {
+  // Stack arguments go to the bottom of the frame.
+  for (int i = 8; i < ir->nargs; i++)
+    println("  str x%d, [sp, #%d]", use_reg(ir->args[i], 16), (i - 8) * 8);
+
+  // Arguments never live in x0-x7, so they can be set in any order.
+  for (int i = 0; i < ir->nargs && i < 8; i++) {
+    Reg *r = ir->args[i];
+    if (r->rn >= 0)
+      println("  mov %s, x%d", argreg64[i], r->rn);
+    else
+      println("  ldr %s, %s", argreg64[i], slot_addr(r->slot, i));
+  }
+}
+
+// Emit a call and the return of its value as a jump to the callee
+// after the epilogue.
+static void emit_sibling_call(Ir *ir) {
+  emit_loc(ir);
+  emit_args(ir);
+  gen_epilogue();
+  println("  b %s", ir->funcname);
+}
+
+static void emit_ir(Ir *ir, BB *bb) {
+  BB *next = bb->next;
+
+  emit_loc(ir);
+
+  int d = ir->d ? def_reg(ir->d) : -1;
+
+  switch (ir->kind) {
+  case IR_IMM:
+    gen_mov_imm(format("x%d", d), ir->imm);
+    finish_def(ir->d);
+    return;
+  case IR_MOV: {
+    int a = use_reg(ir->a, 16);
+    if (a != d)
+      println("  mov x%d, x%d", d, a);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_MUL:
+    if (!ir->b) {
+      gen_mul_imm(d, use_reg(ir->a, 16), ir->imm, 17);
+      finish_def(ir->d);
+      return;
+    }
+    goto binary;
+  case IR_DIV:
+    if (!ir->b) {
+      gen_div_imm(d, use_reg(ir->a, 16), ir->imm, 17, ir->exact);
+      finish_def(ir->d);
+      return;
+    }
+    goto binary;
+  case IR_MADD:
+  case IR_MSUB: {
+    int a = use_reg(ir->a, 16);
+    int b = use_reg(ir->b, 17);
+    int c = use_reg(ir->c, 8);
+    println("  %s x%d, x%d, x%d, x%d", (ir->kind == IR_MADD) ? "madd" : "msub",
+            d, b, c, a);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_MNEG:
+    println("  mneg x%d, x%d, x%d", d, use_reg(ir->a, 16), use_reg(ir->b, 17));
+    finish_def(ir->d);
+    return;
+  case IR_ADD:
+  case IR_SUB:
+  binary: {
+    static char *insn[] = {
+      [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "sdiv",
+    };
+    int a = use_reg(ir->a, 16);
+
+    // add and sub with an immediate operand. A negative immediate
+    // turns one into the other.
+    if (!ir->b) {
+      bool neg = (ir->imm < 0);
+      char *op = ((ir->kind == IR_ADD) != neg) ? "add" : "sub";
+      println("  %s x%d, x%d, #%ld", op, d, a, neg ? -ir->imm : ir->imm);
+      finish_def(ir->d);
+      return;
+    }
+
+    // The second operand of add and sub may be zero-extended and
+    // shifted.
+    int b = use_reg(ir->b, 17);
+    if (ir->size && ir->shift)
+      println("  %s x%d, x%d, w%d, uxt%c #%d", insn[ir->kind], d, a, b,
+              "bhw"[ir->size / 2], ir->shift);
+    else if (ir->size)
+      println("  %s x%d, x%d, w%d, uxt%c", insn[ir->kind], d, a, b,
+              "bhw"[ir->size / 2]);
+    else if (ir->shift)
+      println("  %s x%d, x%d, x%d, lsl #%d", insn[ir->kind], d, a, b, ir->shift);
+    else
+      println("  %s x%d, x%d, x%d", insn[ir->kind], d, a, b);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_NEG:
+    println("  neg x%d, x%d", d, use_reg(ir->a, 16));
+    finish_def(ir->d);
+    return;
+  case IR_ZEXT: {
+    int a = use_reg(ir->a, 16);
+    if (ir->size == 1)
+      println("  and x%d, x%d, #0xff", d, a);
+    else if (ir->size == 2)
+      println("  and x%d, x%d, #0xffff", d, a);
+    else
+      println("  mov w%d, w%d", d, a);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE: {
+    if (is_fusible(ir, bb)) {
+      fused_cmp = ir;
+      if (is_zero_test(ir) && ir->next->kind == IR_BR)
+        return;
+    }
+
+    int a = use_reg(ir->a, 16);
+    if (!ir->b && ir->imm < 0)
+      println("  cmn x%d, #%ld", a, -ir->imm);
+    else if (!ir->b)
+      println("  cmp x%d, #%ld", a, ir->imm);
+    else
+      println("  cmp x%d, x%d", a, use_reg(ir->b, 17));
+    if (fused_cmp == ir)
+      return;
+    println("  cset x%d, %s", d, cond_name(ir->kind));
+    finish_def(ir->d);
+    return;
+  }
+  case IR_SEL: {
+    // Test a unless the flags are set by a fused comparison.
+    Ir *cmp = fused_cmp;
+    if (!cmp)
+      println("  cmp x%d, #0", use_reg(ir->a, 16));
+    if (!ir->next || ir->next->kind != IR_SEL || ir->next->a != ir->a)
+      fused_cmp = NULL;
+
+    char *cond = sel_cond(cmp, ir->invert);
+    char r = (ir->size == 4) ? 'w' : 'x';
+    char *b = ir->b ? format("%c%d", r, use_reg(ir->b, 16)) : format("%czr", r);
+    char *c = ir->c ? format("%c%d", r, use_reg(ir->c, 17)) : format("%czr", r);
+
+    if (ir->imm == 1 && !ir->b && !ir->c)
+      println("  cset %c%d, %s", r, d, sel_cond(cmp, !ir->invert));
+    else if (ir->imm == 1)
+      println("  csinc %c%d, %s, %s, %s", r, d, b, c, cond);
+    else if (ir->imm == -1)
+      println("  csneg %c%d, %s, %s, %s", r, d, b, c, cond);
+    else
+      println("  csel %c%d, %s, %s, %s", r, d, b, c, cond);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_LVAR:
+    gen_add_imm(format("x%d", d), frame_reg, frame_bias + ir->var->offset);
+    finish_def(ir->d);
+    return;
+  case IR_GVAR:
+    println("  adrp x%d, %s", d, ir->var->name);
+    println("  add x%d, x%d, :lo12:%s", d, d, ir->var->name);
+    finish_def(ir->d);
+    return;
+  case IR_LOAD: {
+    if (ir->size == 16) {
+      println("  ld1 {v%d.16b}, %s", d, vec_mem_operand(ir));
+      finish_writeback(ir);
+      return;
+    }
+
+    char *addr = mem_operand(ir);
+    if (ir->size == 1)
+      println("  ldrb w%d, %s", d, addr);
+    else if (ir->size == 2)
+      println("  ldrh w%d, %s", d, addr);
+    else if (ir->size == 4)
+      println("  ldr w%d, %s", d, addr);
+    else
+      println("  ldr x%d, %s", d, addr);
+    finish_writeback(ir);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_STORE: {
+    if (ir->size == 16) {
+      println("  st1 {v%d.16b}, %s", ir->b->rn, vec_mem_operand(ir));
+      finish_writeback(ir);
+      return;
+    }
+
+    int b = use_reg(ir->b, 8);
+    char *addr = mem_operand(ir);
+    if (ir->size == 1)
+      println("  strb w%d, %s", b, addr);
+    else if (ir->size == 2)
+      println("  strh w%d, %s", b, addr);
+    else if (ir->size == 4)
+      println("  str w%d, %s", b, addr);
+    else
+      println("  str x%d, %s", b, addr);
+    finish_writeback(ir);
+    return;
+  }
+  case IR_MEMCPY:
+    gen_copy(use_reg(ir->a, 16), use_reg(ir->b, 17), ir->size);
+    return;
+  case IR_CALL:
+    emit_args(ir);
+    println("  bl %s", ir->funcname);
+    println("  mov x%d, x0", d);
+    finish_def(ir->d);
+    return;
+  case IR_ARG:
+    if (ir->imm < 8)
+      println("  mov x%d, %s", d, argreg64[ir->imm]);
+    else
+      println("  ldr x%d, [%s, #%ld]", d, frame_reg,
+              frame_bias + 16 + (ir->imm - 8) * 8);
+    finish_def(ir->d);
+    return;
+  case IR_VDUP:
+    println("  dup v%d.%s, %c%d", d, lanes(ir->size),
+            (ir->size == 8) ? 'x' : 'w', use_reg(ir->a, 16));
+    return;
+  case IR_VADD:
+  case IR_VSUB:
+  case IR_VMUL:
+  case IR_VMAX:
+  case IR_VMIN:
+  case IR_VEQ:
+  case IR_VLT:
+  case IR_VLE: {
+    static char *insn[] = {
+      [IR_VADD] = "add", [IR_VSUB] = "sub", [IR_VMUL] = "mul",
+      [IR_VMAX] = "umax", [IR_VMIN] = "umin", [IR_VEQ] = "cmeq",
+      [IR_VLT] = "cmhi", [IR_VLE] = "cmhs",
+    };
+    char *op = insn[ir->kind];
+    int a = ir->a->rn;
+    int b = ir->b->rn;
+
+    // a < b is computed as b > a. 8-byte lanes are signed.
+    if (ir->kind == IR_VLT || ir->kind == IR_VLE) {
+      a = ir->b->rn;
+      b = ir->a->rn;
+      if (ir->size == 8)
+        op = (ir->kind == IR_VLT) ? "cmgt" : "cmge";
+    }
+
+    char *t = lanes(ir->size);
+    println("  %s v%d.%s, v%d.%s, v%d.%s", op, d, t, a, t, b, t);
+    return;
+  }
+  case IR_VSEL: {
+    // bsl, bit and bif differ in which operand the result overwrites.
+    int a = ir->a->rn;
+    int b = ir->b->rn;
+    int c = ir->c->rn;
+    if (d == b) {
+      println("  bif v%d.16b, v%d.16b, v%d.16b", d, c, a);
+    } else if (d == c) {
+      println("  bit v%d.16b, v%d.16b, v%d.16b", d, b, a);
+    } else {
+      if (d != a)
+        println("  mov v%d.16b, v%d.16b", d, a);
+      println("  bsl v%d.16b, v%d.16b, v%d.16b", d, b, c);
+    }
+    return;
+  }
+  case IR_VSUMW: {
+    // Add adjacent lanes until they are 4 bytes wide, and then add
+    // adjacent lanes to the 8-byte lanes of the result.
+    int b = ir->b->rn;
+    for (int size = ir->size; size < 4; size *= 2) {
+      println("  uaddlp v0.%s, v%d.%s", lanes(size * 2), b, lanes(size));
+      b = 0;
+    }
+    if (d != ir->a->rn) {
+      if (d == b) {
+        println("  mov v0.16b, v%d.16b", b);
+        b = 0;
+      }
+      println("  mov v%d.16b, v%d.16b", d, ir->a->rn);
+    }
+    println("  uadalp v%d.2d, v%d.4s", d, b);
+    return;
+  }
+  case IR_VSUM:
+    println("  addp d0, v%d.2d", ir->a->rn);
+    println("  umov x%d, v0.d[0]", d);
+    finish_def(ir->d);
+    return;
+  case IR_VHMAX:
+  case IR_VHMIN: {
+    char r = (ir->size == 1) ? 'b' : (ir->size == 2) ? 'h' : 's';
+    println("  %s %c0, v%d.%s", (ir->kind == IR_VHMAX) ? "umaxv" : "uminv", r,
+            ir->a->rn, lanes(ir->size));
+    println("  umov w%d, v0.%c[0]", d, r);
+    finish_def(ir->d);
+    return;
+  }
+  case IR_JMP:
+    if (ir->bb1 != next)
+      println("  b .L.bb.%d", ir->bb1->label);
+    return;
+  case IR_BR: {
+    if (fused_cmp) {
+      Ir *cmp = fused_cmp;
+      fused_cmp = NULL;
+      if (ir->bb2 == next) {
+        branch_if(cmp, false, format(".L.bb.%d", ir->bb1->label));
+      } else {
+        branch_if(cmp, true, format(".L.bb.%d", ir->bb2->label));
+        if (ir->bb1 != next)
+          println("  b .L.bb.%d", ir->bb1->label);
+      }
+      return;
+    }
+
+    int a = use_reg(ir->a, 16);
+    if (ir->bb2 == next) {
+      println("  cbnz x%d, .L.bb.%d", a, ir->bb1->label);
+    } else {
+      println("  cbz x%d, .L.bb.%d", a, ir->bb2->label);
+      if (ir->bb1 != next)
+        println("  b .L.bb.%d", ir->bb1->label);
+    }
+    return;
+  }
+  case IR_RET:
+    if (ir->a) {
+      int a = use_reg(ir->a, 0);
+      if (a != 0)
+        println("  mov x0, x%d", a);
+    }
+    if (next)
+      println("  b .L.return.%s", current_fn->name);
+    return;
+  }
+
+  unreachable();
+}
+
+static void emit_ir_text(Obj *fn) {
+  // Callee-saved registers used by the function are saved above the
+  // spill slots.
+  nsaved = 0;
+  for (int r = 19; r <= 28; r++)
+    if (fn->used_regs & (1u << r))
+      saved[nsaved++] = r;
+
+  // Arguments of calls beyond the eighth are stored at the bottom of
+  // the frame, below the spill slots.
+  bool calls = false;
+  int out_size = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      if (ir->kind == IR_CALL) {
+        calls |= !is_sibling_call_ir(ir);
+        if (ir->nargs > 8 && out_size < (ir->nargs - 8) * 8)
+          out_size = align_to((ir->nargs - 8) * 8, 16);
+      }
+    }
+  }
+
+  spill_base = out_size;
+  frame_size =
+    align_to(fn->stack_size + out_size + (fn->nspills + nsaved) * 8, 16);
+  current_size->stack_size = frame_size;
+  last_line_no = 0;
+
+  int nparams = 0;
+  for (Obj *var = fn->params; var; var = var->next)
+    nparams++;
+
+  // x29 and x30 are saved if the function makes calls or uses x29.
+  // With a frame pointer, that is also the case if it has a frame.
+  // Without one, they are saved anyway if parameters are passed on
+  // the stack, so that the parameters are 16 bytes above the saved
+  // pair in either case. A leaf function that needs no stack has no
+  // prologue at all.
+  omit_fp = opt_omit_frame_pointer;
+  save_fp = calls || (fn->used_regs & (1u << 29)) ||
+                 (!omit_fp && frame_size) || nparams > 8;
+
+  frame_reg = omit_fp ? "sp" : "x29";
+  frame_bias = omit_fp ? frame_size : 0;
+
+  // Prologue
+  if (save_fp) {
+    println("  stp x29, x30, [sp, #-16]!");
+    println("  .cfi_def_cfa_offset 16");
+    println("  .cfi_offset 29, -16");
+    println("  .cfi_offset 30, -8");
+    if (!omit_fp) {
+      println("  mov x29, sp");
+      println("  .cfi_def_cfa_register 29");
+    }
+  }
+  if (frame_size) {
+    gen_add_imm("sp", "sp", -frame_size);
+    if (omit_fp)
+      println("  .cfi_def_cfa_offset %d", frame_size + save_fp * 16);
+  }
+  for (int i = 0; i < nsaved; i++)
+    println("  str x%d, %s", saved[i], slot_addr(fn->nspills + i, 16));
+  for (int i = 0; i < nsaved; i++)
+    println("  .cfi_offset %d, %d", saved[i],
+            spill_base + (fn->nspills + i) * 8 - frame_size - save_fp * 16);
+
+  store_params(fn);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    println(".L.bb.%d:", bb->label);
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      if (is_sibling_call_ir(ir)) {
+        emit_sibling_call(ir);
+        break;
+      }
+      emit_ir(ir, bb);
+    }
+  }
+
+  // Epilogue
+  println(".L.return.%s:", fn->name);
+  gen_epilogue();
+  println("  ret");
+
+  frame_reg = "x29";
+  frame_bias = 0;
+  spill_base = 0;
+  omit_fp = false;
+}
+
 static void emit_text(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
     if (!fn->is_function || !fn->is_definition)
       continue;
+    if (fn->is_static && !fn->is_live)
+      continue;
 
-    println("  .globl %s", fn->name);
+    if (!fn->is_static)
+      println("  .globl %s", fn->name);
     println("  .text");
     println("%s:", fn->name);
+    println("  .cfi_startproc");
     current_fn = fn;
+    current_size = new_func_size(fn->name);
+    current_size->stack_size = fn->stack_size;
+    sibling_calls = opt_optimize_sibling_calls && !frame_escapes(fn);
+
+    if (opt_peephole)
+      insn_tail = &insn_head;
+
+    if (fn->bbs) {
+      emit_ir_text(fn);
+      println("  .cfi_endproc");
+      flush_lines();
+      current_size = NULL;
+      continue;
+    }
+
+    // A function without local variables and calls needs no frame.
+    bool has_frame = fn->stack_size || has_call(fn->body);
+    frame_size = fn->stack_size;
+    save_fp = has_frame;
+    nsaved = 0;
 
     // Prologue
-    println("  stp x29, x30, [sp, #-16]!");
-    println("  mov x29, sp");
-    println("  sub sp, sp, #%d", fn->stack_size);
+    if (has_frame) {
+      println("  stp x29, x30, [sp, #-16]!");
+      println("  .cfi_def_cfa_offset 16");
+      println("  .cfi_offset 29, -16");
+      println("  .cfi_offset 30, -8");
+      println("  mov x29, sp");
+      println("  .cfi_def_cfa_register 29");
+      gen_add_imm("sp", "sp", -fn->stack_size);
+    }
 
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next)
-      store_gp(i++, var->offset, var->ty->size);
+    store_params(fn);
 
     // Emit code
     gen_stmt(fn->body);
@@ -331,9 +1908,11 @@ static void emit_text(Obj *prog) {
 
     // Epilogue
     println(".L.return.%s:", fn->name);
-    println("  add sp, sp, #%d", fn->stack_size);
-    println("  ldp x29, x30, [sp], #16");
+    gen_epilogue();
     println("  ret");
+    println("  .cfi_endproc");
+    flush_lines();
+    current_size = NULL;
   }
 }
 
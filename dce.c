@@ -0,0 +1,523 @@
+// This file removes dead code from the AST before it is compiled.
+//
+// Statements that can never run are removed: those following a return
+// in the same block, and the arms of "if" and "for" statements whose
+// conditions are constant. Such code is common in generated sources
+// with disabled regions, and removing it here shrinks the code at
+// every -O level.
+//
+// With optimization enabled, a local variable that is assigned to but
+// never read is removed along with the assignments, except for the
+// parts of their right-hand sides that have side effects. This also
+// shrinks the stack frame.
+//
+// Finally, static functions and global variables, including string
+// literals, are emitted only if live code refers to them.
+
+#include "chibicc.h"
+
+static Obj *current_fn;
+static bool changed;
+
+static bool is_empty(Node *node) {
+  return node->kind == ND_BLOCK && !node->body;
+}
+
+static void make_empty(Node *node) {
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->kind = ND_BLOCK;
+  node->tok = tok;
+  node->next = next;
+}
+
+// Replace a node with another one in place. Variables declared in
+// `with` if it is a block are now declared in `node`.
+static void replace(Node *node, Node *with) {
+  Node *next = node->next;
+  *node = *with;
+  node->next = next;
+
+  // Only a block declares variables.
+  if (with->kind != ND_BLOCK)
+    return;
+  for (Obj *var = current_fn->locals; var; var = var->next)
+    if (var->block == with)
+      var->block = node;
+}
+
+//
+// Unreachable statements
+//
+
+static bool eval(Node *node, int64_t *val) {
+  int64_t a, b;
+
+  switch (node->kind) {
+  case ND_NUM:
+    *val = node->val;
+    return true;
+  case ND_NEG:
+    if (!eval(node->lhs, &a))
+      return false;
+    *val = -a;
+    return true;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    if (!eval(node->lhs, &a) || !eval(node->rhs, &b))
+      return false;
+
+    switch (node->kind) {
+    case ND_ADD: *val = a + b; return true;
+    case ND_SUB: *val = a - b; return true;
+    case ND_MUL: *val = a * b; return true;
+    case ND_DIV:
+      // Dividing INT64_MIN by -1 overflows and traps on the host.
+      if (b == 0 || (a == INT64_MIN && b == -1))
+        return false;
+      *val = a / b;
+      return true;
+    case ND_EQ: *val = (a == b); return true;
+    case ND_NE: *val = (a != b); return true;
+    case ND_LT: *val = (a < b); return true;
+    case ND_LE: *val = (a <= b); return true;
+    }
+  }
+  return false;
+}
+
+static bool remove_unreachable(Node *node);
+
+static void remove_unreachable_list(Node *node) {
+  for (; node; node = node->next)
+    remove_unreachable(node);
+}
+
+// Removes statements that can never run from a given tree. Returns
+// true if control never reaches the end of it.
+static bool remove_unreachable(Node *node) {
+  if (!node)
+    return false;
+
+  remove_unreachable(node->lhs);
+  remove_unreachable(node->rhs);
+  remove_unreachable(node->cond);
+  remove_unreachable(node->init);
+  remove_unreachable(node->inc);
+  remove_unreachable_list(node->args);
+  bool then = remove_unreachable(node->then);
+  bool els = remove_unreachable(node->els);
+
+  int64_t val;
+  switch (node->kind) {
+  case ND_RETURN:
+    return true;
+  case ND_BLOCK:
+    // There are no labels, so nothing after a return in a block can
+    // be reached.
+    for (Node *n = node->body; n; n = n->next) {
+      if (remove_unreachable(n)) {
+        n->next = NULL;
+        return true;
+      }
+    }
+    return false;
+  case ND_IF:
+    if (!eval(node->cond, &val))
+      return then && els;
+    if (val) {
+      replace(node, node->then);
+      return then;
+    }
+    if (node->els) {
+      replace(node, node->els);
+      return els;
+    }
+    make_empty(node);
+    return false;
+  case ND_FOR:
+    if (!node->cond || !eval(node->cond, &val))
+      return false;
+    if (val)
+      node->cond = NULL;
+    else if (node->init)
+      replace(node, node->init);
+    else
+      make_empty(node);
+    return false;
+  }
+
+  remove_unreachable_list(node->body);
+  return false;
+}
+
+//
+// Dead stores
+//
+
+// Returns true if evaluating a given expression has no side effects.
+static bool is_pure(Node *node) {
+  if (!node)
+    return true;
+
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_NEG:
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_COMMA:
+  case ND_MEMBER:
+  case ND_ADDR:
+  case ND_DEREF:
+    return is_pure(node->lhs) && is_pure(node->rhs);
+  }
+  return false;
+}
+
+static Obj *store_target(Node *node);
+
+// If a given expression computes, without side effects, an address
+// within a local array, returns the array.
+static Obj *addr_target(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    if (node->ty->kind == TY_ARRAY)
+      return store_target(node);
+    return NULL;
+  case ND_ADD:
+    return is_pure(node->rhs) ? addr_target(node->lhs) : NULL;
+  case ND_DEREF:
+  case ND_MEMBER:
+    if (node->ty->kind == TY_ARRAY)
+      return store_target(node);
+    return NULL;
+  }
+  return NULL;
+}
+
+// If a given lvalue is in a local variable, returns the variable.
+static Obj *store_target(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    return node->var->is_local ? node->var : NULL;
+  case ND_MEMBER:
+    return store_target(node->lhs);
+  case ND_DEREF:
+    return addr_target(node->lhs);
+  }
+  return NULL;
+}
+
+// An assignment whose value is not used, to the variable it is
+// listed under.
+struct Store {
+  Store *next;
+  Node *node;
+};
+
+// Variables whose reference counts have dropped to zero
+static Obj **worklist;
+static int worklist_len;
+
+static void add_store(Obj *var, Node *node) {
+  Store *st = calloc(1, sizeof(Store));
+  st->node = node;
+  st->next = var->stores;
+  var->stores = st;
+}
+
+// Count references to local variables. The target of an assignment
+// whose value is not used is not counted as a reference; the
+// assignment is recorded instead.
+static void count_refs(Node *node, bool discarded) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_VAR:
+    if (node->var->is_local)
+      node->var->refs++;
+    return;
+  case ND_ASSIGN: {
+    count_refs(node->lhs, false);
+    count_refs(node->rhs, false);
+    Obj *var = discarded ? store_target(node->lhs) : NULL;
+    if (var) {
+      var->refs--;
+      add_store(var, node);
+    }
+    return;
+  }
+  case ND_EXPR_STMT:
+    count_refs(node->lhs, true);
+    return;
+  case ND_COMMA:
+    count_refs(node->lhs, true);
+    count_refs(node->rhs, discarded);
+    return;
+  case ND_STMT_EXPR:
+    // The last statement gives the value of a statement expression.
+    for (Node *n = node->body; n; n = n->next) {
+      if (n->next || n->kind != ND_EXPR_STMT)
+        count_refs(n, false);
+      else
+        count_refs(n->lhs, discarded);
+    }
+    return;
+  }
+
+  count_refs(node->lhs, false);
+  count_refs(node->rhs, false);
+  count_refs(node->cond, false);
+  count_refs(node->then, false);
+  count_refs(node->els, false);
+  count_refs(node->init, false);
+  count_refs(node->inc, true);
+  for (Node *n = node->body; n; n = n->next)
+    count_refs(n, false);
+  for (Node *n = node->args; n; n = n->next)
+    count_refs(n, false);
+}
+
+// Uncount the references in a pure expression that is being removed.
+static void uncount_refs(Node *node) {
+  if (!node)
+    return;
+  if (node->kind == ND_VAR && node->var->is_local &&
+      --node->var->refs == 0)
+    worklist[worklist_len++] = node->var;
+  uncount_refs(node->lhs);
+  uncount_refs(node->rhs);
+}
+
+// The value of a given expression has become unused, which may turn
+// an assignment at its end into one whose value is not used either.
+// This follows the same contexts as count_refs().
+static void discard(Node *node) {
+  switch (node->kind) {
+  case ND_ASSIGN: {
+    Obj *var = store_target(node->lhs);
+    if (var) {
+      add_store(var, node);
+      if (--var->refs == 0)
+        worklist[worklist_len++] = var;
+    }
+    return;
+  }
+  case ND_COMMA:
+    discard(node->rhs);
+    return;
+  case ND_STMT_EXPR: {
+    Node *n = node->body;
+    while (n && n->next)
+      n = n->next;
+    if (n && n->kind == ND_EXPR_STMT)
+      discard(n->lhs);
+    return;
+  }
+  }
+}
+
+// Replace an assignment to a variable that is never read with its
+// right-hand side. If that has no side effects either, the result is
+// a zero, which remove_zeros() cleans up.
+static void remove_store(Obj *var, Node *node) {
+  // The left-hand side, such as an array index, may have side effects
+  // of its own. Then the variable keeps its slot and the store is left
+  // as it is.
+  if (!is_pure(node->lhs)) {
+    var->refs++;
+    return;
+  }
+
+  // The target in the left-hand side was not counted, so its count
+  // dips below zero here and is then put back.
+  uncount_refs(node->lhs);
+  var->refs++;
+
+  replace(node, node->rhs);
+  changed = true;
+
+  if (!is_pure(node)) {
+    discard(node);
+    return;
+  }
+
+  uncount_refs(node);
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->kind = ND_NUM;
+  node->tok = tok;
+  node->ty = ty_long;
+  node->next = next;
+}
+
+// Remove statements that removed stores have left with nothing to do.
+static void remove_zeros(Node *node) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_EXPR_STMT && node->lhs->kind == ND_NUM) {
+    make_empty(node);
+    return;
+  }
+  if (node->kind == ND_FOR && node->inc && node->inc->kind == ND_NUM)
+    node->inc = NULL;
+
+  remove_zeros(node->lhs);
+  remove_zeros(node->rhs);
+  remove_zeros(node->cond);
+  remove_zeros(node->then);
+  remove_zeros(node->els);
+  remove_zeros(node->init);
+  remove_zeros(node->inc);
+  for (Node *n = node->args; n; n = n->next)
+    remove_zeros(n);
+
+  // The last statement of a statement expression gives its value, so
+  // it is kept.
+  for (Node *n = node->body; n; n = n->next) {
+    if (node->kind == ND_STMT_EXPR && !n->next && n->kind == ND_EXPR_STMT)
+      remove_zeros(n->lhs);
+    else
+      remove_zeros(n);
+  }
+
+  // Drop statements that have become empty.
+  Node **p = &node->body;
+  while (*p) {
+    if (is_empty(*p))
+      *p = (*p)->next;
+    else
+      p = &(*p)->next;
+  }
+}
+
+static void remove_dead_stores(Obj *fn) {
+  // A store through a pointer is not seen here, so if a pointer to a
+  // local variable may exist, every store is kept.
+  if (takes_local_addr(fn->body))
+    return;
+
+  int nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    var->refs = 0;
+    var->stores = NULL;
+    nvars++;
+  }
+  count_refs(fn->body, false);
+
+  // An array or a struct that is read may be read through the pointer
+  // it decays to, or be copied as a whole.
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->refs && !is_integer(var->ty) && var->ty->kind != TY_PTR)
+      return;
+
+  // A variable is put on the worklist when its count drops to zero,
+  // and after that it is never read again, so it is put there at
+  // most once.
+  worklist = calloc(nvars, sizeof(Obj *));
+  worklist_len = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->refs == 0)
+      worklist[worklist_len++] = var;
+
+  changed = false;
+  while (worklist_len) {
+    Obj *var = worklist[--worklist_len];
+    for (Store *st = var->stores; st; st = st->next)
+      remove_store(var, st->node);
+  }
+  free(worklist);
+
+  if (changed)
+    remove_zeros(fn->body);
+
+  // Variables that are left unreferenced need no stack slots.
+  // Parameters are at the end of the list and are always kept.
+  Obj **p = &fn->locals;
+  while (*p && *p != fn->params) {
+    if ((*p)->refs == 0)
+      *p = (*p)->next;
+    else
+      p = &(*p)->next;
+  }
+}
+
+//
+// Unreferenced definitions
+//
+
+static Obj *prog;
+
+static void mark_live(Node *node);
+
+static void mark_live_fn(Obj *fn) {
+  if (fn->is_live)
+    return;
+  fn->is_live = true;
+  mark_live(fn->body);
+}
+
+static void mark_live(Node *node) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_VAR && !node->var->is_local)
+    node->var->is_live = true;
+
+  if (node->kind == ND_FUNCALL)
+    for (Obj *fn = prog; fn; fn = fn->next)
+      if (fn->is_function && fn->is_definition &&
+          !strcmp(fn->name, node->funcname))
+        mark_live_fn(fn);
+
+  mark_live(node->lhs);
+  mark_live(node->rhs);
+  mark_live(node->cond);
+  mark_live(node->then);
+  mark_live(node->els);
+  mark_live(node->init);
+  mark_live(node->inc);
+  for (Node *n = node->body; n; n = n->next)
+    mark_live(n);
+  for (Node *n = node->args; n; n = n->next)
+    mark_live(n);
+}
+
+void eliminate_dead_code(Obj *p, int level) {
+  prog = p;
+
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+    current_fn = fn;
+    remove_unreachable(fn->body);
+    if (level > 0)
+      remove_dead_stores(fn);
+  }
+
+  // Everything that is visible to other files is live, and so is
+  // everything that it refers to.
+  for (Obj *var = prog; var; var = var->next)
+    if (!var->is_function && !var->is_static)
+      var->is_live = true;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && !fn->is_static)
+      mark_live_fn(fn);
+}
@@ -0,0 +1,323 @@
+// This file implements inlining of small functions on the AST.
+//
+// A call to a function whose body is a single return statement is
+// replaced by a copy of the returned expression. Parameters and other
+// local variables of the callee become fresh local variables of the
+// caller, and the parameters are assigned the arguments first, so that
+// each argument is evaluated exactly once as in a real call:
+//
+//   f(a, b)  =>  (p1 = a, p2 = b, <copy of f's return expression>)
+//
+// Inlining runs before the AST is lowered to IR, so constant folding
+// and copy propagation then work across what used to be a call.
+
+#include "chibicc.h"
+
+static Obj *prog;
+static Obj *caller;
+static char *filename;
+static FILE *report;
+
+// Local variables of the callee and their copies in the caller
+static Obj *old_vars[64];
+static Obj *new_vars[64];
+static int nvars;
+
+static Obj *find_function(char *name) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition && !strcmp(fn->name, name))
+      return fn;
+  return NULL;
+}
+
+static int count_nodes(Node *node) {
+  if (!node)
+    return 0;
+
+  int n = 1 + count_nodes(node->lhs) + count_nodes(node->rhs) +
+          count_nodes(node->cond) + count_nodes(node->then) +
+          count_nodes(node->els) + count_nodes(node->init) +
+          count_nodes(node->inc);
+  for (Node *p = node->body; p; p = p->next)
+    n += count_nodes(p);
+  for (Node *p = node->args; p; p = p->next)
+    n += count_nodes(p);
+  return n;
+}
+
+// Returns true if a given expression contains a node of kind `kind`,
+// or a call to `funcname` if it is not NULL.
+static bool contains(Node *node, NodeKind kind, char *funcname) {
+  if (!node)
+    return false;
+  if (node->kind == kind &&
+      (!funcname || !strcmp(node->funcname, funcname)))
+    return true;
+
+  if (contains(node->lhs, kind, funcname) ||
+      contains(node->rhs, kind, funcname) ||
+      contains(node->cond, kind, funcname) ||
+      contains(node->then, kind, funcname) ||
+      contains(node->els, kind, funcname) ||
+      contains(node->init, kind, funcname) ||
+      contains(node->inc, kind, funcname))
+    return true;
+  for (Node *p = node->body; p; p = p->next)
+    if (contains(p, kind, funcname))
+      return true;
+  for (Node *p = node->args; p; p = p->next)
+    if (contains(p, kind, funcname))
+      return true;
+  return false;
+}
+
+static bool is_scalar(Type *ty) {
+  return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+// Returns the expression that replaces a call to `fn` with `nargs`
+// arguments. If the call cannot be inlined, returns NULL and sets
+// `reason`.
+static Node *inline_body(Obj *fn, int nargs, char **reason) {
+  Node *body = fn->body;
+  if (body->kind != ND_BLOCK || !body->body || body->body->next ||
+      body->body->kind != ND_RETURN) {
+    *reason = "not a single return statement";
+    return NULL;
+  }
+
+  Node *expr = body->body->lhs;
+
+  int nparams = 0;
+  for (Obj *var = fn->params; var; var = var->next)
+    nparams++;
+  if (nargs != nparams) {
+    *reason = "wrong number of arguments";
+    return NULL;
+  }
+  if (nparams > MAX_ARGS) {
+    *reason = "too many parameters";
+    return NULL;
+  }
+
+  // The copied expression becomes part of the caller. A return in it
+  // would return from the caller, and taking the address of a local
+  // variable would keep the caller's variables out of registers.
+  int nlocals = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (!is_scalar(var->ty)) {
+      *reason = "has a non-scalar local variable";
+      return NULL;
+    }
+    nlocals++;
+  }
+  if (nlocals > sizeof(old_vars) / sizeof(*old_vars)) {
+    *reason = "too many local variables";
+    return NULL;
+  }
+  if (!is_scalar(expr->ty)) {
+    *reason = "returns a non-scalar value";
+    return NULL;
+  }
+  if (contains(expr, ND_ADDR, NULL)) {
+    *reason = "takes an address";
+    return NULL;
+  }
+  if (contains(expr, ND_RETURN, NULL)) {
+    *reason = "returns from a statement expression";
+    return NULL;
+  }
+  if (contains(expr, ND_FUNCALL, fn->name)) {
+    *reason = "recursive";
+    return NULL;
+  }
+
+  int size = count_nodes(expr);
+  if (size > opt_inline_limit) {
+    *reason = format("too large (%d > %d)", size, opt_inline_limit);
+    return NULL;
+  }
+  return expr;
+}
+
+static Obj *copy_var(Obj *var) {
+  for (int i = 0; i < nvars; i++)
+    if (old_vars[i] == var)
+      return new_vars[i];
+  return var;
+}
+
+static Node *copy_node(Node *node);
+
+static Node *copy_list(Node *node) {
+  Node head = {};
+  Node *cur = &head;
+  for (; node; node = node->next)
+    cur = cur->next = copy_node(node);
+  return head.next;
+}
+
+static Node *copy_node(Node *node) {
+  if (!node)
+    return NULL;
+
+  Node *copy = calloc(1, sizeof(Node));
+  counters.nodes++;
+  *copy = *node;
+  copy->next = NULL;
+  copy->lhs = copy_node(node->lhs);
+  copy->rhs = copy_node(node->rhs);
+  copy->cond = copy_node(node->cond);
+  copy->then = copy_node(node->then);
+  copy->els = copy_node(node->els);
+  copy->init = copy_node(node->init);
+  copy->inc = copy_node(node->inc);
+  copy->body = copy_list(node->body);
+  copy->args = copy_list(node->args);
+  if (node->kind == ND_VAR)
+    copy->var = copy_var(node->var);
+  return copy;
+}
+
+static Node *new_node(NodeKind kind, Type *ty, Token *tok) {
+  Node *node = calloc(1, sizeof(Node));
+  counters.nodes++;
+  node->kind = kind;
+  node->ty = ty;
+  node->tok = tok;
+  return node;
+}
+
+static Node *new_comma(Node *lhs, Node *rhs) {
+  Node *node = new_node(ND_COMMA, rhs->ty, rhs->tok);
+  node->lhs = lhs;
+  node->rhs = rhs;
+  return node;
+}
+
+// Replace a call to `fn` with a copy of `expr`.
+static void inline_call(Node *node, Obj *fn, Node *expr) {
+  nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    Obj *copy = calloc(1, sizeof(Obj));
+    copy->name = var->name;
+    copy->ty = var->ty;
+    copy->is_local = true;
+    copy->next = caller->locals;
+    caller->locals = copy;
+
+    old_vars[nvars] = var;
+    new_vars[nvars++] = copy;
+  }
+
+  Node *result = copy_node(expr);
+
+  // Assign the arguments to the parameters, last one first, so that
+  // the list is built from the end.
+  Node *args[MAX_ARGS];
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[nargs++] = arg;
+  for (int i = 0; i < nargs; i++)
+    args[i]->next = NULL;
+
+  Obj *params[MAX_ARGS];
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next)
+    params[i++] = copy_var(var);
+
+  Node *assigns = NULL;
+  for (int i = nargs - 1; i >= 0; i--) {
+    Node *lhs = new_node(ND_VAR, params[i]->ty, args[i]->tok);
+    lhs->var = params[i];
+    Node *assign = new_node(ND_ASSIGN, params[i]->ty, args[i]->tok);
+    assign->lhs = lhs;
+    assign->rhs = args[i];
+    assigns = assigns ? new_comma(assign, assigns) : assign;
+  }
+  if (assigns)
+    result = new_comma(assigns, result);
+
+  Node *next = node->next;
+  *node = *result;
+  node->next = next;
+}
+
+static void visit(Node *node);
+
+static void visit_call(Node *node) {
+  Obj *fn = find_function(node->funcname);
+  if (!fn)
+    return;
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+
+  char *reason;
+  Node *expr = inline_body(fn, nargs, &reason);
+  int line_no = node->tok->line_no;
+
+  if (expr) {
+    inline_call(node, fn, expr);
+    if (report)
+      fprintf(report, "%s:%d: inlined %s into %s\n", filename, line_no,
+              fn->name, caller->name);
+  } else if (report) {
+    fprintf(report, "%s:%d: not inlined %s into %s: %s\n", filename, line_no,
+            fn->name, caller->name, reason);
+  }
+}
+
+// Inline calls in a given node. Arguments are visited before the call
+// itself, and a copied expression is not visited again, so inlining
+// always terminates.
+static void visit(Node *node) {
+  if (!node)
+    return;
+
+  visit(node->lhs);
+  visit(node->rhs);
+  visit(node->cond);
+  visit(node->then);
+  visit(node->els);
+  visit(node->init);
+  visit(node->inc);
+  for (Node *p = node->body; p; p = p->next)
+    visit(p);
+  for (Node *p = node->args; p; p = p->next)
+    visit(p);
+
+  if (node->kind == ND_FUNCALL)
+    visit_call(node);
+}
+
+// Inline small functions into their callers. If `out` is not NULL, a
+// line is written to it for each call to a function defined in
+// `path`, saying whether it was inlined.
+void inline_functions(Obj *p, char *path, FILE *out) {
+  prog = p;
+  filename = path;
+  report = out;
+
+  if (opt_inline_limit <= 0)
+    return;
+
+  // Visit functions in the order of definition, so that the body of
+  // a callee defined earlier has already had its own calls inlined.
+  int n = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    n++;
+
+  Obj **fns = calloc(n, sizeof(Obj *));
+  int i = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    fns[i++] = fn;
+
+  for (int i = n - 1; i >= 0; i--) {
+    if (!fns[i]->is_function || !fns[i]->is_definition)
+      continue;
+    caller = fns[i];
+    visit(caller->body);
+  }
+}
@@ -0,0 +1,688 @@
+// This file lowers AST trees to an intermediate representation (IR)
+// used by the optimizer.
+//
+// A function in IR is a list of basic blocks. A basic block is a list
+// of three-address instructions that ends with a jump, a conditional
+// branch or a return. Instructions read and write an unlimited number
+// of virtual registers. Each virtual register holds a 64-bit value,
+// and the semantics of each instruction match what the stack-machine
+// code generator in codegen.c does for the corresponding AST node, so
+// the two code generators produce programs that behave the same.
+//
+// The IR is not in SSA form. A temporary computed for an expression is
+// written only once, but a local variable promoted to a virtual
+// register is assigned as many times as the program does.
+
+#include "chibicc.h"
+
+static Obj *current_fn;
+static BB *out;
+static int line_no;
+
+static Reg *gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+Reg *new_reg(Obj *fn) {
+  Reg *r = calloc(1, sizeof(Reg));
+  r->vn = fn->nregs++;
+  r->rn = -1;
+  return r;
+}
+
+BB *new_bb(void) {
+  static int label = 1;
+  BB *bb = calloc(1, sizeof(BB));
+  bb->label = label++;
+  return bb;
+}
+
+Ir *new_ir(IrKind kind) {
+  Ir *ir = calloc(1, sizeof(Ir));
+  ir->kind = kind;
+  return ir;
+}
+
+// Insert `ir` to `bb` before `pos`. If `pos` is NULL, `ir` is
+// appended to the end of the block.
+void insert_ir(BB *bb, Ir *pos, Ir *ir) {
+  ir->next = pos;
+  ir->prev = pos ? pos->prev : bb->last;
+
+  if (ir->prev)
+    ir->prev->next = ir;
+  else
+    bb->first = ir;
+
+  if (pos)
+    pos->prev = ir;
+  else
+    bb->last = ir;
+}
+
+void remove_ir(BB *bb, Ir *ir) {
+  if (ir->prev)
+    ir->prev->next = ir->next;
+  else
+    bb->first = ir->next;
+
+  if (ir->next)
+    ir->next->prev = ir->prev;
+  else
+    bb->last = ir->prev;
+}
+
+bool is_terminator(Ir *ir) {
+  return ir && (ir->kind == IR_JMP || ir->kind == IR_BR || ir->kind == IR_RET);
+}
+
+// Store pointers to the registers an instruction reads to `ops`,
+// which must have room for MAX_OPERANDS elements, and return their
+// number. Passes rewrite operands through the pointers.
+int get_operands(Ir *ir, Reg ***ops) {
+  int n = 0;
+  if (ir->a)
+    ops[n++] = &ir->a;
+  if (ir->b)
+    ops[n++] = &ir->b;
+  if (ir->c)
+    ops[n++] = &ir->c;
+  if (ir->index)
+    ops[n++] = &ir->index;
+  for (int i = 0; i < ir->nargs; i++)
+    ops[n++] = &ir->args[i];
+  return n;
+}
+
+// Store the registers an instruction writes to `defs`, which must
+// have room for two elements, and return their number.
+int get_defs(Ir *ir, Reg **defs) {
+  int n = 0;
+  if (ir->d)
+    defs[n++] = ir->d;
+  if (ir->pre_index || ir->post_index)
+    defs[n++] = ir->a;
+  return n;
+}
+
+static Ir *emit(IrKind kind) {
+  Ir *ir = new_ir(kind);
+  ir->line_no = line_no;
+  insert_ir(out, NULL, ir);
+  return ir;
+}
+
+// Start a new basic block. The current block falls through to it.
+static void start_bb(BB *bb) {
+  if (!is_terminator(out->last))
+    emit(IR_JMP)->bb1 = bb;
+
+  out = out->next = bb;
+}
+
+static Reg *emit_imm(int64_t val) {
+  Ir *ir = emit(IR_IMM);
+  ir->d = new_reg(current_fn);
+  ir->imm = val;
+  return ir->d;
+}
+
+static Reg *emit_unary(IrKind kind, Reg *a) {
+  Ir *ir = emit(kind);
+  ir->d = new_reg(current_fn);
+  ir->a = a;
+  return ir->d;
+}
+
+static Reg *emit_binary(IrKind kind, Reg *a, Reg *b) {
+  Ir *ir = emit(kind);
+  ir->d = new_reg(current_fn);
+  ir->a = a;
+  ir->b = b;
+  return ir->d;
+}
+
+//
+// Escape analysis
+//
+// A scalar local variable whose address is never taken cannot be
+// accessed through a pointer, so it can live in a virtual register
+// instead of in memory. The other variables of a block in which an
+// address is taken stay in memory as well: codegen.c keeps such a
+// block in declaration order, and code may step from the variable to
+// its neighbors by pointer arithmetic.
+//
+
+// Blocks that declare a variable whose address is taken, sorted
+static Node **escaped_blocks;
+static int nescaped_blocks;
+
+static void mark_escaped(Node *node);
+
+// Mark the variable whose address a given lvalue computes.
+static void mark_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    node->var->addr_taken = true;
+    return;
+  case ND_COMMA:
+    mark_addr(node->rhs);
+    return;
+  case ND_MEMBER:
+    mark_addr(node->lhs);
+    return;
+  }
+}
+
+static void mark_list(Node *node) {
+  for (; node; node = node->next)
+    mark_escaped(node);
+}
+
+static void mark_escaped(Node *node) {
+  if (!node)
+    return;
+
+  // An assignment to a member writes the memory of its struct, which is
+  // never promoted, so only a comma can assign through the address of
+  // a scalar variable.
+  if (node->kind == ND_ADDR || (node->kind == ND_ASSIGN && node->lhs->kind == ND_COMMA))
+    mark_addr(node->lhs);
+
+  mark_escaped(node->lhs);
+  mark_escaped(node->rhs);
+  mark_escaped(node->cond);
+  mark_escaped(node->then);
+  mark_escaped(node->els);
+  mark_escaped(node->init);
+  mark_escaped(node->inc);
+  mark_list(node->body);
+  mark_list(node->args);
+}
+
+static int cmp_block(const void *a, const void *b) {
+  Node *x = *(Node **)a;
+  Node *y = *(Node **)b;
+  if (x == y)
+    return 0;
+  return (uintptr_t)x < (uintptr_t)y ? -1 : 1;
+}
+
+static void find_escaped_blocks(Obj *fn) {
+  mark_escaped(fn->body);
+
+  nescaped_blocks = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->addr_taken)
+      nescaped_blocks++;
+
+  escaped_blocks = calloc(nescaped_blocks, sizeof(Node *));
+  int i = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    if (var->addr_taken)
+      escaped_blocks[i++] = var->block;
+  qsort(escaped_blocks, nescaped_blocks, sizeof(Node *), cmp_block);
+}
+
+static bool is_promotable(Obj *var) {
+  switch (var->ty->kind) {
+  case TY_CHAR:
+  case TY_SHORT:
+  case TY_INT:
+  case TY_LONG:
+  case TY_PTR:
+    return !bsearch(&var->block, escaped_blocks, nescaped_blocks,
+                    sizeof(Node *), cmp_block);
+  }
+  return false;
+}
+
+// Assign a value to a promoted variable. Like a store to memory
+// followed by a load, this drops the upper bits of the value.
+static void assign_var(Obj *var, Reg *val) {
+  if (var->ty->size < 8) {
+    Ir *ir = emit(IR_ZEXT);
+    ir->d = new_reg(current_fn);
+    ir->a = val;
+    ir->size = var->ty->size;
+    val = ir->d;
+  }
+
+  Ir *ir = emit(IR_MOV);
+  ir->d = var->reg;
+  ir->a = val;
+}
+
+// Compute the absolute address of a given node.
+static Reg *gen_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR: {
+    Ir *ir = emit(node->var->is_local ? IR_LVAR : IR_GVAR);
+    ir->d = new_reg(current_fn);
+    ir->var = node->var;
+    return ir->d;
+  }
+  case ND_DEREF:
+    return gen_expr(node->lhs);
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_addr(node->rhs);
+  case ND_MEMBER: {
+    Reg *base = gen_addr(node->lhs);
+    return emit_binary(IR_ADD, base, emit_imm(node->member->offset));
+  }
+  }
+
+  error_tok(node->tok, "not an lvalue");
+}
+
+// Load a value of a given type from a given address.
+static Reg *load(Type *ty, Reg *addr) {
+  // Like load() in codegen.c, the value of an array or a struct is
+  // its address.
+  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION)
+    return addr;
+
+  Ir *ir = emit(IR_LOAD);
+  ir->d = new_reg(current_fn);
+  ir->a = addr;
+  ir->size = ty->size;
+  return ir->d;
+}
+
+static void store(Type *ty, Reg *addr, Reg *val) {
+  // A large struct or union is copied by memcpy. This is a call so
+  // that the register allocator knows which registers it clobbers.
+  if ((ty->kind == TY_STRUCT || ty->kind == TY_UNION) &&
+      ty->size > opt_memcpy_threshold) {
+    Reg **args = calloc(3, sizeof(Reg *));
+    args[0] = addr;
+    args[1] = val;
+    args[2] = emit_imm(ty->size);
+
+    Ir *ir = emit(IR_CALL);
+    ir->d = new_reg(current_fn);
+    ir->funcname = "memcpy";
+    ir->args = args;
+    ir->nargs = 3;
+    return;
+  }
+
+  if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
+    Ir *ir = emit(IR_MEMCPY);
+    ir->a = addr;
+    ir->b = val;
+    ir->size = ty->size;
+    return;
+  }
+
+  Ir *ir = emit(IR_STORE);
+  ir->a = addr;
+  ir->b = val;
+  ir->size = ty->size;
+}
+
+static Reg *gen_expr(Node *node) {
+  line_no = node->tok->line_no;
+
+  switch (node->kind) {
+  case ND_NUM:
+    return emit_imm(node->val);
+  case ND_NEG:
+    return emit_unary(IR_NEG, gen_expr(node->lhs));
+  case ND_VAR:
+    // Copy a promoted variable so that the value does not change if
+    // the variable is assigned before the value is used.
+    if (node->var->reg)
+      return emit_unary(IR_MOV, node->var->reg);
+    return load(node->ty, gen_addr(node));
+  case ND_MEMBER:
+    return load(node->ty, gen_addr(node));
+  case ND_DEREF:
+    return load(node->ty, gen_expr(node->lhs));
+  case ND_ADDR:
+    return gen_addr(node->lhs);
+  case ND_ASSIGN: {
+    if (node->lhs->kind == ND_VAR && node->lhs->var->reg) {
+      Reg *val = gen_expr(node->rhs);
+      assign_var(node->lhs->var, val);
+      return val;
+    }
+
+    Reg *addr = gen_addr(node->lhs);
+    Reg *val = gen_expr(node->rhs);
+    store(node->ty, addr, val);
+    return val;
+  }
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next) {
+      if (!n->next && n->kind == ND_EXPR_STMT)
+        return gen_expr(n->lhs);
+      gen_stmt(n);
+    }
+    error_tok(node->tok, "statement expression returning void is not supported");
+  case ND_COMMA:
+    gen_expr(node->lhs);
+    return gen_expr(node->rhs);
+  case ND_FUNCALL: {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      nargs++;
+    if (nargs > MAX_ARGS)
+      error_tok(node->tok, "too many arguments");
+
+    Reg **args = calloc(nargs, sizeof(Reg *));
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      args[i++] = gen_expr(arg);
+
+    line_no = node->tok->line_no;
+    Ir *ir = emit(IR_CALL);
+    ir->d = new_reg(current_fn);
+    ir->funcname = node->funcname;
+    ir->args = args;
+    ir->nargs = nargs;
+    return ir->d;
+  }
+  }
+
+  Reg *rhs = gen_expr(node->rhs);
+  Reg *lhs = gen_expr(node->lhs);
+  line_no = node->tok->line_no;
+
+  switch (node->kind) {
+  case ND_ADD:
+    return emit_binary(IR_ADD, lhs, rhs);
+  case ND_SUB:
+    return emit_binary(IR_SUB, lhs, rhs);
+  case ND_MUL:
+    return emit_binary(IR_MUL, lhs, rhs);
+  case ND_DIV: {
+    Reg *d = emit_binary(IR_DIV, lhs, rhs);
+    out->last->exact = node->exact;
+    return d;
+  }
+  case ND_EQ:
+    return emit_binary(IR_EQ, lhs, rhs);
+  case ND_NE:
+    return emit_binary(IR_NE, lhs, rhs);
+  case ND_LT:
+    return emit_binary(IR_LT, lhs, rhs);
+  case ND_LE:
+    return emit_binary(IR_LE, lhs, rhs);
+  }
+
+  error_tok(node->tok, "invalid expression");
+}
+
+static void gen_stmt(Node *node) {
+  line_no = node->tok->line_no;
+
+  switch (node->kind) {
+  case ND_IF: {
+    BB *then = new_bb();
+    BB *els = new_bb();
+    BB *end = new_bb();
+
+    Reg *cond = gen_expr(node->cond);
+    Ir *ir = emit(IR_BR);
+    ir->a = cond;
+    ir->bb1 = then;
+    ir->bb2 = els;
+
+    start_bb(then);
+    gen_stmt(node->then);
+    emit(IR_JMP)->bb1 = end;
+
+    start_bb(els);
+    if (node->els)
+      gen_stmt(node->els);
+    start_bb(end);
+    return;
+  }
+  case ND_FOR: {
+    BB *begin = new_bb();
+    BB *body = new_bb();
+    BB *end = new_bb();
+
+    if (node->init)
+      gen_stmt(node->init);
+    start_bb(begin);
+    begin->unroll = node->unroll;
+
+    if (node->cond) {
+      Reg *cond = gen_expr(node->cond);
+      Ir *ir = emit(IR_BR);
+      ir->a = cond;
+      ir->bb1 = body;
+      ir->bb2 = end;
+    }
+
+    start_bb(body);
+    gen_stmt(node->then);
+    if (node->inc)
+      gen_expr(node->inc);
+    emit(IR_JMP)->bb1 = begin;
+
+    start_bb(end);
+    return;
+  }
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      gen_stmt(n);
+    return;
+  case ND_RETURN: {
+    Reg *val = gen_expr(node->lhs);
+    emit(IR_RET)->a = val;
+
+    // Code after a return statement goes to a new, unreachable block.
+    start_bb(new_bb());
+    return;
+  }
+  case ND_EXPR_STMT:
+    gen_expr(node->lhs);
+    return;
+  }
+
+  error_tok(node->tok, "invalid statement");
+}
+
+// Lower each function definition to IR.
+void gen_ir(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+
+    current_fn = fn;
+    fn->bbs = out = new_bb();
+
+    find_escaped_blocks(fn);
+    for (Obj *var = fn->locals; var; var = var->next)
+      if (is_promotable(var))
+        var->reg = new_reg(fn);
+
+    // Promoted parameters are copied from the argument registers.
+    int i = 0;
+    for (Obj *var = fn->params; var; var = var->next, i++) {
+      if (!var->reg)
+        continue;
+      Ir *ir = emit(IR_ARG);
+      ir->d = new_reg(fn);
+      ir->imm = i;
+      assign_var(var, ir->d);
+    }
+
+    gen_stmt(fn->body);
+
+    // Falling off the end of a function returns an undefined value.
+    if (!is_terminator(out->last))
+      emit(IR_RET);
+  }
+}
+
+//
+// IR dump
+//
+
+static char *ir_names[] = {
+  [IR_IMM] = "imm", [IR_MOV] = "mov", [IR_ADD] = "add", [IR_SUB] = "sub",
+  [IR_MUL] = "mul", [IR_DIV] = "div", [IR_MADD] = "madd", [IR_MSUB] = "msub",
+  [IR_NEG] = "neg", [IR_MNEG] = "mneg", [IR_ZEXT] = "zext",
+  [IR_EQ] = "eq", [IR_NE] = "ne", [IR_LT] = "lt", [IR_LE] = "le",
+  [IR_SEL] = "sel",
+  [IR_LVAR] = "lvar", [IR_GVAR] = "gvar", [IR_LOAD] = "load",
+  [IR_STORE] = "store", [IR_MEMCPY] = "memcpy", [IR_CALL] = "call",
+  [IR_ARG] = "arg", [IR_VDUP] = "vdup", [IR_VADD] = "vadd", [IR_VSUB] = "vsub",
+  [IR_VMUL] = "vmul", [IR_VMAX] = "vmax", [IR_VMIN] = "vmin", [IR_VEQ] = "veq",
+  [IR_VLT] = "vlt", [IR_VLE] = "vle", [IR_VSEL] = "vsel", [IR_VSUMW] = "vsumw",
+  [IR_VSUM] = "vsum", [IR_VHMAX] = "vhmax", [IR_VHMIN] = "vhmin",
+  [IR_JMP] = "jmp", [IR_BR] = "br", [IR_RET] = "ret",
+};
+
+// Print the address of a load or a store in assembly-like syntax.
+static void dump_addr(Ir *ir, FILE *out) {
+  if (ir->var)
+    fprintf(out, "[%s, %ld]", ir->var->name, ir->imm);
+  else if (ir->index)
+    fprintf(out, "[v%d, v%d, lsl %d]", ir->a->vn, ir->index->vn, ir->shift);
+  else if (ir->pre_index)
+    fprintf(out, "[v%d, %ld]!", ir->a->vn, ir->imm);
+  else if (ir->post_index)
+    fprintf(out, "[v%d], %ld", ir->a->vn, ir->imm);
+  else if (ir->imm)
+    fprintf(out, "[v%d, %ld]", ir->a->vn, ir->imm);
+  else
+    fprintf(out, "v%d", ir->a->vn);
+}
+
+static bool is_imm_form(Ir *ir) {
+  switch (ir->kind) {
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    return !ir->b;
+  }
+  return false;
+}
+
+// Print an operand of a select, which may be zero, incremented or
+// negated.
+static void dump_sel_operand(Reg *r, int64_t op, FILE *out) {
+  char *val = r ? format("v%d", r->vn) : "0";
+  if (op == 1)
+    fprintf(out, "%s+1", val);
+  else if (op == -1)
+    fprintf(out, "-%s", val);
+  else
+    fprintf(out, "%s", val);
+}
+
+static void dump_ir1(Ir *ir, FILE *out) {
+  fprintf(out, "  ");
+  if (ir->d)
+    fprintf(out, "v%d = ", ir->d->vn);
+  fprintf(out, "%s", ir_names[ir->kind]);
+
+  switch (ir->kind) {
+  case IR_IMM:
+  case IR_ARG:
+    fprintf(out, " %ld\n", ir->imm);
+    return;
+  case IR_ZEXT:
+    fprintf(out, "%d v%d\n", ir->size, ir->a->vn);
+    return;
+  case IR_SEL:
+    if (ir->size)
+      fprintf(out, "%d", ir->size);
+    fprintf(out, " %sv%d, ", ir->invert ? "!" : "", ir->a->vn);
+    dump_sel_operand(ir->b, 0, out);
+    fprintf(out, ", ");
+    dump_sel_operand(ir->c, ir->imm, out);
+    fprintf(out, "\n");
+    return;
+  case IR_LVAR:
+  case IR_GVAR:
+    fprintf(out, " %s\n", ir->var->name);
+    return;
+  case IR_LOAD:
+    fprintf(out, "%d ", ir->size);
+    dump_addr(ir, out);
+    fprintf(out, "\n");
+    return;
+  case IR_STORE:
+    fprintf(out, "%d ", ir->size);
+    dump_addr(ir, out);
+    fprintf(out, ", v%d\n", ir->b->vn);
+    return;
+  case IR_MEMCPY:
+    fprintf(out, "%d v%d, v%d\n", ir->size, ir->a->vn, ir->b->vn);
+    return;
+  case IR_CALL:
+    fprintf(out, " %s(", ir->funcname);
+    for (int i = 0; i < ir->nargs; i++)
+      fprintf(out, "%sv%d", i ? ", " : "", ir->args[i]->vn);
+    fprintf(out, ")\n");
+    return;
+  case IR_JMP:
+    fprintf(out, " .L.bb.%d\n", ir->bb1->label);
+    return;
+  case IR_BR:
+    fprintf(out, " v%d, .L.bb.%d, .L.bb.%d\n", ir->a->vn, ir->bb1->label,
+            ir->bb2->label);
+    return;
+  case IR_VDUP:
+  case IR_VADD:
+  case IR_VSUB:
+  case IR_VMUL:
+  case IR_VMAX:
+  case IR_VMIN:
+  case IR_VEQ:
+  case IR_VLT:
+  case IR_VLE:
+  case IR_VSEL:
+  case IR_VSUMW:
+  case IR_VSUM:
+  case IR_VHMAX:
+  case IR_VHMIN:
+    fprintf(out, "%d v%d", ir->size, ir->a->vn);
+    if (ir->b)
+      fprintf(out, ", v%d", ir->b->vn);
+    if (ir->c)
+      fprintf(out, ", v%d", ir->c->vn);
+    fprintf(out, "\n");
+    return;
+  }
+
+  if (ir->a)
+    fprintf(out, " v%d", ir->a->vn);
+  if (ir->b)
+    fprintf(out, ", v%d", ir->b->vn);
+  if (ir->c)
+    fprintf(out, ", v%d", ir->c->vn);
+
+  if (ir->b && ir->size)
+    fprintf(out, ", uxt%c %d", "bhw"[ir->size / 2], ir->shift);
+  else if (ir->b && ir->shift)
+    fprintf(out, ", lsl %d", ir->shift);
+  else if (is_imm_form(ir))
+    fprintf(out, ", %ld", ir->imm);
+  fprintf(out, "\n");
+}
+
+void dump_ir(Obj *prog, FILE *out) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->bbs)
+      continue;
+
+    fprintf(out, "%s:\n", fn->name);
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      fprintf(out, ".L.bb.%d:\n", bb->label);
+      for (Ir *ir = bb->first; ir; ir = ir->next)
+        dump_ir1(ir, out);
+    }
+  }
+}
@@ -4,12 +4,37 @@ static char *opt_o;
 
 static char *input_path;
 
+static StatsFormat opt_stats;
+static char *opt_size_report;
+bool opt_peephole;
+bool opt_omit_frame_pointer;
+bool opt_optimize_sibling_calls;
+bool opt_if_conversion = true;
+bool opt_vectorize = true;
+int opt_memcpy_threshold = 256;
+int opt_inline_limit = 24;
+int opt_unroll_factor = 4;
+
+static int opt_O;
+static bool opt_dump_ir;
+static bool opt_inline_report;
+
 static void usage(int status) {
-  fprintf(stderr, "chibicc [ -o <path> ] <file>\n");
+  fprintf(stderr, "chibicc [ -o <path> ] [ -O0|-O1|-O2 ] [ -f[no-]peephole ]\n"
+          "        [ -f[no-]omit-frame-pointer ] [ -f[no-]optimize-sibling-calls ]\n"
+          "        [ -f[no-]if-conversion ] [ -f[no-]vectorize ]\n"
+          "        [ -fmemcpy-threshold=<bytes> ] [ -finline-limit=<nodes> ]\n"
+          "        [ -funroll-factor=<n> ]\n"
+          "        [ --dump-ir ] [ --inline-report ]\n"
+          "        [ -ftime-report ] [ --stats=table|json ]\n"
+          "        [ --size-report[=<path>] ] <file>\n");
   exit(status);
 }
 
 static void parse_args(int argc, char **argv) {
+  int peephole = -1;
+  int sibling_calls = -1;
+
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "--help"))
       usage(0);
@@ -26,6 +51,112 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strcmp(argv[i], "-ftime-report") || !strcmp(argv[i], "--stats=table")) {
+      opt_stats = STATS_TABLE;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--stats=json")) {
+      opt_stats = STATS_JSON;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--size-report")) {
+      opt_size_report = "-";
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--size-report=", 14)) {
+      opt_size_report = argv[i] + 14;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-O")) {
+      opt_O = 1;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") ||
+        !strcmp(argv[i], "-O2")) {
+      opt_O = argv[i][2] - '0';
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fpeephole")) {
+      peephole = 1;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-peephole")) {
+      peephole = 0;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fomit-frame-pointer")) {
+      opt_omit_frame_pointer = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+      opt_omit_frame_pointer = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-foptimize-sibling-calls")) {
+      sibling_calls = 1;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-optimize-sibling-calls")) {
+      sibling_calls = 0;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fif-conversion")) {
+      opt_if_conversion = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-if-conversion")) {
+      opt_if_conversion = false;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fvectorize")) {
+      opt_vectorize = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fno-vectorize")) {
+      opt_vectorize = false;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fmemcpy-threshold=", 19)) {
+      opt_memcpy_threshold = atoi(argv[i] + 19);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-finline-limit=", 15)) {
+      opt_inline_limit = atoi(argv[i] + 15);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-funroll-factor=", 16)) {
+      opt_unroll_factor = atoi(argv[i] + 16);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--dump-ir")) {
+      opt_dump_ir = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--inline-report")) {
+      opt_inline_report = true;
+      continue;
+    }
+
     if (argv[i][0] == '-' && argv[i][1] != '\0')
       error("unknown argument: %s", argv[i]);
 
@@ -34,6 +165,16 @@ static void parse_args(int argc, char **argv) {
 
   if (!input_path)
     error("no input files");
+
+  if (opt_dump_ir && opt_O == 0)
+    error("--dump-ir requires -O1 or higher");
+
+  // The peephole optimizer is enabled by -O1 and higher by default.
+  opt_peephole = (peephole == -1) ? (opt_O > 0) : peephole;
+
+  // So are sibling calls, which drop the caller's frame from backtraces.
+  opt_optimize_sibling_calls =
+    (sibling_calls == -1) ? (opt_O > 0) : sibling_calls;
 }
 
 static FILE *open_file(char *path) {
@@ -49,13 +190,61 @@ static FILE *open_file(char *path) {
 int main(int argc, char **argv) {
   parse_args(argc, argv);
 
+  if (opt_stats)
+    stats_enable(opt_stats);
+
   // Tokenize and parse.
   Token *tok = tokenize_file(input_path);
+
+  phase_begin(PHASE_PARSE);
   Obj *prog = parse(tok);
+  phase_end();
+
+  // At -O2, small functions are inlined into their callers.
+  if (opt_O > 1) {
+    phase_begin(add_phase("inline"));
+    inline_functions(prog, input_path, opt_inline_report ? stderr : NULL);
+    phase_end();
+  }
+
+  // Code that can never run is removed at every level, and code that
+  // has no effect with optimization enabled.
+  phase_begin(add_phase("dead-code"));
+  eliminate_dead_code(prog, opt_O);
+  phase_end();
+
+  // With optimization enabled, lower the AST to IR and optimize it.
+  // Otherwise the AST is compiled directly.
+  if (opt_O > 0) {
+    phase_begin(PHASE_GEN_IR);
+    gen_ir(prog);
+    phase_end();
+
+    optimize(prog, opt_O);
+
+    if (opt_dump_ir)
+      dump_ir(prog, stderr);
+
+    phase_begin(PHASE_REGALLOC);
+    alloc_regs(prog);
+    phase_end();
+  }
 
   // Traverse the AST to emit assembly.
   FILE *out = open_file(opt_o);
   fprintf(out, ".file 1 \"%s\"\n", input_path);
+
+  phase_begin(PHASE_CODEGEN);
   codegen(prog, out);
+  phase_end();
+
+  print_stats(stderr);
+
+  if (opt_size_report) {
+    if (!strcmp(opt_size_report, "-"))
+      print_size_report(stderr);
+    else
+      print_size_report(open_file(opt_size_report));
+  }
   return 0;
 }
@@ -0,0 +1,3142 @@
+// This file contains the optimizer, which transforms functions in IR
+// form. Each optimization is a pass that takes a function and rewrites
+// it in place. Which passes run depends on the -O level.
+
+#include "chibicc.h"
+
+typedef struct {
+  char *name;
+  int level; // Minimum -O level that enables this pass
+  void (*run)(Obj *fn);
+} Pass;
+
+static bool reads(Ir *ir, Reg *r) {
+  Reg **ops[MAX_OPERANDS];
+  int nops = get_operands(ir, ops);
+  for (int i = 0; i < nops; i++)
+    if (*ops[i] == r)
+      return true;
+  return false;
+}
+
+static bool writes(Ir *ir, Reg *r) {
+  Reg *defs[2];
+  int ndefs = get_defs(ir, defs);
+  for (int i = 0; i < ndefs; i++)
+    if (defs[i] == r)
+      return true;
+  return false;
+}
+
+// Forget what is known about the registers an instruction writes.
+static void kill_defs(Ir **map, Ir *ir) {
+  Reg *defs[2];
+  int ndefs = get_defs(ir, defs);
+  for (int i = 0; i < ndefs; i++)
+    map[defs[i]->vn] = NULL;
+}
+
+// Returns the successors of a given basic block.
+static int get_succs(BB *bb, BB **succs) {
+  Ir *ir = bb->last;
+  if (ir->kind == IR_JMP) {
+    succs[0] = ir->bb1;
+    return 1;
+  }
+  if (ir->kind == IR_BR) {
+    succs[0] = ir->bb1;
+    succs[1] = ir->bb2;
+    return 2;
+  }
+  return 0;
+}
+
+//
+// Control flow graph simplification
+//
+
+// If `bb` contains nothing but an unconditional jump, returns the
+// jump target. Otherwise, returns `bb`.
+static BB *skip_empty(BB *bb) {
+  for (int i = 0; i < 100; i++) {
+    if (bb->first != bb->last || bb->first->kind != IR_JMP || bb->first->bb1 == bb)
+      return bb;
+    bb = bb->first->bb1;
+  }
+  return bb;
+}
+
+static void remove_unreachable(Obj *fn) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->reachable = false;
+
+  // Each block is pushed to the stack at most once.
+  int nbbs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    nbbs++;
+
+  BB **stack = calloc(nbbs, sizeof(BB *));
+  int len = 0;
+  stack[len++] = fn->bbs;
+  fn->bbs->reachable = true;
+
+  while (len > 0) {
+    BB *succs[2];
+    int n = get_succs(stack[--len], succs);
+    for (int i = 0; i < n; i++) {
+      if (!succs[i]->reachable) {
+        succs[i]->reachable = true;
+        stack[len++] = succs[i];
+      }
+    }
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    while (bb->next && !bb->next->reachable)
+      bb->next = bb->next->next;
+}
+
+static void simplify_cfg(Obj *fn) {
+  // Make jumps to empty blocks jump to their final destinations.
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    Ir *ir = bb->last;
+    if (ir->kind == IR_JMP || ir->kind == IR_BR)
+      ir->bb1 = skip_empty(ir->bb1);
+    if (ir->kind == IR_BR)
+      ir->bb2 = skip_empty(ir->bb2);
+
+    if (ir->kind == IR_BR && ir->bb1 == ir->bb2) {
+      ir->kind = IR_JMP;
+      ir->a = NULL;
+      ir->bb2 = NULL;
+    }
+  }
+
+  remove_unreachable(fn);
+
+  // Merge a block into its predecessor if that is the only way to
+  // reach the block.
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->npreds = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    BB *succs[2];
+    int n = get_succs(bb, succs);
+    for (int i = 0; i < n; i++)
+      succs[i]->npreds++;
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!bb->reachable)
+      continue;
+
+    for (;;) {
+      Ir *jmp = bb->last;
+      if (jmp->kind != IR_JMP)
+        break;
+
+      BB *succ = jmp->bb1;
+      if (succ == bb || succ == fn->bbs || succ->npreds != 1)
+        break;
+
+      remove_ir(bb, jmp);
+      for (Ir *ir = succ->first, *next; ir; ir = next) {
+        next = ir->next;
+        insert_ir(bb, NULL, ir);
+      }
+      succ->reachable = false;
+    }
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    while (bb->next && !bb->next->reachable)
+      bb->next = bb->next->next;
+}
+
+//
+// Constant folding
+//
+
+static bool eval(Ir *ir, int64_t a, int64_t b, int64_t *res) {
+  switch (ir->kind) {
+  case IR_ADD:
+    *res = (uint64_t)a + b;
+    return true;
+  case IR_SUB:
+    *res = (uint64_t)a - b;
+    return true;
+  case IR_MUL:
+    *res = (uint64_t)a * b;
+    return true;
+  case IR_DIV:
+    // sdiv returns 0 when dividing by zero, but we leave it to the
+    // hardware instead of replicating corner cases.
+    if (b == 0 || (a == INT64_MIN && b == -1))
+      return false;
+    *res = a / b;
+    return true;
+  case IR_NEG:
+    *res = -(uint64_t)a;
+    return true;
+  case IR_ZEXT:
+    *res = (ir->size == 4) ? (uint32_t)a : (ir->size == 2) ? (uint16_t)a : (uint8_t)a;
+    return true;
+  case IR_EQ:
+    *res = (a == b);
+    return true;
+  case IR_NE:
+    *res = (a != b);
+    return true;
+  case IR_LT:
+    *res = (a < b);
+    return true;
+  case IR_LE:
+    *res = (a <= b);
+    return true;
+  }
+  return false;
+}
+
+// Replace arithmetic on constants with the result. This is done
+// within each basic block, where it is easy to tell which virtual
+// registers hold constants.
+static void fold_constants(Obj *fn) {
+  Ir **def = calloc(fn->nregs, sizeof(Ir *));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      Ir *a = ir->a ? def[ir->a->vn] : NULL;
+      Ir *b = ir->b ? def[ir->b->vn] : NULL;
+      int64_t val;
+
+      if (ir->kind == IR_MOV && a) {
+        ir->kind = IR_IMM;
+        ir->imm = a->imm;
+        ir->a = NULL;
+      } else if (ir->d && a && (b || !ir->b) &&
+                 eval(ir, a->imm, b ? b->imm : ir->imm, &val)) {
+        ir->kind = IR_IMM;
+        ir->imm = val;
+        ir->a = ir->b = NULL;
+      }
+
+      kill_defs(def, ir);
+      if (ir->kind == IR_IMM)
+        def[ir->d->vn] = ir;
+    }
+
+    // Forget constants at the end of the block.
+    for (Ir *ir = bb->first; ir; ir = ir->next)
+      kill_defs(def, ir);
+  }
+}
+
+//
+// Immediate operands
+//
+
+static bool has_imm_form(IrKind kind) {
+  return kind == IR_ADD || kind == IR_SUB || kind == IR_MUL || kind == IR_DIV ||
+         kind == IR_EQ || kind == IR_NE || kind == IR_LT || kind == IR_LE;
+}
+
+static bool is_commutative(IrKind kind) {
+  return kind == IR_ADD || kind == IR_MUL || kind == IR_EQ || kind == IR_NE;
+}
+
+// Returns true if a constant can be an immediate operand.
+static bool is_imm_operand(IrKind kind, int64_t val) {
+  // The code generator picks an instruction sequence for each
+  // multiplier and divisor.
+  if (kind == IR_MUL)
+    return true;
+  if (kind == IR_DIV)
+    return val != 0;
+
+  // A negative constant is fine as long as its negation fits,
+  // because the code generator can use sub for add and cmn for cmp.
+  return val != INT64_MIN && (is_add_imm(val) || is_add_imm(-val));
+}
+
+// Use the immediate forms of instructions for constant operands.
+static void fold_immediates(Obj *fn) {
+  Ir **def = calloc(fn->nregs, sizeof(Ir *));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      if (has_imm_form(ir->kind) && ir->b) {
+        Ir *a = def[ir->a->vn];
+        Ir *b = def[ir->b->vn];
+
+        // Move a constant to the right if the operation is commutative.
+        if (!b && a && is_commutative(ir->kind)) {
+          Reg *tmp = ir->a;
+          ir->a = ir->b;
+          ir->b = tmp;
+          b = a;
+        }
+
+        if (b && is_imm_operand(ir->kind, b->imm)) {
+          ir->imm = b->imm;
+          ir->b = NULL;
+        }
+      }
+
+      kill_defs(def, ir);
+      if (ir->kind == IR_IMM)
+        def[ir->d->vn] = ir;
+    }
+
+    for (Ir *ir = bb->first; ir; ir = ir->next)
+      kill_defs(def, ir);
+  }
+}
+
+//
+// Block-local definitions
+//
+// Passes that fold one instruction into a later one track, while
+// walking a block, which instruction last assigned each register.
+// An instruction can be folded into a later one only if none of its
+// operands have been reassigned in between, which is checked by
+// comparing the positions at which registers were last assigned.
+//
+
+static Ir **def;
+static int *last_def;
+
+static void init_defs(Obj *fn) {
+  def = calloc(fn->nregs, sizeof(Ir *));
+  last_def = calloc(fn->nregs, sizeof(int));
+}
+
+// Record the registers written by the instruction at `pos`.
+static void record_defs(Ir *ir, int pos) {
+  Reg *defs[2];
+  int ndefs = get_defs(ir, defs);
+  for (int i = 0; i < ndefs; i++) {
+    def[defs[i]->vn] = (defs[i] == ir->d) ? ir : NULL;
+    last_def[defs[i]->vn] = pos;
+  }
+}
+
+// Forget the definitions at the end of a block.
+static void clear_defs(BB *bb) {
+  for (Ir *ir = bb->first; ir; ir = ir->next) {
+    Reg *defs[2];
+    int ndefs = get_defs(ir, defs);
+    for (int i = 0; i < ndefs; i++) {
+      def[defs[i]->vn] = NULL;
+      last_def[defs[i]->vn] = 0;
+    }
+  }
+}
+
+// Returns the instruction that computed the current value of `r` in
+// the current block if its operands still hold the same values.
+static Ir *get_def(Reg *r) {
+  Ir *ir = def[r->vn];
+  if (!ir)
+    return NULL;
+
+  Reg **ops[MAX_OPERANDS];
+  int nops = get_operands(ir, ops);
+  for (int i = 0; i < nops; i++)
+    if (last_def[(*ops[i])->vn] >= last_def[r->vn])
+      return NULL;
+  return ir;
+}
+
+//
+// Addressing modes
+//
+
+static int log2_exact(int64_t val) {
+  for (int i = 0; i < 63; i++)
+    if (val == (1LL << i))
+      return i;
+  return -1;
+}
+
+// If `r` is `x * size`, returns x.
+static Reg *scaled_index(Reg *r, int size) {
+  Ir *ir = get_def(r);
+  if (ir && ir->kind == IR_MUL && !ir->b && ir->imm == size)
+    return ir->a;
+  return NULL;
+}
+
+static void fold_address(Ir *ir) {
+  for (;;) {
+    Ir *addr = get_def(ir->a);
+    if (!addr)
+      return;
+
+    // [x29, #offset]
+    if (addr->kind == IR_LVAR) {
+      ir->var = addr->var;
+      ir->a = NULL;
+      return;
+    }
+
+    if (addr->kind != IR_ADD || addr->shift || addr->size)
+      return;
+
+    // [base, #offset], typically a struct member. The offset is kept
+    // small so that it costs a single add at worst.
+    if (!addr->b) {
+      int64_t imm = ir->imm + addr->imm;
+      if (imm <= -4096 || 4096 <= imm)
+        return;
+      ir->a = addr->a;
+      ir->imm = imm;
+      continue;
+    }
+
+    // [base, index, lsl #log2(size)] or [base, index]
+    if (ir->imm)
+      return;
+
+    Reg *index;
+    if ((index = scaled_index(addr->b, ir->size))) {
+      ir->a = addr->a;
+      ir->index = index;
+      ir->shift = log2_exact(ir->size);
+    } else if ((index = scaled_index(addr->a, ir->size))) {
+      ir->a = addr->b;
+      ir->index = index;
+      ir->shift = log2_exact(ir->size);
+    } else {
+      ir->a = addr->a;
+      ir->index = addr->b;
+    }
+    return;
+  }
+}
+
+// Fold address computations into the addressing modes of loads and
+// stores.
+static void fold_addresses(Obj *fn) {
+  init_defs(fn);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    int pos = 1;
+    for (Ir *ir = bb->first; ir; ir = ir->next, pos++) {
+      if ((ir->kind == IR_LOAD || ir->kind == IR_STORE) && ir->a && !ir->index)
+        fold_address(ir);
+      record_defs(ir, pos);
+    }
+    clear_defs(bb);
+  }
+}
+
+//
+// Instruction combining
+//
+
+static int *nuses;
+static int *ndefs;
+
+// Count the uses and the definitions of each register.
+static void count_regs(Obj *fn) {
+  nuses = calloc(fn->nregs, sizeof(int));
+  ndefs = calloc(fn->nregs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      Reg **ops[MAX_OPERANDS];
+      int nops = get_operands(ir, ops);
+      for (int i = 0; i < nops; i++)
+        nuses[(*ops[i])->vn]++;
+
+      Reg *defs[2];
+      int n = get_defs(ir, defs);
+      for (int i = 0; i < n; i++)
+        ndefs[defs[i]->vn]++;
+    }
+  }
+}
+
+// Returns the instruction that computed `r` if that is the only
+// definition and this is the only use of `r`, so that the instruction
+// can be merged into the user.
+static Ir *get_single_def(Reg *r) {
+  if (!r || nuses[r->vn] != 1 || ndefs[r->vn] != 1)
+    return NULL;
+  return get_def(r);
+}
+
+// Make b of add or sub `b << shift`, zero-extended first if possible.
+// Only shifts of up to 4 bits can be combined with an extension.
+static void use_shifted_operand(Ir *ir, Reg *b, int shift) {
+  ir->b = b;
+  ir->shift = shift;
+
+  Ir *ext = get_single_def(b);
+  if (ext && ext->kind == IR_ZEXT && shift <= 4) {
+    ir->b = ext->a;
+    ir->size = ext->size;
+  }
+}
+
+// Merge the instruction computing b of add or sub into it. Returns
+// false if it cannot be merged.
+//
+// b may already be shifted, as in an address computed by strength
+// reduction. A shift composes with a negation and with another
+// shift, but b can be zero-extended only once and only before it is
+// shifted.
+static bool combine_operand(Ir *ir) {
+  Ir *op = get_single_def(ir->b);
+  if (!op || ir->size)
+    return false;
+
+  switch (op->kind) {
+  case IR_NEG:
+    // a + -b => a - b, a - -b => a + b
+    ir->kind = (ir->kind == IR_ADD) ? IR_SUB : IR_ADD;
+    ir->b = op->a;
+    return true;
+  case IR_ZEXT:
+    if (ir->shift > 4)
+      return false;
+    ir->b = op->a;
+    ir->size = op->size;
+    return true;
+  case IR_MUL:
+    // a + b * 2^k => add with a shifted operand
+    if (!op->b && log2_exact(op->imm) > 0 &&
+        ir->shift + log2_exact(op->imm) < 64) {
+      use_shifted_operand(ir, op->a, ir->shift + log2_exact(op->imm));
+      return true;
+    }
+
+    // a + b * -2^k => sub with a shifted operand
+    if (!op->b && op->imm != INT64_MIN && log2_exact(-op->imm) > 0 &&
+        ir->shift + log2_exact(-op->imm) < 64) {
+      ir->kind = (ir->kind == IR_ADD) ? IR_SUB : IR_ADD;
+      use_shifted_operand(ir, op->a, ir->shift + log2_exact(-op->imm));
+      return true;
+    }
+
+    // madd and msub take no shifted operand.
+    if (ir->shift)
+      return false;
+
+    // A constant multiplier is loaded to the register that held the
+    // product if mul would be needed anyway.
+    if (!op->b) {
+      if (is_cheap_mul(op->imm))
+        return false;
+      ir->b = op->a;
+      ir->c = op->d;
+      op->kind = IR_IMM;
+      op->a = NULL;
+    } else {
+      ir->b = op->a;
+      ir->c = op->b;
+    }
+
+    ir->kind = (ir->kind == IR_ADD) ? IR_MADD : IR_MSUB;
+    return true;
+  }
+  return false;
+}
+
+static void combine(Ir *ir) {
+  if (ir->kind == IR_ADD && ir->b) {
+    if (combine_operand(ir) || ir->shift || ir->size)
+      return;
+
+    // Try again with the operands swapped.
+    Reg *tmp = ir->a;
+    ir->a = ir->b;
+    ir->b = tmp;
+    if (!combine_operand(ir)) {
+      ir->b = ir->a;
+      ir->a = tmp;
+    }
+    return;
+  }
+
+  if (ir->kind == IR_SUB && ir->b) {
+    combine_operand(ir);
+    return;
+  }
+
+  // -(a * b) => mneg
+  if (ir->kind == IR_NEG) {
+    Ir *op = get_single_def(ir->a);
+    if (op && op->kind == IR_MUL && op->b) {
+      ir->kind = IR_MNEG;
+      ir->a = op->a;
+      ir->b = op->b;
+    }
+  }
+}
+
+// Select instructions that do the work of two: madd and msub for
+// multiply-add, add and sub with a shifted or a zero-extended operand,
+// and sub instead of adding a negated value. An instruction is merged
+// into its only user, and DCE removes it afterwards.
+static void combine_insns(Obj *fn) {
+  count_regs(fn);
+  init_defs(fn);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    int pos = 1;
+    for (Ir *ir = bb->first; ir; ir = ir->next, pos++) {
+      combine(ir);
+      record_defs(ir, pos);
+    }
+    clear_defs(bb);
+  }
+}
+
+// Returns true if an instruction is a load or a store through
+// register `a` without an offset.
+static bool is_plain_access(Ir *ir) {
+  return (ir->kind == IR_LOAD || ir->kind == IR_STORE) && ir->a &&
+         !ir->index && !ir->imm && !ir->pre_index && !ir->post_index;
+}
+
+// Returns true if an instruction is `p = add p, imm` where imm fits in
+// the 9-bit offset of a pre- or post-indexed load or store.
+static bool is_increment(Ir *ir) {
+  return ir->kind == IR_ADD && !ir->b && ir->d == ir->a &&
+         -256 <= ir->imm && ir->imm <= 255;
+}
+
+// Returns true if the base register of a load or a store can be
+// updated by the access itself. The base cannot be the loaded or
+// stored register. A vector access can only be followed by an
+// increment of its size.
+static bool can_writeback(Ir *ir, Reg *p, Ir *inc, bool post) {
+  if (ir->size == 16 && (!post || inc->imm != 16))
+    return false;
+  return ir->d != p && ir->b != p;
+}
+
+// Merge a pointer increment into an adjacent load or store. This is
+// for code that walks an array with a pointer:
+//
+//   *p; p = p + 8  => ldr [p], #8
+//   p = p + 8; *p  => ldr [p, #8]!
+static void use_writeback(Obj *fn) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      if (!is_plain_access(ir))
+        continue;
+
+      Reg *p = ir->a;
+
+      // Post-index: find the increment after the access.
+      Ir *inc = ir->next;
+      while (inc && !reads(inc, p) && !writes(inc, p))
+        inc = inc->next;
+      if (inc && is_increment(inc) && inc->d == p &&
+          can_writeback(ir, p, inc, true)) {
+        ir->post_index = true;
+        ir->imm = inc->imm;
+        remove_ir(bb, inc);
+        continue;
+      }
+
+      // Pre-index: find the increment before the access.
+      inc = ir->prev;
+      while (inc && !reads(inc, p) && !writes(inc, p))
+        inc = inc->prev;
+      if (inc && is_increment(inc) && inc->d == p &&
+          can_writeback(ir, p, inc, false)) {
+        ir->pre_index = true;
+        ir->imm = inc->imm;
+        remove_ir(bb, inc);
+      }
+    }
+  }
+}
+
+//
+// Copy propagation
+//
+
+// The copies made so far in the current block. copies[d] is `a` of
+// the active `d = mov a`.
+static Reg **copies;
+static Ir **active;
+static int nactive;
+
+static void init_copies(Obj *fn) {
+  copies = calloc(fn->nregs, sizeof(Reg *));
+  active = calloc(fn->nregs, sizeof(Ir *));
+  nactive = 0;
+}
+
+// Replace the registers `ir` reads with the ones they are copies of.
+static void forward_copies(Ir *ir) {
+  Reg **ops[MAX_OPERANDS];
+  int nops = get_operands(ir, ops);
+  for (int i = 0; i < nops; i++)
+    if (copies[(*ops[i])->vn])
+      *ops[i] = copies[(*ops[i])->vn];
+}
+
+// Forget copies invalidated by `ir`, and remember the one it makes.
+static void track_copies(Ir *ir) {
+  for (int i = 0; i < nactive; i++) {
+    Ir *mov = active[i];
+    if (writes(ir, mov->d) || writes(ir, mov->a)) {
+      copies[mov->d->vn] = NULL;
+      active[i--] = active[--nactive];
+    }
+  }
+
+  if (ir->kind == IR_MOV && ir->a != ir->d) {
+    copies[ir->d->vn] = ir->a;
+    active[nactive++] = ir;
+  }
+}
+
+// Forget the copies at the end of a block.
+static void clear_copies(void) {
+  for (int i = 0; i < nactive; i++)
+    copies[active[i]->d->vn] = NULL;
+  nactive = 0;
+}
+
+// After `d = mov a`, replace uses of `d` with `a` in the rest of the
+// block as long as neither register is reassigned. Copies are created
+// for every read of a promoted variable, and this makes most of them
+// dead.
+static void propagate_copies(Obj *fn) {
+  init_copies(fn);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      forward_copies(ir);
+      track_copies(ir);
+    }
+    clear_copies();
+  }
+}
+
+// Rewrite `t = op ...; x = mov t` to `x = op ...; t = mov x` where `t`
+// is a temporary, so that a value assigned to a promoted variable is
+// computed directly into the variable's register. The new copy is
+// usually dead or removed by copy propagation.
+static void coalesce_copies(Obj *fn) {
+  int *ndefs = calloc(fn->nregs, sizeof(int));
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      Reg *defs[2];
+      int n = get_defs(ir, defs);
+      for (int i = 0; i < n; i++)
+        ndefs[defs[i]->vn]++;
+    }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *mov = bb->first; mov; mov = mov->next) {
+      if (mov->kind != IR_MOV || ndefs[mov->a->vn] != 1)
+        continue;
+
+      Reg *x = mov->d;
+      Reg *t = mov->a;
+
+      // Find the definition of `t`. `x` must not be used in between,
+      // and neither may `t`, which will be defined later.
+      Ir *def = mov->prev;
+      for (; def && def->d != t; def = def->prev)
+        if (writes(def, x) || reads(def, x) || reads(def, t))
+          break;
+      if (!def || def->d != t || def->kind == IR_ARG)
+        continue;
+
+      def->d = x;
+      mov->d = t;
+      mov->a = x;
+    }
+  }
+}
+
+//
+// If-conversion
+//
+// A branch around a few instructions that only compute values is
+// replaced by running the instructions of both arms and picking the
+// results with csel, csinc, csneg or cset:
+//
+//   if (a < b) x = b; else x = a;  =>  cmp; csel
+//
+// The instructions of each arm are moved before the branch and made
+// to write fresh registers. Then a select assigns each register
+// written by either arm the value from the arm that would have run.
+// A mispredicted branch costs more than a dozen cycles, but one that
+// is predicted well is nearly free, so only arms that add a few
+// instructions to every execution are converted.
+//
+
+// Maximum cost of the instructions of both arms plus the selects
+#define IFCVT_MAX_COST 6
+
+// The instructions of an arm and the fresh registers they write
+typedef struct {
+  Reg *from[IFCVT_MAX_COST];
+  Reg *to[IFCVT_MAX_COST];
+  Ir *def[IFCVT_MAX_COST];
+  int n;
+} Arm;
+
+// An operand of a select
+typedef struct {
+  Reg *r;    // NULL for zero
+  int op;    // 1 to increment r, -1 to negate it
+  bool zext; // r is only used in its lower 32 bits
+} SelOperand;
+
+// Registers whose definitions all leave the upper 32 bits zero
+static bool *is_zext;
+static int nzext;
+
+static Arm then_arm, else_arm;
+
+static bool defines_zext(Ir *ir, Reg *r) {
+  if (r != ir->d)
+    return false;
+
+  switch (ir->kind) {
+  case IR_ZEXT:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+    return true;
+  case IR_IMM:
+    return 0 <= ir->imm && ir->imm <= UINT32_MAX;
+  case IR_LOAD:
+    return ir->size <= 4;
+  case IR_SEL:
+    return ir->size == 4;
+  }
+  return false;
+}
+
+static void find_zext_regs(Obj *fn) {
+  nzext = fn->nregs;
+  is_zext = calloc(nzext, sizeof(bool));
+  memset(is_zext, true, nzext);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      Reg *defs[2];
+      int n = get_defs(ir, defs);
+      for (int i = 0; i < n; i++)
+        if (!defines_zext(ir, defs[i]))
+          is_zext[defs[i]->vn] = false;
+    }
+  }
+}
+
+// Returns the cost of running an instruction on a path where the
+// program would not, or -1 if that would change the behavior.
+static int speculation_cost(Ir *ir) {
+  switch (ir->kind) {
+  case IR_IMM:
+  case IR_MOV:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_NEG:
+  case IR_ZEXT:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_SEL:
+  case IR_LVAR:
+    return 1;
+  case IR_GVAR:
+    return 2;
+  case IR_MUL:
+  case IR_MADD:
+  case IR_MSUB:
+  case IR_MNEG:
+    return 3;
+  }
+  return -1;
+}
+
+static bool same_address(Ir *x, Ir *y) {
+  return x->a == y->a && x->index == y->index && x->shift == y->shift &&
+         x->imm == y->imm && x->var == y->var && !x->pre_index &&
+         !x->post_index && !y->pre_index && !y->post_index;
+}
+
+static bool writes_address(Ir *ir, Ir *load) {
+  return (load->a && writes(ir, load->a)) ||
+         (load->index && writes(ir, load->index));
+}
+
+// Returns true if a load in an arm reads memory that `bb`, which
+// branches to the arm, has already read. Such a load can run on
+// either path, as in `if (p[i] > m) m = p[i];`.
+static bool is_reload(BB *bb, BB *arm, Ir *load) {
+  for (Ir *ir = arm->first; ir != load; ir = ir->next)
+    if (writes_address(ir, load))
+      return false;
+
+  for (Ir *ir = bb->last; ir; ir = ir->prev) {
+    if (ir->kind == IR_STORE || ir->kind == IR_MEMCPY || ir->kind == IR_CALL ||
+        writes_address(ir, load))
+      return false;
+    if (ir->kind == IR_LOAD && ir->size == load->size && same_address(ir, load))
+      return true;
+  }
+  return false;
+}
+
+// Returns the cost of the instructions of an arm that jumps to `join`,
+// or -1 if the arm cannot be converted. If the arm is `join` itself,
+// it is empty.
+static int arm_cost(Obj *fn, BB *bb, BB *arm, BB *join) {
+  if (arm == join)
+    return 0;
+  if (arm == fn->bbs || arm->npreds != 1 || arm->last->kind != IR_JMP ||
+      arm->last->bb1 != join)
+    return -1;
+
+  int cost = 0;
+  for (Ir *ir = arm->first; ir != arm->last; ir = ir->next) {
+    int c = speculation_cost(ir);
+    if (ir->kind == IR_LOAD && is_reload(bb, arm, ir))
+      c = 1;
+    if (c < 0)
+      return -1;
+    cost += c;
+  }
+  return cost;
+}
+
+static Reg *renamed(Arm *arm, Reg *r) {
+  for (int i = arm->n - 1; i >= 0; i--)
+    if (arm->from[i] == r)
+      return arm->to[i];
+  return r;
+}
+
+static bool is_arm_output(Reg *r) {
+  return renamed(&then_arm, r) != r || renamed(&else_arm, r) != r;
+}
+
+// Move the instructions of an arm to `bb` before its branch and make
+// them write fresh registers.
+static void hoist_arm(Obj *fn, BB *bb, BB *arm, BB *join, Arm *out) {
+  out->n = 0;
+  if (arm == join)
+    return;
+
+  for (Ir *ir = arm->first, *next; ir != arm->last; ir = next) {
+    next = ir->next;
+
+    Reg **ops[MAX_OPERANDS];
+    int nops = get_operands(ir, ops);
+    for (int i = 0; i < nops; i++)
+      *ops[i] = renamed(out, *ops[i]);
+
+    out->from[out->n] = ir->d;
+    out->def[out->n] = ir;
+    ir->d = out->to[out->n++] = new_reg(fn);
+
+    remove_ir(arm, ir);
+    insert_ir(bb, bb->last, ir);
+  }
+}
+
+// Returns the hoisted instruction that computes `r`, if any.
+static Ir *arm_def(Reg *r) {
+  for (int i = 0; i < then_arm.n; i++)
+    if (then_arm.to[i] == r)
+      return then_arm.def[i];
+  for (int i = 0; i < else_arm.n; i++)
+    if (else_arm.to[i] == r)
+      return else_arm.def[i];
+  return NULL;
+}
+
+// Returns the operand of a select assigning `x` for value `v`. The
+// hoisted instruction computing `v` is merged into the select if
+// possible. A 32-bit zero extension is merged if `zext` is true, and
+// an increment or a negation if `fold` is true. The select may read
+// only registers that the other selects do not write.
+static SelOperand sel_operand(Reg *v, Reg *x, bool zext, bool fold) {
+  SelOperand o = {v};
+  Ir *def = arm_def(v);
+
+  if (zext && def && def->kind == IR_ZEXT && def->size == 4) {
+    o.r = def->a;
+    o.zext = true;
+    def = arm_def(o.r);
+  }
+
+  if (!def)
+    return o;
+
+  if (def->kind == IR_IMM && def->imm == 0) {
+    o.r = NULL;
+  } else if (fold && def->kind == IR_IMM && def->imm == 1) {
+    o.r = NULL;
+    o.op = 1;
+  } else if (fold && (def->a == x || !is_arm_output(def->a))) {
+    if (def->kind == IR_ADD && !def->b && def->imm == 1) {
+      o.r = def->a;
+      o.op = 1;
+    } else if (def->kind == IR_NEG) {
+      o.r = def->a;
+      o.op = -1;
+    }
+  }
+  return o;
+}
+
+// Returns true if the lower 32 bits of an operand zero-extended are
+// its value.
+static bool fits_in_32_bits(SelOperand o) {
+  return o.zext || !o.r || (!o.op && o.r->vn < nzext && is_zext[o.r->vn]);
+}
+
+// Emit a select that assigns `x` before `pos`.
+static void emit_sel(BB *bb, Ir *pos, Reg *cond, Reg *x) {
+  Reg *vt = renamed(&then_arm, x);
+  Reg *vf = renamed(&else_arm, x);
+
+  // Use a 32-bit select if that merges a zero extension.
+  SelOperand t = sel_operand(vt, x, true, true);
+  SelOperand f = sel_operand(vf, x, true, true);
+  bool w = (t.zext || f.zext) && fits_in_32_bits(t) && fits_in_32_bits(f);
+  if (!w) {
+    t = sel_operand(vt, x, false, true);
+    f = sel_operand(vf, x, false, true);
+  }
+  if (t.op && f.op)
+    f = sel_operand(vf, x, w, false);
+
+  Ir *sel = new_ir(IR_SEL);
+  sel->line_no = pos->line_no;
+  sel->d = x;
+  sel->a = cond;
+  sel->size = w ? 4 : 0;
+
+  // Only the second operand can be incremented or negated.
+  if (t.op) {
+    SelOperand tmp = t;
+    t = f;
+    f = tmp;
+    sel->invert = true;
+  }
+  sel->b = t.r;
+  sel->c = f.r;
+  sel->imm = f.op;
+  insert_ir(bb, pos, sel);
+}
+
+// Registers written by an arm, except temporaries that are not used
+// outside of it.
+static int arm_outputs(BB *arm, BB *join, Reg **outs, int n) {
+  if (arm == join)
+    return n;
+
+  for (Ir *ir = arm->first; ir != arm->last; ir = ir->next) {
+    Reg *x = ir->d;
+    bool seen = false;
+    for (int i = 0; i < n; i++)
+      seen |= (outs[i] == x);
+    if (seen)
+      continue;
+
+    int uses = 0;
+    for (Ir *p = arm->first; p != arm->last; p = p->next)
+      uses += reads(p, x);
+    if (ndefs[x->vn] == 1 && nuses[x->vn] == uses)
+      continue;
+    outs[n++] = x;
+  }
+  return n;
+}
+
+static bool convert_if(Obj *fn, BB *bb) {
+  Ir *br = bb->last;
+  BB *then = br->bb1;
+  BB *els = br->bb2;
+
+  // Find the block where the arms meet.
+  BB *join = NULL;
+  if (then->last->kind == IR_JMP &&
+      (els == then->last->bb1 ||
+       (els->last->kind == IR_JMP && els->last->bb1 == then->last->bb1)))
+    join = then->last->bb1;
+  else if (els->last->kind == IR_JMP && els->last->bb1 == then)
+    join = then;
+  if (!join || join == bb)
+    return false;
+
+  int then_cost = arm_cost(fn, bb, then, join);
+  int else_cost = arm_cost(fn, bb, els, join);
+  if (then_cost < 0 || else_cost < 0)
+    return false;
+
+  Reg *outs[IFCVT_MAX_COST * 2];
+  int nouts = arm_outputs(then, join, outs, 0);
+  nouts = arm_outputs(els, join, outs, nouts);
+  if (then_cost + else_cost + nouts > IFCVT_MAX_COST)
+    return false;
+
+  Reg *cond = br->a;
+  for (int i = 0; i < nouts; i++)
+    if (outs[i] == cond)
+      return false;
+
+  Ir *cmp = br->prev;
+  hoist_arm(fn, bb, then, join, &then_arm);
+  hoist_arm(fn, bb, els, join, &else_arm);
+
+  // Move the comparison next to the selects so that they can use its
+  // flags.
+  if (cmp && cmp->d == cond) {
+    bool read = false;
+    for (Ir *ir = cmp->next; ir != br; ir = ir->next)
+      read |= reads(ir, cond);
+    if (!read) {
+      remove_ir(bb, cmp);
+      insert_ir(bb, br, cmp);
+    }
+  }
+
+  for (int i = 0; i < nouts; i++)
+    emit_sel(bb, br, cond, outs[i]);
+
+  br->kind = IR_JMP;
+  br->a = NULL;
+  br->bb1 = join;
+  br->bb2 = NULL;
+  return true;
+}
+
+// Convert branches to selects. Converting an inner if statement may
+// make an outer one convertible, so repeat until nothing changes.
+static void convert_ifs(Obj *fn) {
+  if (!opt_if_conversion)
+    return;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+      bb->npreds = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      BB *succs[2];
+      int n = get_succs(bb, succs);
+      for (int i = 0; i < n; i++)
+        succs[i]->npreds++;
+    }
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      if (bb->last->kind != IR_BR)
+        continue;
+      count_regs(fn);
+      find_zext_regs(fn);
+      if (convert_if(fn, bb))
+        changed = true;
+    }
+
+    if (changed)
+      simplify_cfg(fn);
+  }
+}
+
+//
+// Common subexpression elimination
+//
+// Value numbering within each basic block. An instruction computing a
+// value that is still held in a register becomes a copy of it, and the
+// rest of the block reads that register instead. This removes repeated
+// address computations such as global addresses and index multiplies,
+// and repeated loads of the same memory.
+//
+// A value is available until one of its operands or the register
+// holding it is reassigned. Loaded values are also forgotten at
+// stores, memcpy and calls because they may write any memory, but a
+// load from the address just stored to gets the stored value.
+//
+
+#define MAX_VALUES 128
+
+static bool is_pure(Ir *ir) {
+  switch (ir->kind) {
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_MADD:
+  case IR_MSUB:
+  case IR_NEG:
+  case IR_MNEG:
+  case IR_ZEXT:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_SEL:
+  case IR_LVAR:
+  case IR_GVAR:
+    return true;
+  case IR_LOAD:
+    return ir->size <= 8 && !ir->pre_index && !ir->post_index;
+  }
+  return false;
+}
+
+// Returns true if `y` computes the value that `x` has computed, or
+// loads the value that store `x` has stored.
+static bool same_value(Ir *x, Ir *y) {
+  if (x->kind == IR_STORE)
+    return y->kind == IR_LOAD && x->size == y->size && same_address(x, y);
+
+  if (x->kind != y->kind || x->c != y->c || x->imm != y->imm ||
+      x->size != y->size || x->var != y->var || x->exact != y->exact ||
+      x->invert != y->invert || x->index != y->index || x->shift != y->shift)
+    return false;
+  if (x->a == y->a && x->b == y->b)
+    return true;
+  return is_commutative(x->kind) && x->b && !x->shift && !x->size &&
+         x->a == y->b && x->b == y->a;
+}
+
+// Returns true if `ir` reassigns a register that `x` reads or writes.
+static bool clobbers(Ir *ir, Ir *x) {
+  Reg *defs[2];
+  int ndefs = get_defs(ir, defs);
+  for (int i = 0; i < ndefs; i++)
+    if (x->d == defs[i] || reads(x, defs[i]))
+      return true;
+
+  return (x->kind == IR_LOAD || x->kind == IR_STORE) &&
+         (ir->kind == IR_STORE || ir->kind == IR_MEMCPY || ir->kind == IR_CALL);
+}
+
+// Turn `ir` into a copy of the value computed or stored by `x`. A
+// stored value is truncated by the store and zero-extended by the load.
+static void reuse_value(Ir *ir, Ir *x) {
+  Ir *copy = new_ir(IR_MOV);
+  copy->line_no = ir->line_no;
+  copy->d = ir->d;
+  copy->a = x->d;
+
+  if (x->kind == IR_STORE) {
+    copy->a = x->b;
+    if (ir->size < 8) {
+      copy->kind = IR_ZEXT;
+      copy->size = ir->size;
+    }
+  }
+
+  copy->next = ir->next;
+  copy->prev = ir->prev;
+  *ir = *copy;
+}
+
+static void eliminate_common_subexprs(Obj *fn) {
+  Ir *vals[MAX_VALUES];
+  init_copies(fn);
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    int nvals = 0;
+
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      // Copies are forwarded so that values are compared by the
+      // registers they originally came from.
+      forward_copies(ir);
+
+      if (is_pure(ir)) {
+        for (int i = 0; i < nvals; i++) {
+          if (same_value(vals[i], ir)) {
+            reuse_value(ir, vals[i]);
+            break;
+          }
+        }
+      }
+
+      // Forget values invalidated by this instruction.
+      int n = 0;
+      for (int i = 0; i < nvals; i++)
+        if (!clobbers(ir, vals[i]))
+          vals[n++] = vals[i];
+      nvals = n;
+      track_copies(ir);
+
+      bool avail = is_pure(ir) && !reads(ir, ir->d);
+      if (ir->kind == IR_STORE)
+        avail = ir->size <= 8 && !ir->pre_index && !ir->post_index;
+      if (!avail)
+        continue;
+
+      // Keep the most recent values.
+      if (nvals == MAX_VALUES) {
+        memmove(vals, vals + 1, (MAX_VALUES - 1) * sizeof(Ir *));
+        nvals--;
+      }
+      vals[nvals++] = ir;
+    }
+    clear_copies();
+  }
+}
+
+//
+// Loops
+//
+// A loop is found from a back edge, which is a jump to a block that
+// dominates the jumping block. The target is the loop header, and the
+// loop consists of the blocks that reach the back edge without passing
+// through the header. Code moved out of a loop goes to its preheader,
+// a block that is the only way into the loop and only jumps to the
+// header.
+//
+
+typedef struct {
+  BB *header;
+  BB *preheader;
+  bool *body; // body[bb->index] is true if bb is in the loop
+  int nblocks;
+  bool innermost;
+} Loop;
+
+static BB **bbs;
+static int nbbs;
+static BB ***preds;
+static int *npreds;
+
+// Loops of the current function, innermost first
+static Loop **loops;
+static int nloops;
+
+static void number_bbs(Obj *fn) {
+  nbbs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bb->index = nbbs++;
+
+  bbs = calloc(nbbs, sizeof(BB *));
+  preds = calloc(nbbs, sizeof(BB **));
+  npreds = calloc(nbbs, sizeof(int));
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    bbs[bb->index] = bb;
+    preds[bb->index] = calloc(nbbs, sizeof(BB *));
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    BB *succs[2];
+    int n = get_succs(bb, succs);
+    for (int i = 0; i < n; i++)
+      if (i == 0 || succs[1] != succs[0])
+        preds[succs[i]->index][npreds[succs[i]->index]++] = bb;
+  }
+}
+
+// Returns dom, where dom[i][j] is true if block j dominates block i.
+static bool **find_dominators(void) {
+  bool **dom = calloc(nbbs, sizeof(bool *));
+  for (int i = 0; i < nbbs; i++) {
+    dom[i] = calloc(nbbs, sizeof(bool));
+    memset(dom[i], i > 0, nbbs);
+  }
+  dom[0][0] = true;
+
+  bool *tmp = calloc(nbbs, sizeof(bool));
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 1; i < nbbs; i++) {
+      if (npreds[i] == 0)
+        continue;
+
+      memset(tmp, true, nbbs);
+      for (int j = 0; j < npreds[i]; j++)
+        for (int k = 0; k < nbbs; k++)
+          tmp[k] &= dom[preds[i][j]->index][k];
+      tmp[i] = true;
+
+      if (memcmp(tmp, dom[i], nbbs)) {
+        memcpy(dom[i], tmp, nbbs);
+        changed = true;
+      }
+    }
+  }
+  return dom;
+}
+
+static Loop *get_loop(BB *header) {
+  for (int i = 0; i < nloops; i++)
+    if (loops[i]->header == header)
+      return loops[i];
+
+  Loop *loop = calloc(1, sizeof(Loop));
+  loop->header = header;
+  loop->body = calloc(nbbs, sizeof(bool));
+  loop->body[header->index] = true;
+  loops[nloops++] = loop;
+  return loop;
+}
+
+// Add the blocks that reach `latch` without passing through the
+// header to a loop.
+static void add_body(Loop *loop, BB *latch) {
+  BB **stack = calloc(nbbs, sizeof(BB *));
+  int len = 0;
+  if (!loop->body[latch->index]) {
+    loop->body[latch->index] = true;
+    stack[len++] = latch;
+  }
+
+  while (len > 0) {
+    BB *bb = stack[--len];
+    for (int i = 0; i < npreds[bb->index]; i++) {
+      BB *pred = preds[bb->index][i];
+      if (!loop->body[pred->index]) {
+        loop->body[pred->index] = true;
+        stack[len++] = pred;
+      }
+    }
+  }
+}
+
+// Returns the preheader of a loop, or NULL if the loop has none. If
+// `create` is true, a missing preheader is created.
+static BB *get_preheader(Obj *fn, Loop *loop, bool create) {
+  BB *header = loop->header;
+  if (header == fn->bbs)
+    return NULL;
+
+  BB *outside[nbbs];
+  int n = 0;
+  for (int i = 0; i < npreds[header->index]; i++)
+    if (!loop->body[preds[header->index][i]->index])
+      outside[n++] = preds[header->index][i];
+
+  if (n == 0)
+    return NULL;
+  if (n == 1 && outside[0]->last->kind == IR_JMP)
+    return outside[0];
+  if (!create)
+    return NULL;
+
+  BB *pre = new_bb();
+  Ir *jmp = new_ir(IR_JMP);
+  jmp->bb1 = header;
+  insert_ir(pre, NULL, jmp);
+
+  for (int i = 0; i < n; i++) {
+    Ir *ir = outside[i]->last;
+    if (ir->bb1 == header)
+      ir->bb1 = pre;
+    if (ir->bb2 == header)
+      ir->bb2 = pre;
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (bb->next == header) {
+      bb->next = pre;
+      pre->next = header;
+      break;
+    }
+  }
+  return pre;
+}
+
+static int cmp_loop_size(const void *a, const void *b) {
+  return (*(Loop **)a)->nblocks - (*(Loop **)b)->nblocks;
+}
+
+// Find the loops of a function and give each a preheader. Creating
+// preheaders changes the blocks, so loops are found again after that.
+static void find_loops(Obj *fn) {
+  for (;;) {
+    number_bbs(fn);
+    bool **dom = find_dominators();
+
+    loops = calloc(nbbs, sizeof(Loop *));
+    nloops = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      BB *succs[2];
+      int n = get_succs(bb, succs);
+      for (int i = 0; i < n; i++)
+        if (npreds[bb->index] && dom[bb->index][succs[i]->index])
+          add_body(get_loop(succs[i]), bb);
+    }
+
+    bool created = false;
+    for (int i = 0; i < nloops; i++)
+      if (!get_preheader(fn, loops[i], false) && get_preheader(fn, loops[i], true))
+        created = true;
+    if (!created)
+      break;
+  }
+
+  // Drop loops that cannot be entered through a preheader.
+  int n = 0;
+  for (int i = 0; i < nloops; i++) {
+    Loop *loop = loops[i];
+    loop->preheader = get_preheader(fn, loop, false);
+    if (!loop->preheader)
+      continue;
+    for (int j = 0; j < nbbs; j++)
+      loop->nblocks += loop->body[j];
+    loops[n++] = loop;
+  }
+  nloops = n;
+
+  qsort(loops, nloops, sizeof(Loop *), cmp_loop_size);
+
+  for (int i = 0; i < nloops; i++) {
+    loops[i]->innermost = true;
+    for (int j = 0; j < nloops; j++)
+      if (j != i && loops[i]->body[loops[j]->header->index])
+        loops[i]->innermost = false;
+  }
+}
+
+// Number of definitions of each register in the current loop
+static int *loop_defs;
+static int nloop_defs;
+
+static void count_loop_defs(Obj *fn, Loop *loop) {
+  nloop_defs = fn->nregs;
+  loop_defs = calloc(nloop_defs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!loop->body[bb->index])
+      continue;
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      Reg *defs[2];
+      int n = get_defs(ir, defs);
+      for (int i = 0; i < n; i++)
+        loop_defs[defs[i]->vn]++;
+    }
+  }
+}
+
+// Returns true if the value of a register does not change in the
+// current loop.
+static bool is_invariant(Reg *r) {
+  return r->vn < nloop_defs && loop_defs[r->vn] == 0;
+}
+
+//
+// Loop-invariant code motion
+//
+// An instruction whose operands do not change in a loop computes the
+// same value in every iteration, so it is moved to the preheader. Only
+// temporaries, which are assigned once, are moved, so the result is
+// never needed before the loop. A load is moved only if nothing in the
+// loop writes to memory and it is in the header, which runs whenever
+// the preheader does.
+//
+
+static bool writes_memory(Obj *fn, Loop *loop) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!loop->body[bb->index])
+      continue;
+    for (Ir *ir = bb->first; ir; ir = ir->next)
+      if (ir->kind == IR_STORE || ir->kind == IR_MEMCPY || ir->kind == IR_CALL)
+        return true;
+  }
+  return false;
+}
+
+static bool can_hoist(Ir *ir, Loop *loop, BB *bb, bool stores) {
+  if (!ir->d || ir->d->vn >= nloop_defs || ndefs[ir->d->vn] != 1)
+    return false;
+
+  switch (ir->kind) {
+  case IR_IMM:
+  case IR_MOV:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_MADD:
+  case IR_MSUB:
+  case IR_NEG:
+  case IR_MNEG:
+  case IR_ZEXT:
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE:
+  case IR_SEL:
+  case IR_LVAR:
+  case IR_GVAR:
+    break;
+  case IR_LOAD:
+    if (stores || bb != loop->header || ir->pre_index || ir->post_index)
+      return false;
+    break;
+  default:
+    return false;
+  }
+
+  Reg **ops[MAX_OPERANDS];
+  int nops = get_operands(ir, ops);
+  for (int i = 0; i < nops; i++)
+    if (!is_invariant(*ops[i]))
+      return false;
+  return true;
+}
+
+// Move loop-invariant instructions to preheaders. Inner loops are
+// done first, so that code can move out of several loops.
+static void hoist_invariants(Obj *fn) {
+  find_loops(fn);
+
+  for (int i = 0; i < nloops; i++) {
+    Loop *loop = loops[i];
+    BB *pre = loop->preheader;
+    count_regs(fn);
+    count_loop_defs(fn, loop);
+    bool stores = writes_memory(fn, loop);
+
+    // Moving an instruction may make its users invariant.
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (BB *bb = fn->bbs; bb; bb = bb->next) {
+        if (!loop->body[bb->index])
+          continue;
+
+        for (Ir *ir = bb->first, *next; ir; ir = next) {
+          next = ir->next;
+          if (!can_hoist(ir, loop, bb, stores))
+            continue;
+          remove_ir(bb, ir);
+          insert_ir(pre, pre->last, ir);
+          loop_defs[ir->d->vn]--;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+//
+// Strength reduction
+//
+// An induction variable is a register that is changed in a loop only
+// by adding a constant, like the index of a for statement. A value
+// computed from it by multiplying by a constant or by adding an
+// invariant base, and an array element indexed by it, become new
+// induction variables that are initialized in the preheader and
+// advanced where the original one is:
+//
+//   for (i = 0; i < n; i++)        p = &a[0];
+//     a[i] = x;               =>   for (i = 0; i < n; i++, p++)
+//                                    *p = x;
+//
+// This replaces a multiplication or an indexed address by an addition,
+// and the writeback pass then merges the addition into the access as a
+// post-indexed load or store. The index of an int is zero-extended
+// after each increment, but it is assumed not to overflow, as in C.
+//
+
+// Maximum number of induction variables created per loop
+#define MAX_NEW_IVS 8
+
+typedef struct {
+  Reg *reg;
+  int64_t step;
+  BB *bb;
+  Ir *def; // The instruction that adds `step` to `reg`
+} IndVar;
+
+// A value derived from an induction variable. `reg` is `base +
+// iv * scale`, or `iv * scale` if `base` is NULL.
+typedef struct {
+  Reg *iv;
+  Reg *base;
+  int64_t scale;
+  Reg *reg;
+} Derived;
+
+static IndVar ivs[64];
+static int nivs;
+static Derived derived[MAX_NEW_IVS];
+static int nderived;
+
+// Find induction variables, which are `i = i + c` or `i = i - c`, or
+// `t = i + c; i = zext t` for an int.
+static void find_ivs(Obj *fn, Loop *loop) {
+  nivs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!loop->body[bb->index])
+      continue;
+
+    for (Ir *ir = bb->first; ir && nivs < 64; ir = ir->next) {
+      Reg *r = ir->d;
+      if (!r || r->vn >= nloop_defs || loop_defs[r->vn] != 1)
+        continue;
+
+      Ir *add = ir;
+      if (ir->kind == IR_ZEXT && ir->size == 4) {
+        add = ir->prev;
+        if (!add || add->d != ir->a || ndefs[add->d->vn] != 1)
+          continue;
+      }
+      if ((add->kind != IR_ADD && add->kind != IR_SUB) || add->b ||
+          add->a != r || add->imm < -4096 || add->imm > 4096)
+        continue;
+      int64_t step = (add->kind == IR_ADD) ? add->imm : -add->imm;
+      ivs[nivs++] = (IndVar){r, step, bb, ir};
+    }
+  }
+}
+
+static IndVar *get_iv(Reg *r) {
+  for (int i = 0; i < nivs; i++)
+    if (ivs[i].reg == r)
+      return &ivs[i];
+  return NULL;
+}
+
+// Returns a register holding `base + iv * scale` in the loop.
+static Reg *get_derived(Obj *fn, Loop *loop, IndVar *iv, Reg *base,
+                        int64_t scale, int line_no) {
+  for (int i = 0; i < nderived; i++)
+    if (derived[i].iv == iv->reg && derived[i].base == base &&
+        derived[i].scale == scale)
+      return derived[i].reg;
+
+  int64_t inc = iv->step * scale;
+  if (nderived == MAX_NEW_IVS || !(is_add_imm(inc) || is_add_imm(-inc)))
+    return NULL;
+
+  Reg *r = new_reg(fn);
+  BB *pre = loop->preheader;
+
+  // Initialize it in the preheader.
+  Ir *init = new_ir(IR_MUL);
+  init->line_no = line_no;
+  init->d = r;
+  init->a = iv->reg;
+  init->imm = scale;
+  if (base && log2_exact(scale) >= 0) {
+    init->kind = IR_ADD;
+    init->a = base;
+    init->b = iv->reg;
+    init->shift = log2_exact(scale);
+  } else if (base) {
+    Ir *mul = init;
+    mul->d = new_reg(fn);
+    insert_ir(pre, pre->last, mul);
+
+    init = new_ir(IR_ADD);
+    init->line_no = line_no;
+    init->d = r;
+    init->a = base;
+    init->b = mul->d;
+  }
+  insert_ir(pre, pre->last, init);
+
+  // Advance it with the induction variable.
+  Ir *add = new_ir(IR_ADD);
+  add->line_no = iv->def->line_no;
+  add->d = add->a = r;
+  add->imm = inc;
+  insert_ir(iv->bb, iv->def->next, add);
+
+  derived[nderived++] = (Derived){iv->reg, base, scale, r};
+  return r;
+}
+
+// Returns true if `a` comes before `b` in the same block.
+static bool precedes(Ir *a, Ir *b) {
+  for (Ir *ir = a->next; ir; ir = ir->next)
+    if (ir == b)
+      return true;
+  return false;
+}
+
+// Rewrite an instruction to use a derived induction variable. Returns
+// true if it has been rewritten.
+static bool reduce(Obj *fn, Loop *loop, Ir *ir) {
+  // d = i * c
+  if (ir->kind == IR_MUL && !ir->b && get_iv(ir->a) &&
+      -4096 <= ir->imm && ir->imm <= 4096) {
+    Reg *r = get_derived(fn, loop, get_iv(ir->a), NULL, ir->imm, ir->line_no);
+    if (!r)
+      return false;
+    ir->kind = IR_MOV;
+    ir->a = r;
+    ir->imm = 0;
+    return true;
+  }
+
+  // d = base + (i << shift)
+  if (ir->kind == IR_ADD && ir->b && !ir->size) {
+    Reg *base = ir->a;
+    Reg *i = ir->b;
+    if (ir->shift == 0 && !get_iv(i)) {
+      base = ir->b;
+      i = ir->a;
+    }
+    if (!get_iv(i) || !is_invariant(base))
+      return false;
+
+    Reg *r = get_derived(fn, loop, get_iv(i), base, 1 << ir->shift, ir->line_no);
+    if (!r)
+      return false;
+    ir->kind = IR_MOV;
+    ir->a = r;
+    ir->b = NULL;
+    ir->shift = 0;
+    return true;
+  }
+
+  // Load or store at [base, i, lsl shift]. An indexed access is as
+  // fast as a plain one, so this is done only if the increment can be
+  // merged into the access, which must then come before the increment
+  // in the same block.
+  if ((ir->kind == IR_LOAD || ir->kind == IR_STORE) && !ir->var && ir->index &&
+      get_iv(ir->index) && is_invariant(ir->a) &&
+      precedes(ir, get_iv(ir->index)->def)) {
+    Reg *r = get_derived(fn, loop, get_iv(ir->index), ir->a, 1 << ir->shift,
+                         ir->line_no);
+    if (!r)
+      return false;
+    ir->a = r;
+    ir->index = NULL;
+    ir->shift = 0;
+    return true;
+  }
+  return false;
+}
+
+// Returns the number of uses of `r` in a loop.
+static int count_loop_uses(Obj *fn, Loop *loop, Reg *r) {
+  int n = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!loop->body[bb->index])
+      continue;
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      Reg **ops[MAX_OPERANDS];
+      int nops = get_operands(ir, ops);
+      for (int i = 0; i < nops; i++)
+        n += (*ops[i] == r);
+    }
+  }
+  return n;
+}
+
+// Returns true if `r` may be read after leaving a loop before it is
+// assigned again.
+static bool is_live_after(Obj *fn, Loop *loop, Reg *r) {
+  bool *visited = calloc(nbbs, sizeof(bool));
+  BB **stack = calloc(nbbs, sizeof(BB *));
+  int len = 0;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!loop->body[bb->index])
+      continue;
+    BB *succs[2];
+    int n = get_succs(bb, succs);
+    for (int i = 0; i < n; i++) {
+      if (!loop->body[succs[i]->index] && !visited[succs[i]->index]) {
+        visited[succs[i]->index] = true;
+        stack[len++] = succs[i];
+      }
+    }
+  }
+
+  while (len > 0) {
+    BB *bb = stack[--len];
+    bool killed = false;
+    for (Ir *ir = bb->first; ir && !killed; ir = ir->next) {
+      if (reads(ir, r))
+        return true;
+      killed = writes(ir, r);
+    }
+    if (killed)
+      continue;
+
+    BB *succs[2];
+    int n = get_succs(bb, succs);
+    for (int i = 0; i < n; i++) {
+      if (!visited[succs[i]->index]) {
+        visited[succs[i]->index] = true;
+        stack[len++] = succs[i];
+      }
+    }
+  }
+  return false;
+}
+
+// Emit `base + n * scale`, or `base + imm * scale` if n is NULL, to
+// the preheader of a loop.
+static Reg *emit_bound(Obj *fn, Loop *loop, Reg *base, Reg *n, int64_t imm,
+                       int64_t scale, int line_no) {
+  BB *pre = loop->preheader;
+  Ir *ir = new_ir(IR_IMM);
+  ir->line_no = line_no;
+  ir->d = new_reg(fn);
+
+  if (!n) {
+    ir->imm = imm * scale;
+    if (base && (is_add_imm(ir->imm) || is_add_imm(-ir->imm))) {
+      ir->kind = IR_ADD;
+      ir->a = base;
+    } else if (base) {
+      insert_ir(pre, pre->last, ir);
+      Reg *k = ir->d;
+      ir = new_ir(IR_ADD);
+      ir->line_no = line_no;
+      ir->d = new_reg(fn);
+      ir->a = base;
+      ir->b = k;
+    }
+  } else if (base && log2_exact(scale) >= 0) {
+    ir->kind = IR_ADD;
+    ir->a = base;
+    ir->b = n;
+    ir->shift = log2_exact(scale);
+  } else {
+    ir->kind = IR_MUL;
+    ir->a = n;
+    ir->imm = scale;
+    if (base) {
+      insert_ir(pre, pre->last, ir);
+      Reg *k = ir->d;
+      ir = new_ir(IR_ADD);
+      ir->line_no = line_no;
+      ir->d = new_reg(fn);
+      ir->a = base;
+      ir->b = k;
+    }
+  }
+
+  insert_ir(pre, pre->last, ir);
+  return ir->d;
+}
+
+// If an induction variable is used in a loop only to be compared with
+// invariant values, compare a value derived from it with the values
+// scaled the same way instead, so that the variable becomes dead:
+//
+//   for (i = 0; i < n; i++) a[i] = 0;  =>  for (p = a; p < a + n; p++) *p = 0;
+static void replace_exit_tests(Obj *fn, Loop *loop, IndVar *iv) {
+  // Choose a derived value that is used in the loop anyway.
+  Derived *d = NULL;
+  for (int i = 0; i < nderived; i++) {
+    Derived *x = &derived[i];
+    if (x->iv != iv->reg || x->scale <= 0)
+      continue;
+    if (!d || count_loop_uses(fn, loop, x->reg) > 1)
+      d = x;
+  }
+  if (!d)
+    return;
+
+  // All uses other than the one advancing the variable must be
+  // comparisons with invariants.
+  Ir *cmps[8];
+  int ncmps = 0;
+  int uses = count_loop_uses(fn, loop, iv->reg) - 1;
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (!loop->body[bb->index])
+      continue;
+    for (Ir *ir = bb->first; ir; ir = ir->next) {
+      if (ir->kind != IR_EQ && ir->kind != IR_NE && ir->kind != IR_LT &&
+          ir->kind != IR_LE)
+        continue;
+      if (ir->a != iv->reg && ir->b != iv->reg)
+        continue;
+
+      Reg *other = (ir->a == iv->reg) ? ir->b : ir->a;
+      if (other == iv->reg || (other && !is_invariant(other)) || ncmps == 8)
+        return;
+      cmps[ncmps++] = ir;
+    }
+  }
+  if (ncmps == 0 || ncmps != uses)
+    return;
+
+  for (int i = 0; i < ncmps; i++) {
+    Ir *cmp = cmps[i];
+    if (cmp->a == iv->reg) {
+      cmp->b = emit_bound(fn, loop, d->base, cmp->b, cmp->imm, d->scale,
+                          cmp->line_no);
+      cmp->a = d->reg;
+    } else {
+      cmp->a = emit_bound(fn, loop, d->base, cmp->a, 0, d->scale, cmp->line_no);
+      cmp->b = d->reg;
+    }
+    cmp->imm = 0;
+  }
+}
+
+// Remove induction variables that are only used to advance themselves.
+static void remove_dead_ivs(Obj *fn, Loop *loop) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    count_regs(fn);
+    count_loop_defs(fn, loop);
+    find_ivs(fn, loop);
+
+    for (int i = 0; i < nivs; i++) {
+      IndVar *iv = &ivs[i];
+      if (count_loop_uses(fn, loop, iv->reg) != 1 ||
+          is_live_after(fn, loop, iv->reg))
+        continue;
+      if (iv->def->kind == IR_ZEXT && nuses[iv->def->a->vn] != 1)
+        continue;
+
+      if (iv->def->kind == IR_ZEXT)
+        remove_ir(iv->bb, iv->def->prev);
+      remove_ir(iv->bb, iv->def);
+      changed = true;
+      break;
+    }
+  }
+}
+
+static void remove_dead_code(Obj *fn);
+
+// Strength-reduce induction variables of innermost loops. A value
+// derived from an induction variable may become one itself after copy
+// propagation, so this is repeated a few times.
+static void reduce_strength(Obj *fn) {
+  find_loops(fn);
+
+  for (int i = 0; i < nloops; i++) {
+    Loop *loop = loops[i];
+    if (!loop->innermost)
+      continue;
+    nderived = 0;
+
+    for (int round = 0; round < 3; round++) {
+      count_regs(fn);
+      count_loop_defs(fn, loop);
+      find_ivs(fn, loop);
+
+      bool changed = false;
+      for (BB *bb = fn->bbs; bb; bb = bb->next) {
+        if (!loop->body[bb->index])
+          continue;
+        for (Ir *ir = bb->first; ir; ir = ir->next)
+          if (reduce(fn, loop, ir))
+            changed = true;
+      }
+
+      if (!changed)
+        break;
+      propagate_copies(fn);
+    }
+
+    count_regs(fn);
+    count_loop_defs(fn, loop);
+    find_ivs(fn, loop);
+    for (int j = 0; j < nivs; j++)
+      replace_exit_tests(fn, loop, &ivs[j]);
+
+    // Instructions made dead by the rewrite may still read an old
+    // induction variable.
+    remove_dead_code(fn);
+    remove_dead_ivs(fn, loop);
+  }
+}
+
+//
+// Loop unrolling
+//
+// An innermost loop is unrolled if its body is a single block and its
+// header does nothing but compare an induction variable with an
+// invariant bound. If the number of iterations is a small constant,
+// the loop is replaced by that many copies of the body. Otherwise, a
+// loop running `factor` copies of the body is put in front of the
+// original loop, which does the remaining iterations:
+//
+//   for (; i < n; i++)      for (; i < n - 3; i++) { B; i++; B; i++; B; i++; B; }
+//     B;               =>   for (; i < n; i++)
+//                             B;
+//
+// This saves the compare and the branches of all but one in `factor`
+// iterations. The unrolled loop runs after strength reduction, so the
+// copies advance pointers that writeback merges into loads and stores.
+// As for strength reduction, the bound is assumed not to overflow.
+//
+
+// Maximum number of instructions of the copies of a body, unless
+// #pragma unroll asks for more
+#define UNROLL_MAX_SIZE 64
+
+// Maximum number of iterations of a loop fully unrolled by #pragma unroll
+#define UNROLL_MAX_TRIPS 256
+
+// A value known to be `base + off`, where `base` is NULL for a constant
+typedef struct {
+  Reg *base;
+  int64_t off;
+} Linear;
+
+static Ir *find_def(Obj *fn, Reg *r) {
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    for (Ir *ir = bb->first; ir; ir = ir->next)
+      if (ir->d == r)
+        return ir;
+  return NULL;
+}
+
+// Find the value of `r` before `pos` in the preheader of a loop, or
+// anywhere if `pos` is NULL. A register assigned more than once is
+// followed only to its last definition in the preheader.
+static bool eval_linear(Obj *fn, BB *pre, Ir *pos, Reg *r, Linear *val,
+                        int depth) {
+  Ir *ir = NULL;
+  if (pos)
+    for (ir = pos->prev; ir && !writes(ir, r); ir = ir->prev);
+
+  if (!ir) {
+    if (ndefs[r->vn] != 1)
+      return false;
+    ir = find_def(fn, r);
+    pos = NULL;
+  }
+
+  Linear a, b;
+  if (depth < 8 && ir->d == r) {
+    switch (ir->kind) {
+    case IR_IMM:
+      *val = (Linear){NULL, ir->imm};
+      return true;
+    case IR_MOV:
+      if (eval_linear(fn, pre, pos ? ir : NULL, ir->a, val, depth + 1))
+        return true;
+      break;
+    case IR_ADD:
+    case IR_SUB:
+      if (!eval_linear(fn, pre, pos ? ir : NULL, ir->a, &a, depth + 1))
+        break;
+      if (!ir->b) {
+        b = (Linear){NULL, ir->imm};
+      } else {
+        if (!eval_linear(fn, pre, pos ? ir : NULL, ir->b, &b, depth + 1) ||
+            b.base)
+          break;
+        if (ir->size == 4)
+          b.off = (uint32_t)b.off;
+        b.off <<= ir->shift;
+      }
+      *val = (Linear){a.base, ir->kind == IR_ADD ? a.off + b.off : a.off - b.off};
+      return true;
+    case IR_MUL:
+      if (ir->b || !eval_linear(fn, pre, pos ? ir : NULL, ir->a, &a, depth + 1) ||
+          a.base)
+        break;
+      *val = (Linear){NULL, a.off * ir->imm};
+      return true;
+    }
+  }
+
+  // Otherwise, a register assigned once is its own base.
+  if (ndefs[r->vn] != 1)
+    return false;
+  *val = (Linear){r, 0};
+  return true;
+}
+
+// Returns the number of iterations of a loop testing `cmp` in its
+// header, or -1 if it is not a known constant.
+static int64_t count_trips(Obj *fn, Loop *loop, Ir *cmp, IndVar *iv) {
+  BB *pre = loop->preheader;
+  bool up = (cmp->a == iv->reg);
+  Reg *bound = up ? cmp->b : cmp->a;
+
+  Linear init, limit;
+  if (!eval_linear(fn, pre, pre->last, iv->reg, &init, 0))
+    return -1;
+  if (!bound)
+    limit = (Linear){NULL, cmp->imm};
+  else if (!eval_linear(fn, pre, pre->last, bound, &limit, 0))
+    return -1;
+  if (init.base != limit.base)
+    return -1;
+
+  int64_t dist = up ? limit.off - init.off : init.off - limit.off;
+  int64_t step = up ? iv->step : -iv->step;
+  if (cmp->kind == IR_LE)
+    dist++;
+  if (dist <= 0)
+    return 0;
+  if (dist > (1 << 30))
+    return -1;
+  return (dist + step - 1) / step;
+}
+
+// Returns registers that are assigned once in `body` and only used in
+// it after the assignment. Copies of the body get new ones. Unless
+// `once` is set, they may also be assigned several times in `body`.
+static bool *find_local_regs(Obj *fn, BB *body, bool once) {
+  bool *local = calloc(fn->nregs, sizeof(bool));
+  int *defined = calloc(fn->nregs, sizeof(int));
+  bool *early = calloc(fn->nregs, sizeof(bool));
+  int *uses = calloc(fn->nregs, sizeof(int));
+
+  for (Ir *ir = body->first; ir; ir = ir->next) {
+    Reg **ops[MAX_OPERANDS];
+    int nops = get_operands(ir, ops);
+    for (int i = 0; i < nops; i++) {
+      int vn = (*ops[i])->vn;
+      uses[vn]++;
+      if (!defined[vn])
+        early[vn] = true;
+    }
+
+    Reg *defs[2];
+    int n = get_defs(ir, defs);
+    for (int i = 0; i < n; i++)
+      defined[defs[i]->vn]++;
+  }
+
+  for (int i = 0; i < fn->nregs; i++)
+    local[i] = defined[i] && !early[i] && ndefs[i] == defined[i] &&
+               (!once || ndefs[i] == 1) && uses[i] == nuses[i];
+  return local;
+}
+
+// Insert a copy of the instructions of `body` but its jump before
+// `pos` in `bb`.
+static void copy_body(Obj *fn, BB *body, bool *local, BB *bb, Ir *pos) {
+  Reg **map = calloc(fn->nregs, sizeof(Reg *));
+
+  for (Ir *ir = body->first; ir != body->last; ir = ir->next) {
+    Ir *copy = new_ir(ir->kind);
+    *copy = *ir;
+    copy->next = copy->prev = NULL;
+    if (ir->args) {
+      copy->args = calloc(ir->nargs, sizeof(Reg *));
+      memcpy(copy->args, ir->args, ir->nargs * sizeof(Reg *));
+    }
+
+    Reg **ops[MAX_OPERANDS];
+    int nops = get_operands(copy, ops);
+    for (int i = 0; i < nops; i++)
+      if (map[(*ops[i])->vn])
+        *ops[i] = map[(*ops[i])->vn];
+
+    if (copy->d && local[copy->d->vn]) {
+      copy->d = map[copy->d->vn] = new_reg(fn);
+      copy->d->vector = ir->d->vector;
+    }
+    insert_ir(bb, pos, copy);
+  }
+}
+
+// Put a loop running `factor` copies of the body in front of a loop.
+static void unroll_partially(Obj *fn, Loop *loop, Ir *cmp, IndVar *iv,
+                             BB *body, bool *local, int factor) {
+  BB *header = loop->header;
+  int64_t delta = -(factor - 1) * iv->step;
+
+  Ir *test = new_ir(cmp->kind);
+  test->line_no = cmp->line_no;
+  test->d = new_reg(fn);
+  test->a = cmp->a;
+  test->b = cmp->b;
+  if (cmp->a == iv->reg && !cmp->b && is_imm_operand(cmp->kind, cmp->imm + delta))
+    test->imm = cmp->imm + delta;
+  else if (cmp->a == iv->reg)
+    test->b = emit_bound(fn, loop, cmp->b, NULL, cmp->b ? delta : cmp->imm + delta,
+                         1, cmp->line_no);
+  else
+    test->a = emit_bound(fn, loop, cmp->a, NULL, delta, 1, cmp->line_no);
+
+  BB *new_header = new_bb();
+  BB *new_body = new_bb();
+  new_header->unroll = 1;
+  header->unroll = 1;
+
+  Ir *br = new_ir(IR_BR);
+  br->line_no = cmp->line_no;
+  br->a = test->d;
+  br->bb1 = new_body;
+  br->bb2 = header;
+  insert_ir(new_header, NULL, test);
+  insert_ir(new_header, NULL, br);
+
+  Ir *jmp = new_ir(IR_JMP);
+  jmp->line_no = body->last->line_no;
+  jmp->bb1 = new_header;
+  insert_ir(new_body, NULL, jmp);
+  for (int i = 0; i < factor; i++)
+    copy_body(fn, body, local, new_body, jmp);
+
+  loop->preheader->last->bb1 = new_header;
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (bb->next == header) {
+      bb->next = new_header;
+      new_header->next = new_body;
+      new_body->next = header;
+      break;
+    }
+  }
+}
+
+// Unroll a loop. Returns true if the loop was changed.
+static bool unroll_loop(Obj *fn, Loop *loop) {
+  BB *header = loop->header;
+  Ir *cmp = header->first;
+  Ir *br = header->last;
+  if (header->unroll == 1 || loop->nblocks != 2 || cmp->next != br ||
+      br->kind != IR_BR || br->a != cmp->d || nuses[cmp->d->vn] != 1 ||
+      (cmp->kind != IR_LT && cmp->kind != IR_LE) ||
+      loop->body[br->bb2->index])
+    return false;
+
+  BB *body = br->bb1;
+  if (body->last->kind != IR_JMP || body->last->bb1 != header)
+    return false;
+
+  // The loop must test an induction variable against an invariant,
+  // and keep running while the variable moves toward the bound.
+  count_loop_defs(fn, loop);
+  find_ivs(fn, loop);
+  IndVar *iv = get_iv(cmp->a);
+  Reg *bound = cmp->b;
+  if (iv && iv->step <= 0)
+    return false;
+  if (!iv) {
+    iv = cmp->b ? get_iv(cmp->b) : NULL;
+    bound = cmp->a;
+    if (!iv || iv->step >= 0)
+      return false;
+  }
+  if (bound && !is_invariant(bound))
+    return false;
+
+  int size = 0;
+  for (Ir *ir = body->first; ir != body->last; ir = ir->next)
+    size++;
+
+  int unroll = header->unroll;
+  if (unroll == 0 && opt_unroll_factor < 2)
+    return false;
+
+  // Replace a loop with a small constant number of iterations with
+  // copies of its body.
+  int64_t trips = count_trips(fn, loop, cmp, iv);
+  bool full = false;
+  if (trips > 0 && unroll == -1)
+    full = (trips <= UNROLL_MAX_TRIPS);
+  else if (trips > 0 && unroll > 1)
+    full = (trips <= unroll);
+  else if (trips > 0)
+    full = (trips * size <= UNROLL_MAX_SIZE);
+
+  bool *local = find_local_regs(fn, body, true);
+
+  if (full) {
+    Ir *jmp = loop->preheader->last;
+    for (int i = 0; i < trips; i++)
+      copy_body(fn, body, local, loop->preheader, jmp);
+    jmp->bb1 = br->bb2;
+    return true;
+  }
+
+  int factor = unroll > 1 ? unroll : opt_unroll_factor;
+  if (unroll < 2)
+    while (factor > 1 && factor * size > UNROLL_MAX_SIZE)
+      factor--;
+  if (factor < 2 || (trips >= 0 && trips < factor))
+    return false;
+
+  unroll_partially(fn, loop, cmp, iv, body, local, factor);
+  return true;
+}
+
+// Unroll innermost loops. A loop that has been unrolled, and the loop
+// created for it, are marked so that they are not unrolled again.
+static void unroll_loops(Obj *fn) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    find_loops(fn);
+    count_regs(fn);
+
+    for (int i = 0; i < nloops && !changed; i++)
+      if (loops[i]->innermost && unroll_loop(fn, loops[i]))
+        changed = true;
+    if (changed)
+      simplify_cfg(fn);
+  }
+}
+
+//
+// Vectorization
+//
+// An innermost loop whose body is a single block working on elements
+// `i` of arrays, such as
+//
+//   for (; i < n; i++)
+//     c[i] = a[i] + b[i];
+//
+// gets a loop in front of it that does the work of several iterations
+// at once with NEON instructions, on a vector of 16 bytes from each
+// array. The original loop does the remaining iterations, and all of
+// them if two of the arrays are so close that the vector loop would
+// give a different result:
+//
+//   if (c, a and b are 0 or at least 16 bytes apart)
+//     for (; i < n - 3; i += 4)
+//       c[i..i+3] = a[i..i+3] + b[i..i+3];
+//   for (; i < n; i++)
+//     c[i] = a[i] + b[i];
+//
+// All arrays must have elements of the same size, which becomes the
+// size of the lanes of the vectors. Besides element-wise arithmetic,
+// comparisons and selects, the body may add elements to a variable or
+// keep their maximum or minimum in one. Such a variable gets a vector
+// of partial results, which is folded into it after the vector loop.
+// AArch64 does not require vectors to be aligned, so no iterations are
+// peeled off in front of the vector loop.
+//
+// Loads zero-extend, so the lanes of a loaded vector hold the values
+// the original loop would have. After an addition, a lane holds only
+// the lower bits of the value, which is enough to store it but not to
+// compare it, so each vector is marked as exact or not.
+//
+
+// Size of a vector in bytes
+#define VEC_BYTES 16
+
+// Maximum numbers of arrays, variables and vector registers in a loop
+#define VEC_MAX_ARRAYS 4
+#define VEC_MAX_REDUCTIONS 4
+#define VEC_MAX_REGS 12
+
+// A variable that keeps a sum, a maximum or a minimum of elements
+typedef struct {
+  Reg *reg;
+  Ir *def;    // The instruction assigning the variable
+  Ir *helper; // The addition or the comparison used by `def`, if any
+  bool zext;  // The sum is truncated to 32 bits
+  bool count; // The variable counts elements for which a condition holds
+  Reg *acc;   // Vector of partial results
+  IrKind kind; // IR_VSUMW, IR_VMAX or IR_VMIN
+} Reduction;
+
+static int vec_size;
+static BB *vec_pre;
+static BB *vec_body;
+static int nvec_regs;
+
+// The vector for each register of the body. A comparison gives a mask,
+// which is used only by selects.
+static Reg **vec_of;
+static bool *vec_exact;
+static Ir **vec_mask;
+static bool *vec_negated;
+
+static Reg *arrays[VEC_MAX_ARRAYS];
+static Reg *ptrs[VEC_MAX_ARRAYS];
+static Reg *loaded[VEC_MAX_ARRAYS];
+static bool stored[VEC_MAX_ARRAYS];
+static int narrays;
+
+static Reduction reds[VEC_MAX_REDUCTIONS];
+static int nreds;
+
+// Insert an instruction before `pos` in `bb`, or at the end if `pos`
+// is NULL.
+static Ir *add_ir(BB *bb, Ir *pos, IrKind kind, Reg *d, Reg *a, Reg *b,
+                  int line_no) {
+  Ir *ir = new_ir(kind);
+  ir->line_no = line_no;
+  ir->d = d;
+  ir->a = a;
+  ir->b = b;
+  insert_ir(bb, pos, ir);
+  return ir;
+}
+
+static Reg *new_vec_reg(Obj *fn) {
+  Reg *r = new_reg(fn);
+  r->vector = true;
+  nvec_regs++;
+  return r;
+}
+
+// Returns a vector with `r`, or `imm` if r is NULL, in every lane.
+static Reg *broadcast(Obj *fn, Reg *r, int64_t imm, bool *exact, int line_no) {
+  bool known = !r;
+  bool fits = false;
+  if (r && ndefs[r->vn] == 1) {
+    Ir *def = find_def(fn, r);
+    if (def->kind == IR_IMM) {
+      known = true;
+      imm = def->imm;
+    }
+
+    // Zero-extended values fit into lanes of their size.
+    if ((def->kind == IR_ZEXT || def->kind == IR_LOAD) && def->size <= vec_size)
+      fits = true;
+  }
+  if (!r) {
+    r = new_reg(fn);
+    add_ir(vec_pre, NULL, IR_IMM, r, NULL, NULL, line_no)->imm = imm;
+  }
+
+  *exact = (vec_size == 8) || fits ||
+           (known && 0 <= imm && imm < (1LL << (vec_size * 8)));
+  Reg *v = new_vec_reg(fn);
+  add_ir(vec_pre, NULL, IR_VDUP, v, r, NULL, line_no)->size = vec_size;
+  return v;
+}
+
+// Returns the vector for an operand of an instruction in the body, or
+// NULL if there is none.
+static Reg *vec_operand(Obj *fn, Reg *r, bool *exact, int line_no) {
+  if (r->vn < nloop_defs && vec_of[r->vn]) {
+    *exact = vec_exact[r->vn];
+    return vec_mask[r->vn] ? NULL : vec_of[r->vn];
+  }
+  if (is_invariant(r)) {
+    vec_of[r->vn] = broadcast(fn, r, 0, exact, line_no);
+    vec_exact[r->vn] = *exact;
+    return vec_of[r->vn];
+  }
+  return NULL;
+}
+
+static void set_vec(Reg *r, Reg *v, bool exact) {
+  vec_of[r->vn] = v;
+  vec_exact[r->vn] = exact;
+}
+
+// Returns the array accessed by a load or a store at element `i`, or
+// -1 if the access is not one.
+static int get_array(Obj *fn, Ir *ir, IndVar *iv) {
+  if (ir->var || ir->index != iv->reg || (1 << ir->shift) != ir->size ||
+      ir->imm || ir->pre_index || ir->post_index || !is_invariant(ir->a))
+    return -1;
+
+  for (int i = 0; i < narrays; i++)
+    if (arrays[i] == ir->a)
+      return i;
+  if (narrays == VEC_MAX_ARRAYS)
+    return -1;
+
+  // Point to element i before the vector loop.
+  Reg *p = new_reg(fn);
+  Ir *init = add_ir(vec_pre, NULL, IR_ADD, p, ir->a, iv->reg, ir->line_no);
+  init->shift = ir->shift;
+
+  arrays[narrays] = ir->a;
+  ptrs[narrays] = p;
+  loaded[narrays] = NULL;
+  stored[narrays] = false;
+  return narrays++;
+}
+
+// Find variables assigned in the body that are not temporaries. Each
+// must be a sum, a maximum or a minimum of values computed in the body.
+static bool find_reductions(BB *body, IndVar *iv, bool *local) {
+  nreds = 0;
+
+  for (Ir *ir = body->first; ir != body->last; ir = ir->next) {
+    Reg *r = ir->d;
+    if (!r || local[r->vn] || r == iv->reg)
+      continue;
+    if (loop_defs[r->vn] != 1 || nreds == VEC_MAX_REDUCTIONS)
+      return false;
+
+    int nreads = 0;
+    for (Ir *p = body->first; p; p = p->next)
+      nreads += reads(p, r);
+
+    Reduction *red = &reds[nreds++];
+    *red = (Reduction){r, ir};
+
+    // r = r + x, or t = r + x; r = zext4 t
+    Ir *add = ir;
+    if (ir->kind == IR_ZEXT && ir->size == 4 && ir->prev &&
+        ir->prev->d == ir->a && local[ir->a->vn] && nuses[ir->a->vn] == 1) {
+      add = red->helper = ir->prev;
+      red->zext = true;
+    }
+    if (add->kind == IR_ADD && add->b && !add->shift && !add->size &&
+        (add->a == r) != (add->b == r) && nreads == 1) {
+      red->kind = IR_VSUMW;
+      continue;
+    }
+
+    // r = c ? r : r + 1 counts the elements for which c does not hold.
+    if (ir->kind == IR_SEL && ir->imm == 1 && ir->b == r && ir->c == r &&
+        nreads == 1) {
+      red->kind = IR_VSUMW;
+      red->zext = (ir->size == 4);
+      red->count = true;
+      continue;
+    }
+
+    // c = r < x; r = c ? x : r, or any other order of r and x
+    if (ir->kind != IR_SEL || ir->imm || !ir->b || !ir->c ||
+        (ir->b == r) == (ir->c == r) || nreads != 2)
+      return false;
+
+    Ir *cmp = ir->prev;
+    while (cmp && !writes(cmp, ir->a))
+      cmp = cmp->prev;
+    if (!cmp || (cmp->kind != IR_LT && cmp->kind != IR_LE) || !cmp->b ||
+        (cmp->a == r) == (cmp->b == r) || !local[cmp->d->vn] ||
+        nuses[cmp->d->vn] != 1)
+      return false;
+    red->helper = cmp;
+    red->kind = IR_VMAX;
+  }
+  return true;
+}
+
+static Reduction *get_reduction(Ir *ir) {
+  for (int i = 0; i < nreds; i++)
+    if (reds[i].def == ir || reds[i].helper == ir)
+      return &reds[i];
+  return NULL;
+}
+
+// Update the partial results of a variable.
+static bool vectorize_reduction(Obj *fn, Reduction *red) {
+  Ir *ir = red->def;
+  Reg *r = red->reg;
+  int line_no = ir->line_no;
+  bool exact;
+
+  if (red->kind == IR_VSUMW) {
+    Reg *x;
+    if (red->count) {
+      // The lanes of a mask are all ones where the comparison holds,
+      // so 0 - mask has ones there, and mask + 1 everywhere else.
+      Ir *cmp = vec_mask[ir->a->vn];
+      if (!cmp)
+        return false;
+      x = new_vec_reg(fn);
+      if (ir->invert != vec_negated[ir->a->vn])
+        add_ir(vec_body, NULL, IR_VSUB, x,
+               broadcast(fn, NULL, 0, &exact, line_no), cmp->d, line_no);
+      else
+        add_ir(vec_body, NULL, IR_VADD, x, cmp->d,
+               broadcast(fn, NULL, 1, &exact, line_no), line_no);
+      vec_body->last->size = vec_size;
+    } else {
+      Ir *add = red->helper ? red->helper : ir;
+      x = vec_operand(fn, (add->a == r) ? add->b : add->a, &exact, line_no);
+      if (!x || (!exact && vec_size != 8 && !(red->zext && vec_size == 4)))
+        return false;
+    }
+
+    // Lanes are added to lanes of 8 bytes, which do not overflow.
+    red->acc = new_vec_reg(fn);
+    IrKind kind = (vec_size == 8) ? IR_VADD : IR_VSUMW;
+    add_ir(vec_body, NULL, kind, red->acc, red->acc, x, line_no)->size =
+      vec_size;
+    return true;
+  }
+
+  // There is no vector instruction for the maximum of 8-byte lanes.
+  if (vec_size == 8 || (ir->size == 4 && vec_size > 4))
+    return false;
+
+  // The select picks `t` if `p` is less than `q`, and `f` otherwise.
+  // The variable is one of `p` and `q`, and one of `t` and `f`.
+  Ir *cmp = red->helper;
+  Reg *p = cmp->a, *q = cmp->b, *t = ir->b, *f = ir->c;
+  if (ir->invert) {
+    t = ir->c;
+    f = ir->b;
+  }
+
+  Reg *x = vec_operand(fn, (p == r) ? q : p, &exact, line_no);
+  if (!x || !exact)
+    return false;
+  Reg *y = vec_operand(fn, (t == r) ? f : t, &exact, line_no);
+  if (x != y)
+    return false;
+
+  // The larger value is picked if it is q.
+  red->kind = ((t == r) == (q == r)) ? IR_VMAX : IR_VMIN;
+
+  red->acc = new_vec_reg(fn);
+  add_ir(vec_body, NULL, red->kind, red->acc, red->acc, x, line_no)->size =
+    vec_size;
+  return true;
+}
+
+// Add the vector form of an instruction of the body to the vector
+// loop. Returns false if there is none.
+static bool vectorize_insn(Obj *fn, Ir *ir, IndVar *iv) {
+  Reduction *red = get_reduction(ir);
+  if (red)
+    return ir != red->def || vectorize_reduction(fn, red);
+
+  int line_no = ir->line_no;
+  bool ea, eb;
+
+  switch (ir->kind) {
+  case IR_LOAD: {
+    int k = get_array(fn, ir, iv);
+    if (k < 0)
+      return false;
+    if (!loaded[k]) {
+      loaded[k] = new_vec_reg(fn);
+      add_ir(vec_body, NULL, IR_LOAD, loaded[k], ptrs[k], NULL, line_no);
+      vec_body->last->size = VEC_BYTES;
+    }
+    set_vec(ir->d, loaded[k], true);
+    return true;
+  }
+  case IR_STORE: {
+    int k = get_array(fn, ir, iv);
+    Reg *v = (k < 0) ? NULL : vec_operand(fn, ir->b, &eb, line_no);
+    if (!v)
+      return false;
+    add_ir(vec_body, NULL, IR_STORE, NULL, ptrs[k], v, line_no);
+    vec_body->last->size = VEC_BYTES;
+    stored[k] = true;
+
+    // Arrays may be the same, so load them again.
+    for (int i = 0; i < narrays; i++)
+      loaded[i] = NULL;
+    return true;
+  }
+  case IR_MOV: {
+    Reg *a = vec_operand(fn, ir->a, &ea, line_no);
+    if (!a)
+      return false;
+    set_vec(ir->d, a, ea);
+    return true;
+  }
+  case IR_ZEXT: {
+    // A lane keeps the lower bits of a value, so a zero extension to
+    // the lane size makes it exact.
+    Reg *a = vec_operand(fn, ir->a, &ea, line_no);
+    if (!a || ir->size < vec_size)
+      return false;
+    set_vec(ir->d, a, ea || ir->size == vec_size);
+    return true;
+  }
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_NEG: {
+    static IrKind kinds[] = {
+      [IR_ADD] = IR_VADD, [IR_SUB] = IR_VSUB,
+      [IR_MUL] = IR_VMUL, [IR_NEG] = IR_VSUB,
+    };
+    if ((ir->b && (ir->shift || ir->size)) ||
+        (ir->kind == IR_MUL && vec_size == 8))
+      return false;
+
+    Reg *a, *b;
+    if (ir->kind == IR_NEG) {
+      a = broadcast(fn, NULL, 0, &ea, line_no);
+      b = vec_operand(fn, ir->a, &eb, line_no);
+    } else {
+      a = vec_operand(fn, ir->a, &ea, line_no);
+      b = ir->b ? vec_operand(fn, ir->b, &eb, line_no)
+                : broadcast(fn, NULL, ir->imm, &eb, line_no);
+    }
+    if (!a || !b)
+      return false;
+
+    Reg *d = new_vec_reg(fn);
+    add_ir(vec_body, NULL, kinds[ir->kind], d, a, b, line_no)->size = vec_size;
+    set_vec(ir->d, d, vec_size == 8);
+    return true;
+  }
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE: {
+    static IrKind kinds[] = {
+      [IR_EQ] = IR_VEQ, [IR_NE] = IR_VEQ, [IR_LT] = IR_VLT, [IR_LE] = IR_VLE,
+    };
+    Reg *a = vec_operand(fn, ir->a, &ea, line_no);
+    Reg *b = ir->b ? vec_operand(fn, ir->b, &eb, line_no)
+                   : broadcast(fn, NULL, ir->imm, &eb, line_no);
+    if (!a || !b || !ea || !eb)
+      return false;
+
+    Reg *d = new_vec_reg(fn);
+    Ir *cmp = add_ir(vec_body, NULL, kinds[ir->kind], d, a, b, line_no);
+    cmp->size = vec_size;
+    set_vec(ir->d, d, false);
+    vec_mask[ir->d->vn] = cmp;
+    vec_negated[ir->d->vn] = (ir->kind == IR_NE);
+    return true;
+  }
+  case IR_SEL: {
+    Ir *cmp = vec_mask[ir->a->vn];
+    if (!cmp || ir->imm || (ir->size == 4 && vec_size > 4))
+      return false;
+
+    Reg *t = ir->b ? vec_operand(fn, ir->b, &ea, line_no)
+                   : broadcast(fn, NULL, 0, &ea, line_no);
+    Reg *f = ir->c ? vec_operand(fn, ir->c, &eb, line_no)
+                   : broadcast(fn, NULL, 0, &eb, line_no);
+    if (!t || !f)
+      return false;
+    if (ir->invert != vec_negated[ir->a->vn]) {
+      Reg *tmp = t;
+      t = f;
+      f = tmp;
+    }
+
+    // Selecting one of the compared values is a maximum or a minimum.
+    Reg *d = new_vec_reg(fn);
+    Ir *sel = add_ir(vec_body, NULL, IR_VSEL, d, cmp->d, t, line_no);
+    sel->c = f;
+    sel->size = vec_size;
+    if (cmp->kind != IR_VEQ && vec_size < 8) {
+      if (t == cmp->b && f == cmp->a) {
+        sel->kind = IR_VMAX;
+        sel->a = t;
+        sel->b = f;
+        sel->c = NULL;
+      } else if (t == cmp->a && f == cmp->b) {
+        sel->kind = IR_VMIN;
+        sel->a = t;
+        sel->b = f;
+        sel->c = NULL;
+      }
+    }
+    set_vec(ir->d, d, ea && eb);
+    return true;
+  }
+  }
+  return false;
+}
+
+// Emit the checks that the arrays written by the vector loop are
+// either the same as or at least VEC_BYTES apart from the others.
+// Returns a register that is nonzero if they are not, or NULL if no
+// check is needed.
+static Reg *emit_alias_checks(Obj *fn, BB *pre, int line_no) {
+  Reg *bad = NULL;
+
+  for (int i = 0; i < narrays; i++) {
+    for (int j = 0; j < i; j++) {
+      if (!stored[i] && !stored[j])
+        continue;
+
+      // dist = |arrays[i] - arrays[j]|
+      // overlap = (dist < VEC_BYTES) ? dist : 0
+      Reg *diff = new_reg(fn);
+      Reg *neg = new_reg(fn);
+      Reg *dist = new_reg(fn);
+      Reg *near = new_reg(fn);
+      Reg *overlap = new_reg(fn);
+      add_ir(pre, pre->last, IR_SUB, diff, arrays[i], arrays[j], line_no);
+      add_ir(pre, pre->last, IR_LT, neg, diff, NULL, line_no);
+      Ir *abs = add_ir(pre, pre->last, IR_SEL, dist, neg, diff, line_no);
+      abs->c = diff;
+      abs->imm = -1;
+      abs->invert = true;
+      add_ir(pre, pre->last, IR_LT, near, dist, NULL, line_no)->imm = VEC_BYTES;
+      add_ir(pre, pre->last, IR_SEL, overlap, near, dist, line_no);
+
+      if (bad) {
+        Reg *any = new_reg(fn);
+        add_ir(pre, pre->last, IR_SEL, any, bad, bad, line_no)->c = overlap;
+        overlap = any;
+      }
+      bad = overlap;
+    }
+  }
+  return bad;
+}
+
+// Fold the partial results of the vector loop into the variables.
+static void finish_reductions(Obj *fn, BB *bb, int line_no) {
+  for (int i = 0; i < nreds; i++) {
+    Reduction *red = &reds[i];
+    Reg *r = red->reg;
+    Reg *x = new_reg(fn);
+
+    // Start with a vector of zeros, or of all ones for a minimum.
+    Reg *init = new_reg(fn);
+    Ir *imm = add_ir(vec_pre, NULL, IR_IMM, init, NULL, NULL, line_no);
+    imm->imm = (red->kind == IR_VMIN) ? -1 : 0;
+    Ir *dup = add_ir(vec_pre, NULL, IR_VDUP, red->acc, init, NULL, line_no);
+    dup->size = (red->kind == IR_VMAX || red->kind == IR_VMIN) ? vec_size : 8;
+
+    if (red->kind == IR_VMAX || red->kind == IR_VMIN) {
+      IrKind kind = (red->kind == IR_VMAX) ? IR_VHMAX : IR_VHMIN;
+      add_ir(bb, NULL, kind, x, red->acc, NULL, line_no)->size = vec_size;
+
+      Reg *c = new_reg(fn);
+      if (red->kind == IR_VMAX)
+        add_ir(bb, NULL, IR_LT, c, r, x, line_no);
+      else
+        add_ir(bb, NULL, IR_LT, c, x, r, line_no);
+      Ir *sel = add_ir(bb, NULL, IR_SEL, r, c, x, line_no);
+      sel->c = r;
+      sel->size = red->def->size;
+      continue;
+    }
+
+    add_ir(bb, NULL, IR_VSUM, x, red->acc, NULL, line_no)->size = 8;
+    if (red->zext) {
+      Reg *t = new_reg(fn);
+      add_ir(bb, NULL, IR_ADD, t, r, x, line_no);
+      add_ir(bb, NULL, IR_ZEXT, r, t, NULL, line_no)->size = 4;
+    } else {
+      add_ir(bb, NULL, IR_ADD, r, r, x, line_no);
+    }
+  }
+}
+
+// Vectorize a loop. Returns true if the loop was changed.
+static bool vectorize_loop(Obj *fn, Loop *loop) {
+  BB *header = loop->header;
+  Ir *cmp = header->first;
+  Ir *br = header->last;
+  if (loop->nblocks != 2 || cmp->next != br || br->kind != IR_BR ||
+      br->a != cmp->d || nuses[cmp->d->vn] != 1 ||
+      (cmp->kind != IR_LT && cmp->kind != IR_LE) ||
+      loop->body[br->bb2->index])
+    return false;
+
+  BB *body = br->bb1;
+  if (body->last->kind != IR_JMP || body->last->bb1 != header)
+    return false;
+
+  // The loop must count i up by one to an invariant bound.
+  count_loop_defs(fn, loop);
+  find_ivs(fn, loop);
+  IndVar *iv = get_iv(cmp->a);
+  if (!iv || iv->step != 1 || iv->bb != body ||
+      (cmp->b && !is_invariant(cmp->b)))
+    return false;
+
+  int size = 0;
+  vec_size = 0;
+  for (Ir *ir = body->first; ir != body->last; ir = ir->next, size++) {
+    if (ir->kind != IR_LOAD && ir->kind != IR_STORE)
+      continue;
+    if (vec_size && ir->size != vec_size)
+      return false;
+    vec_size = ir->size;
+  }
+  if (vec_size == 0 || vec_size > 8)
+    return false;
+  int vf = VEC_BYTES / vec_size;
+
+  // Leave a loop with few iterations to the unroller.
+  int64_t trips = count_trips(fn, loop, cmp, iv);
+  if (trips >= 0 && (trips < vf || trips * size <= UNROLL_MAX_SIZE))
+    return false;
+
+  bool *local = find_local_regs(fn, body, false);
+  if (!find_reductions(body, iv, local))
+    return false;
+
+  vec_of = calloc(nloop_defs, sizeof(Reg *));
+  vec_exact = calloc(nloop_defs, sizeof(bool));
+  vec_mask = calloc(nloop_defs, sizeof(Ir *));
+  vec_negated = calloc(nloop_defs, sizeof(bool));
+  vec_pre = new_bb();
+  vec_body = new_bb();
+  nvec_regs = 0;
+  narrays = 0;
+
+  // Accesses must come before i is incremented.
+  Ir *inc = (iv->def->kind == IR_ZEXT) ? iv->def->prev : iv->def;
+  bool after_inc = false;
+  for (Ir *ir = body->first; ir != body->last; ir = ir->next) {
+    if (ir == inc || ir == iv->def) {
+      after_inc = true;
+      continue;
+    }
+    if (after_inc && (ir->kind == IR_LOAD || ir->kind == IR_STORE))
+      return false;
+    if (!vectorize_insn(fn, ir, iv))
+      return false;
+  }
+  if (nvec_regs > VEC_MAX_REGS)
+    return false;
+
+  int line_no = cmp->line_no;
+
+  // Advance the pointers and i. i stays below the bound, so an int
+  // does not need to be truncated.
+  for (int i = 0; i < narrays; i++)
+    add_ir(vec_body, NULL, IR_ADD, ptrs[i], ptrs[i], NULL, line_no)->imm =
+      VEC_BYTES;
+  add_ir(vec_body, NULL, IR_ADD, iv->reg, iv->reg, NULL, line_no)->imm = vf;
+
+  // The vector loop runs while all lanes are within the bound.
+  BB *vec_header = new_bb();
+  BB *vec_exit = new_bb();
+  int64_t delta = -(vf - 1);
+  Ir *test =
+    add_ir(vec_header, NULL, cmp->kind, new_reg(fn), iv->reg, NULL, line_no);
+  if (!cmp->b && is_imm_operand(cmp->kind, cmp->imm + delta))
+    test->imm = cmp->imm + delta;
+  else
+    test->b = emit_bound(fn, loop, cmp->b, NULL,
+                         cmp->b ? delta : cmp->imm + delta, 1, line_no);
+  Ir *vbr = add_ir(vec_header, NULL, IR_BR, NULL, test->d, NULL, line_no);
+  vbr->bb1 = vec_body;
+  vbr->bb2 = vec_exit;
+  add_ir(vec_body, NULL, IR_JMP, NULL, NULL, NULL, line_no)->bb1 = vec_header;
+
+  finish_reductions(fn, vec_exit, line_no);
+
+  // A minimum or a maximum starts from a vector that may be out of the
+  // range of the variable, so fold reductions only if the vector loop
+  // runs at least once.
+  if (nreds) {
+    Ir *first =
+      add_ir(vec_pre, NULL, test->kind, new_reg(fn), test->a, test->b, line_no);
+    first->imm = test->imm;
+    Ir *enter = add_ir(vec_pre, NULL, IR_BR, NULL, first->d, NULL, line_no);
+    enter->bb1 = vec_header;
+    enter->bb2 = header;
+  } else {
+    add_ir(vec_pre, NULL, IR_JMP, NULL, NULL, NULL, line_no)->bb1 = vec_header;
+  }
+  add_ir(vec_exit, NULL, IR_JMP, NULL, NULL, NULL, line_no)->bb1 = header;
+
+  // Enter the vector loop unless arrays overlap.
+  BB *pre = loop->preheader;
+  Reg *bad = emit_alias_checks(fn, pre, line_no);
+  if (bad) {
+    pre->last->kind = IR_BR;
+    pre->last->a = bad;
+    pre->last->bb1 = header;
+    pre->last->bb2 = vec_pre;
+  } else {
+    pre->last->bb1 = vec_pre;
+  }
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    if (bb->next == header) {
+      bb->next = vec_pre;
+      vec_pre->next = vec_header;
+      vec_header->next = vec_body;
+      vec_body->next = vec_exit;
+      vec_exit->next = header;
+      break;
+    }
+  }
+
+  // The original loop runs fewer iterations than a vector has lanes,
+  // unless the arrays overlap, so it is not worth unrolling.
+  vec_header->unroll = header->unroll;
+  header->unroll = 1;
+  return true;
+}
+
+// Vectorize innermost loops. The loops left for the remaining
+// iterations are not vectorized again.
+static void vectorize_loops(Obj *fn) {
+  if (!opt_vectorize)
+    return;
+
+  BB *done[64];
+  int ndone = 0;
+
+  for (bool changed = true; changed && ndone < 64;) {
+    changed = false;
+    find_loops(fn);
+    count_regs(fn);
+
+    for (int i = 0; i < nloops && !changed; i++) {
+      Loop *loop = loops[i];
+      bool seen = false;
+      for (int j = 0; j < ndone; j++)
+        seen |= (done[j] == loop->header);
+      if (!loop->innermost || seen)
+        continue;
+      done[ndone++] = loop->header;
+      changed = vectorize_loop(fn, loop);
+    }
+  }
+}
+
+//
+// Dead code elimination
+//
+
+static bool has_side_effect(Ir *ir) {
+  return !ir->d || ir->kind == IR_CALL || ir->pre_index || ir->post_index;
+}
+
+// Add `delta` to the use counts of the operands of an instruction.
+static void count_uses(int *uses, Ir *ir, int delta) {
+  Reg **ops[MAX_OPERANDS];
+  int nops = get_operands(ir, ops);
+  for (int i = 0; i < nops; i++)
+    uses[(*ops[i])->vn] += delta;
+}
+
+// Remove instructions whose results are never used. Removing one may
+// make its operands dead too, so repeat until nothing changes.
+static void remove_dead_code(Obj *fn) {
+  int *uses = calloc(fn->nregs, sizeof(int));
+
+  for (BB *bb = fn->bbs; bb; bb = bb->next) {
+    for (Ir *ir = bb->first; ir; ir = ir->next)
+      count_uses(uses, ir, 1);
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (BB *bb = fn->bbs; bb; bb = bb->next) {
+      for (Ir *ir = bb->last, *prev; ir; ir = prev) {
+        prev = ir->prev;
+        if (has_side_effect(ir) || uses[ir->d->vn])
+          continue;
+
+        count_uses(uses, ir, -1);
+        remove_ir(bb, ir);
+        changed = true;
+      }
+    }
+  }
+}
+
+static Pass passes[] = {
+  {"simplify-cfg", 1, simplify_cfg},
+  {"fold-constants", 1, fold_constants},
+  {"copy-prop", 1, propagate_copies},
+  {"coalesce", 1, coalesce_copies},
+  {"copy-prop", 1, propagate_copies},
+  {"fold-immediates", 1, fold_immediates},
+  {"fold-addresses", 1, fold_addresses},
+  {"cse", 1, eliminate_common_subexprs},
+  {"dce", 1, remove_dead_code},
+  {"if-convert", 1, convert_ifs},
+  {"copy-prop", 1, propagate_copies},
+  {"dce", 1, remove_dead_code},
+  {"licm", 1, hoist_invariants},
+  {"vectorize", 2, vectorize_loops},
+  {"strength-reduce", 2, reduce_strength},
+  {"dce", 2, remove_dead_code},
+  {"unroll", 2, unroll_loops},
+  {"combine", 1, combine_insns},
+  {"dce", 1, remove_dead_code},
+  {"writeback", 1, use_writeback},
+};
+
+void optimize(Obj *prog, int level) {
+  for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++) {
+    Pass *pass = &passes[i];
+    if (level < pass->level)
+      continue;
+
+    phase_begin(add_phase(pass->name));
+    for (Obj *fn = prog; fn; fn = fn->next)
+      if (fn->bbs)
+        pass->run(fn);
+    phase_end();
+  }
+}
@@ -19,21 +19,10 @@
 #include "chibicc.h"
 
 // Scope for local, global variables or typedefs.
-typedef struct VarScope VarScope;
-struct VarScope {
-  VarScope *next;
-  char *name;
+typedef struct {
   Obj *var;
   Type *type_def;
-};
-
-// Scope for struct or union tags
-typedef struct TagScope TagScope;
-struct TagScope {
-  TagScope *next;
-  char *name;
-  Type *ty;
-};
+} VarScope;
 
 // Represents a block scope.
 typedef struct Scope Scope;
@@ -42,19 +31,23 @@ struct Scope {
 
   // C has two block scopes; one is for variables and the other is
   // for struct tags.
-  VarScope *vars;
-  TagScope *tags;
+  HashMap vars;
+  HashMap tags;
 };
 
 // Variable attributes such as typedef or extern.
 typedef struct {
   bool is_typedef;
+  bool is_static;
 } VarAttr;
 
 // All local variable instances created during parsing are
 // accumulated to this list.
 static Obj *locals;
 
+// The innermost block being parsed
+static Node *current_block;
+
 // Likewise, global variables are accumulated to this list.
 static Obj *globals;
 
@@ -82,6 +75,7 @@ static Token *parse_typedef(Token *tok, Type *basety);
 
 static void enter_scope(void) {
   Scope *sc = calloc(1, sizeof(Scope));
+  counters.scopes++;
   sc->next = scope;
   scope = sc;
 }
@@ -92,23 +86,26 @@ static void leave_scope(void) {
 
 // Find a variable by name.
 static VarScope *find_var(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next)
-    for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
-      if (equal(tok, sc2->name))
-        return sc2;
+  for (Scope *sc = scope; sc; sc = sc->next) {
+    VarScope *sc2 = hashmap_get2(&sc->vars, tok->loc, tok->len);
+    if (sc2)
+      return sc2;
+  }
   return NULL;
 }
 
 static Type *find_tag(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next)
-    for (TagScope *sc2 = sc->tags; sc2; sc2 = sc2->next)
-      if (equal(tok, sc2->name))
-        return sc2->ty;
+  for (Scope *sc = scope; sc; sc = sc->next) {
+    Type *ty = hashmap_get2(&sc->tags, tok->loc, tok->len);
+    if (ty)
+      return ty;
+  }
   return NULL;
 }
 
 static Node *new_node(NodeKind kind, Token *tok) {
   Node *node = calloc(1, sizeof(Node));
+  counters.nodes++;
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -141,9 +138,7 @@ static Node *new_var_node(Obj *var, Token *tok) {
 
 static VarScope *push_scope(char *name) {
   VarScope *sc = calloc(1, sizeof(VarScope));
-  sc->name = name;
-  sc->next = scope->vars;
-  scope->vars = sc;
+  hashmap_put(&scope->vars, name, sc);
   return sc;
 }
 
@@ -158,6 +153,7 @@ static Obj *new_var(char *name, Type *ty) {
 static Obj *new_lvar(char *name, Type *ty) {
   Obj *var = new_var(name, ty);
   var->is_local = true;
+  var->block = current_block;
   var->next = locals;
   locals = var;
   return var;
@@ -176,7 +172,9 @@ static char *new_unique_name(void) {
 }
 
 static Obj *new_anon_gvar(Type *ty) {
-  return new_gvar(new_unique_name(), ty);
+  Obj *var = new_gvar(new_unique_name(), ty);
+  var->is_static = true;
+  return var;
 }
 
 static Obj *new_string_literal(char *p, Type *ty) {
@@ -207,15 +205,11 @@ static long get_number(Token *tok) {
 }
 
 static void push_tag_scope(Token *tok, Type *ty) {
-  TagScope *sc = calloc(1, sizeof(TagScope));
-  sc->name = strndup(tok->loc, tok->len);
-  sc->ty = ty;
-  sc->next = scope->tags;
-  scope->tags = sc;
+  hashmap_put2(&scope->tags, tok->loc, tok->len, ty);
 }
 
 // declspec = ("void" | "char" | "short" | "int" | "long"
-//             | "typedef"
+//             | "typedef" | "static"
 //             | struct-decl | union-decl | typedef-name)+
 //
 // The order of typenames in a type-specifier doesn't matter. For
@@ -247,11 +241,18 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
   int counter = 0;
 
   while (is_typename(tok)) {
-    // Handle "typedef" keyword
-    if (equal(tok, "typedef")) {
+    // Handle storage class specifiers.
+    if (equal(tok, "typedef") || equal(tok, "static")) {
       if (!attr)
         error_tok(tok, "storage class specifier is not allowed in this context");
-      attr->is_typedef = true;
+
+      if (equal(tok, "typedef"))
+        attr->is_typedef = true;
+      else
+        attr->is_static = true;
+
+      if (attr->is_typedef && attr->is_static)
+        error_tok(tok, "typedef and static may not be used together");
       tok = tok->next;
       continue;
     }
@@ -439,7 +440,7 @@ static Node *declaration(Token **rest, Token *tok, Type *basety) {
 static bool is_typename(Token *tok) {
   static char *kw[] = {
     "void", "char", "short", "int", "long", "struct", "union",
-    "typedef",
+    "typedef", "static",
   };
 
   for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
@@ -448,13 +449,51 @@ static bool is_typename(Token *tok) {
   return find_typedef(tok);
 }
 
+// pragma = "#pragma" ("unroll" ("(" num ")" | num)? | "nounroll")
+//
+// Returns the unroll factor of the loop following a pragma, -1 if
+// the pragma leaves the factor to the compiler, or 0 if the pragma
+// is not about loop unrolling.
+static int unroll_pragma(Token *tok) {
+  char *s = strndup(tok->loc, tok->len);
+  char name[10] = "";
+  int n;
+  int matched = sscanf(s, "#pragma %9[a-z] (%d", name, &n);
+  if (matched < 2)
+    matched = sscanf(s, "#pragma %9[a-z] %d", name, &n);
+
+  if (!strcmp(name, "nounroll"))
+    return 1;
+  if (strcmp(name, "unroll"))
+    return 0;
+  if (matched < 2)
+    return -1;
+  if (n < 0)
+    error_tok(tok, "invalid unroll count");
+  if (n == 0)
+    return 1;
+  return n;
+}
+
 // stmt = "return" expr ";"
 //      | "if" "(" expr ")" stmt ("else" stmt)?
 //      | "for" "(" expr-stmt expr? ";" expr? ")" stmt
 //      | "while" "(" expr ")" stmt
 //      | "{" compound-stmt
+//      | pragma stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok) {
+  if (tok->kind == TK_PRAGMA) {
+    int unroll = unroll_pragma(tok);
+    Node *node = stmt(rest, tok->next);
+    if (unroll) {
+      if (node->kind != ND_FOR)
+        error_tok(tok, "expected a loop after #pragma unroll");
+      node->unroll = unroll;
+    }
+    return node;
+  }
+
   if (equal(tok, "return")) {
     Node *node = new_node(ND_RETURN, tok);
     node->lhs = expr(&tok, tok->next);
@@ -513,6 +552,9 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   Node head = {};
   Node *cur = &head;
 
+  Node *outer = current_block;
+  current_block = node;
+
   enter_scope();
 
   while (!equal(tok, "}")) {
@@ -525,6 +567,9 @@ static Node *compound_stmt(Token **rest, Token *tok) {
         continue;
       }
 
+      if (attr.is_static)
+        error_tok(tok, "static local variables are not supported");
+
       cur = cur->next = declaration(&tok, tok, basety);
     } else {
       cur = cur->next = stmt(&tok, tok);
@@ -533,6 +578,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   }
 
   leave_scope();
+  current_block = outer;
 
   node->body = head.next;
   *rest = tok->next;
@@ -678,7 +724,9 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   if (lhs->ty->base && rhs->ty->base) {
     Node *node = new_binary(ND_SUB, lhs, rhs, tok);
     node->ty = ty_int;
-    return new_binary(ND_DIV, node, new_num(lhs->ty->base->size, tok), tok);
+    node = new_binary(ND_DIV, node, new_num(lhs->ty->base->size, tok), tok);
+    node->exact = true;
+    return node;
   }
 
   error_tok(tok, "invalid operands");
@@ -789,6 +837,7 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
 
   // Construct a struct object.
   Type *ty = calloc(1, sizeof(Type));
+  counters.types++;
   ty->kind = TY_STRUCT;
   struct_members(rest, tok->next, ty);
   ty->align = 1;
@@ -920,9 +969,11 @@ static Node *primary(Token **rest, Token *tok) {
   Token *start = tok;
 
   if (equal(tok, "(") && equal(tok->next, "{")) {
-    // This is a GNU statement expresssion.
-    Node *node = new_node(ND_STMT_EXPR, tok);
-    node->body = compound_stmt(&tok, tok->next->next)->body;
+    // This is a GNU statement expresssion. The block node is reused
+    // so that it stays the block of the variables declared in it.
+    Node *node = compound_stmt(&tok, tok->next->next);
+    node->kind = ND_STMT_EXPR;
+    node->tok = start;
     *rest = skip(tok, ")");
     return node;
   }
@@ -994,11 +1045,12 @@ static void create_param_lvars(Type *param) {
   }
 }
 
-static Token *function(Token *tok, Type *basety) {
+static Token *function(Token *tok, Type *basety, VarAttr *attr) {
   Type *ty = declarator(&tok, tok, basety);
 
   Obj *fn = new_gvar(get_ident(ty->name), ty);
   fn->is_function = true;
+  fn->is_static = attr->is_static;
   fn->is_definition = !consume(&tok, tok, ";");
 
   if (!fn->is_definition)
@@ -1016,7 +1068,7 @@ static Token *function(Token *tok, Type *basety) {
   return tok;
 }
 
-static Token *global_variable(Token *tok, Type *basety) {
+static Token *global_variable(Token *tok, Type *basety, VarAttr *attr) {
   bool first = true;
 
   while (!consume(&tok, tok, ";")) {
@@ -1025,7 +1077,8 @@ static Token *global_variable(Token *tok, Type *basety) {
     first = false;
 
     Type *ty = declarator(&tok, tok, basety);
-    new_gvar(get_ident(ty->name), ty);
+    Obj *var = new_gvar(get_ident(ty->name), ty);
+    var->is_static = attr->is_static;
   }
   return tok;
 }
@@ -1046,6 +1099,12 @@ Obj *parse(Token *tok) {
   globals = NULL;
 
   while (tok->kind != TK_EOF) {
+    // Pragmas at file scope are ignored.
+    if (tok->kind == TK_PRAGMA) {
+      tok = tok->next;
+      continue;
+    }
+
     VarAttr attr = {};
     Type *basety = declspec(&tok, tok, &attr);
 
@@ -1057,12 +1116,12 @@ Obj *parse(Token *tok) {
 
     // Function
     if (is_function(tok)) {
-      tok = function(tok, basety);
+      tok = function(tok, basety, &attr);
       continue;
     }
 
     // Global variable
-    tok = global_variable(tok, basety);
+    tok = global_variable(tok, basety, &attr);
 
   }
   return globals;
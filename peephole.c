@@ -0,0 +1,413 @@
+// This file implements a peephole optimizer, which rewrites short
+// sequences of instructions into cheaper ones.
+//
+// When it is enabled, the code generator does not write a function's
+// assembly to the output file directly. Lines are collected into a
+// list of Insns, the patterns below are matched against the list
+// until none of them applies, and then the list is written out.
+//
+// Patterns work on the assembly text, so they know nothing about the
+// program except what they can see in a few adjacent instructions.
+// A register is assumed to be live at the end of a basic block unless
+// it is a temporary and the block ends with a call or a return.
+
+#include "chibicc.h"
+
+typedef struct {
+  char *name;
+  bool (*fn)(Insn *insn);
+  int64_t *count;
+} Pattern;
+
+//
+// Parsing
+//
+
+static bool is_insn(Insn *insn) {
+  return insn->text[0] == ' ' && insn->text[2] != '.';
+}
+
+static bool is_label(Insn *insn) {
+  return insn->text[0] != ' ';
+}
+
+// Split an instruction into its mnemonic and operands. Commas inside
+// brackets do not separate operands.
+static void parse_insn(Insn *insn) {
+  insn->nopnds = 0;
+  if (!is_insn(insn))
+    return;
+
+  char *p = insn->text + 2;
+  char *q = p;
+  while (*q && *q != ' ')
+    q++;
+  insn->op = strndup(p, q - p);
+
+  while (*q == ' ')
+    q++;
+
+  while (*q && insn->nopnds < 4) {
+    char *start = q;
+    int nest = 0;
+    for (; *q && (nest || *q != ','); q++) {
+      if (*q == '[')
+        nest++;
+      else if (*q == ']')
+        nest--;
+    }
+    insn->opnd[insn->nopnds++] = strndup(start, q - start);
+    if (*q == ',')
+      q++;
+    while (*q == ' ')
+      q++;
+  }
+}
+
+static void set_text(Insn *insn, char *text) {
+  insn->text = text;
+  parse_insn(insn);
+}
+
+static Insn *new_insn(char *text) {
+  Insn *insn = calloc(1, sizeof(Insn));
+  set_text(insn, text);
+  return insn;
+}
+
+static void delete(Insn *insn) {
+  insn->prev->next = insn->next;
+  if (insn->next)
+    insn->next->prev = insn->prev;
+}
+
+// Returns the next instruction, skipping directives. Returns NULL if
+// a label comes first.
+static Insn *next_insn(Insn *insn) {
+  for (insn = insn->next; insn; insn = insn->next) {
+    if (is_label(insn))
+      return NULL;
+    if (is_insn(insn))
+      return insn;
+  }
+  return NULL;
+}
+
+static bool is_op(Insn *insn, char *op) {
+  return insn && is_insn(insn) && !strcmp(insn->op, op);
+}
+
+// Returns the number of a general-purpose register operand such as
+// "x9" or "w9", or -1 if it is not one.
+static int reg_num(char *s) {
+  if ((s[0] != 'x' && s[0] != 'w') || !isdigit(s[1]))
+    return -1;
+  char *end;
+  int n = strtol(s + 1, &end, 10);
+  return *end ? -1 : n;
+}
+
+static bool is_xreg(char *s) {
+  return s[0] == 'x' && reg_num(s) >= 0;
+}
+
+// Parse an immediate operand. The '#' prefix is optional.
+static bool parse_imm(char *s, int64_t *val) {
+  if (*s == '#')
+    s++;
+  char *end;
+  *val = strtoll(s, &end, 0);
+  return end != s && !*end;
+}
+
+// Parse a memory operand of the form "[base]" or "[base, #off]".
+static bool parse_mem(char *s, char *base, int64_t *off) {
+  int n = strlen(s);
+  if (s[0] != '[' || s[n - 1] != ']')
+    return false;
+
+  char *comma = strchr(s, ',');
+  if (!comma) {
+    snprintf(base, 8, "%.*s", n - 2, s + 1);
+    *off = 0;
+    return true;
+  }
+
+  snprintf(base, 8, "%.*s", (int)(comma - s - 1), s + 1);
+  char *imm = strndup(comma + 1, s + n - 1 - comma - 1);
+  while (*imm == ' ')
+    imm++;
+  return parse_imm(imm, off);
+}
+
+// Returns the access size of a load or a store.
+static int access_size(Insn *insn) {
+  if (!strcmp(insn->op, "ldrb") || !strcmp(insn->op, "strb"))
+    return 1;
+  if (!strcmp(insn->op, "ldrh") || !strcmp(insn->op, "strh"))
+    return 2;
+  if (!strcmp(insn->op, "ldr") || !strcmp(insn->op, "str"))
+    return insn->opnd[0][0] == 'x' ? 8 : 4;
+  return 0;
+}
+
+//
+// Liveness
+//
+
+// Returns true if an operand refers to a given register.
+static bool mentions(char *s, int reg) {
+  for (char *p = s; *p; p++) {
+    if ((*p != 'x' && *p != 'w') || (p > s && isalnum(p[-1])) || !isdigit(p[1]))
+      continue;
+    char *end;
+    if (strtol(p + 1, &end, 10) == reg && !isalnum(*end))
+      return true;
+  }
+  return false;
+}
+
+// Returns true if the first operand of an instruction is written
+// rather than read.
+static bool writes_first_operand(Insn *insn) {
+  static char *ops[] = {
+    "str", "strb", "strh", "stp", "stur", "cmp", "cmn", "tst",
+    "cbz", "cbnz", "tbz", "tbnz", "b", "bl", "br", "blr", "ret",
+  };
+  for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++)
+    if (!strcmp(insn->op, ops[i]))
+      return false;
+  return strncmp(insn->op, "b.", 2) != 0;
+}
+
+// Returns true if the value of a register is not used after a given
+// instruction.
+static bool is_dead_after(Insn *insn, int reg) {
+  // The stack pointer, the frame pointer, the link register and the
+  // callee-saved registers are always live.
+  if (reg >= 18)
+    return false;
+
+  for (insn = insn->next; insn; insn = insn->next) {
+    if (is_label(insn))
+      return false;
+    if (!is_insn(insn))
+      continue;
+
+    for (int i = writes_first_operand(insn); i < insn->nopnds; i++)
+      if (mentions(insn->opnd[i], reg))
+        return false;
+
+    // Calls clobber and returns end the life of temporaries, but
+    // argument registers are used by both.
+    if (!strcmp(insn->op, "bl") || !strcmp(insn->op, "ret"))
+      return reg >= 8;
+
+    if (writes_first_operand(insn) && insn->nopnds > 0 &&
+        reg_num(insn->opnd[0]) == reg)
+      return true;
+
+    if (insn->op[0] == 'b' || !strncmp(insn->op, "cb", 2) ||
+        !strncmp(insn->op, "tb", 2))
+      return false;
+  }
+  return false;
+}
+
+//
+// Patterns
+//
+
+// str xA, [sp, #-8]!; ldr xB, [sp], #8 => mov xB, xA
+static bool push_pop(Insn *insn) {
+  Insn *next = next_insn(insn);
+  if (!is_op(insn, "str") || insn->nopnds != 2 || !is_xreg(insn->opnd[0]) ||
+      strcmp(insn->opnd[1], "[sp, #-8]!"))
+    return false;
+  if (!is_op(next, "ldr") || next->nopnds != 3 || !is_xreg(next->opnd[0]) ||
+      strcmp(next->opnd[1], "[sp]") || strcmp(next->opnd[2], "#8"))
+    return false;
+
+  if (!strcmp(insn->opnd[0], next->opnd[0]))
+    delete(insn);
+  else
+    set_text(insn, format("  mov %s, %s", next->opnd[0], insn->opnd[0]));
+  delete(next);
+  return true;
+}
+
+// str xA, [M]; ldr xB, [M] => str xA, [M]; mov xB, xA
+static bool store_load(Insn *insn) {
+  Insn *next = next_insn(insn);
+  char base[8];
+  int64_t off;
+
+  if (!is_op(insn, "str") || insn->nopnds != 2 || !is_xreg(insn->opnd[0]) ||
+      !parse_mem(insn->opnd[1], base, &off))
+    return false;
+  if (!is_op(next, "ldr") || next->nopnds != 2 || !is_xreg(next->opnd[0]) ||
+      strcmp(insn->opnd[1], next->opnd[1]))
+    return false;
+
+  if (!strcmp(insn->opnd[0], next->opnd[0]))
+    delete(next);
+  else
+    set_text(next, format("  mov %s, %s", next->opnd[0], insn->opnd[0]));
+  return true;
+}
+
+// add xT, xB, #off; ldr R, [xT] => ldr R, [xB, #off]
+// if xT is not used after that. Stores are handled likewise.
+static bool fold_address(Insn *insn) {
+  Insn *next = next_insn(insn);
+  int64_t off;
+
+  if ((!is_op(insn, "add") && !is_op(insn, "sub")) || insn->nopnds != 3 ||
+      !is_xreg(insn->opnd[0]) || !parse_imm(insn->opnd[2], &off))
+    return false;
+  if (!next || next->nopnds != 2 || !access_size(next) ||
+      strcmp(next->opnd[1], format("[%s]", insn->opnd[0])))
+    return false;
+
+  if (insn->op[0] == 's')
+    off = -off;
+
+  // ldr and str take a scaled 12-bit unsigned offset or an unscaled
+  // 9-bit signed offset.
+  int size = access_size(next);
+  if (!(off >= 0 && off % size == 0 && off <= 4095 * size) &&
+      !(-256 <= off && off <= 255))
+    return false;
+
+  int t = reg_num(insn->opnd[0]);
+  bool is_load = (next->op[0] == 'l');
+  if (!is_load && reg_num(next->opnd[0]) == t)
+    return false;
+  if (!(is_load && reg_num(next->opnd[0]) == t) && !is_dead_after(next, t))
+    return false;
+
+  set_text(next, format("  %s %s, [%s, #%ld]", next->op, next->opnd[0],
+                        insn->opnd[1], off));
+  delete(insn);
+  return true;
+}
+
+// b .L.x; .L.x: => .L.x:
+static bool jump_to_next(Insn *insn) {
+  if (!is_op(insn, "b"))
+    return false;
+
+  char *label = format("%s:", insn->opnd[0]);
+  for (Insn *p = insn->next; p; p = p->next) {
+    if (!strcmp(p->text, label)) {
+      delete(insn);
+      return true;
+    }
+    if (is_insn(p))
+      return false;
+  }
+  return false;
+}
+
+// ldr xA, [xB, #off]; ldr xC, [xB, #off+8] => ldp xA, xC, [xB, #off]
+// Stores are merged to stp likewise. 32-bit accesses are merged too.
+static bool merge_pair(Insn *insn) {
+  Insn *next = next_insn(insn);
+  if (!next || !is_insn(insn))
+    return false;
+
+  bool is_load = !strcmp(insn->op, "ldr");
+  if ((!is_load && strcmp(insn->op, "str")) || strcmp(insn->op, next->op) ||
+      insn->nopnds != 2 || next->nopnds != 2 ||
+      insn->opnd[0][0] != next->opnd[0][0])
+    return false;
+
+  char base1[8], base2[8];
+  int64_t off1, off2;
+  if (!parse_mem(insn->opnd[1], base1, &off1) ||
+      !parse_mem(next->opnd[1], base2, &off2) || strcmp(base1, base2))
+    return false;
+
+  int size = access_size(insn);
+  int a = reg_num(insn->opnd[0]);
+  int c = reg_num(next->opnd[0]);
+  if (a < 0 || c < 0)
+    return false;
+
+  // The first load must not change the base of the second.
+  if (is_load && (a == c || a == reg_num(base1)))
+    return false;
+
+  Insn *lo = insn, *hi = next;
+  if (off2 == off1 - size) {
+    lo = next;
+    hi = insn;
+  } else if (off2 != off1 + size) {
+    return false;
+  }
+
+  int64_t off = (lo == insn) ? off1 : off2;
+  if (off % size || off < -64 * size || off > 63 * size)
+    return false;
+
+  set_text(insn, format("  %s %s, %s, [%s, #%ld]", is_load ? "ldp" : "stp",
+                        lo->opnd[0], hi->opnd[0], base1, off));
+  delete(next);
+  return true;
+}
+
+// mov xA, xA => (nothing)
+static bool redundant_move(Insn *insn) {
+  if (!is_op(insn, "mov") || insn->nopnds != 2 || !is_xreg(insn->opnd[0]) ||
+      strcmp(insn->opnd[0], insn->opnd[1]))
+    return false;
+  delete(insn);
+  return true;
+}
+
+static Pattern patterns[] = {
+  {"push-pop", push_pop},
+  {"store-load", store_load},
+  {"fold-address", fold_address},
+  {"jump-to-next", jump_to_next},
+  {"merge-pair", merge_pair},
+  {"redundant-move", redundant_move},
+};
+
+// Add a line to the end of a list.
+Insn *add_insn(Insn *tail, char *text) {
+  Insn *insn = new_insn(text);
+  insn->prev = tail;
+  tail->next = insn;
+  return insn;
+}
+
+// Apply patterns to a list of lines whose first element is a dummy
+// head until nothing changes.
+void peephole(Insn *head) {
+  int npatterns = sizeof(patterns) / sizeof(*patterns);
+
+  if (!patterns[0].count)
+    for (int i = 0; i < npatterns; i++)
+      patterns[i].count = add_counter(format("peephole.%s", patterns[i].name));
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (Insn *insn = head->next, *next; insn; insn = next) {
+      next = insn->next;
+      if (!is_insn(insn))
+        continue;
+
+      for (int i = 0; i < npatterns; i++) {
+        // A pattern may delete the instruction following this one.
+        Insn *prev = insn->prev;
+        if (patterns[i].fn(insn)) {
+          (*patterns[i].count)++;
+          changed = true;
+          next = prev->next;
+          break;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,305 @@
+// This file implements a linear scan register allocator.
+//
+// Virtual registers of a function in IR form are mapped to the
+// temporary registers x9-x15 and the callee-saved registers x19-x28,
+// plus x29 if the frame pointer is omitted.
+// The live range of a virtual register is approximated by a single
+// interval over the instructions numbered in block order. Intervals
+// are visited in the order of their start points, and a register is
+// freed when the interval holding it ends. If no register is
+// available, the interval that ends last is spilled to a stack slot.
+//
+// x9-x15 are clobbered by function calls, so a value that is live
+// across a call gets a callee-saved register or is spilled.
+//
+// Vectors get v16-v31. The vectorizer uses only a few of them in a
+// loop without calls, so they are never spilled.
+
+#include "chibicc.h"
+
+static int temp_regs[] = {9, 10, 11, 12, 13, 14, 15};
+static int callee_regs[] = {19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29};
+
+static int vector_regs[] = {16, 17, 18, 19, 20, 21, 22, 23,
+                            24, 25, 26, 27, 28, 29, 30, 31};
+
+#define NUM_TEMP (sizeof(temp_regs) / sizeof(*temp_regs))
+#define NUM_CALLEE (sizeof(callee_regs) / sizeof(*callee_regs))
+#define NUM_VECTOR (sizeof(vector_regs) / sizeof(*vector_regs))
+
+typedef struct {
+  Reg *reg;
+  int start;
+  int end;
+  bool across_call;
+} Interval;
+
+//
+// Liveness analysis
+//
+
+static int nwords;
+
+static uint64_t *new_set(void) {
+  return calloc(nwords, sizeof(uint64_t));
+}
+
+static void set_add(uint64_t *set, int i) {
+  set[i / 64] |= 1ULL << (i % 64);
+}
+
+static bool set_has(uint64_t *set, int i) {
+  return set[i / 64] & (1ULL << (i % 64));
+}
+
+static int get_succs(BB *bb, BB **succs) {
+  Ir *ir = bb->last;
+  if (ir->kind == IR_JMP) {
+    succs[0] = ir->bb1;
+    return 1;
+  }
+  if (ir->kind == IR_BR) {
+    succs[0] = ir->bb1;
+    succs[1] = ir->bb2;
+    return 2;
+  }
+  return 0;
+}
+
+static void add_use(uint64_t *use, uint64_t *def, Reg *r) {
+  if (!set_has(def, r->vn))
+    set_add(use, r->vn);
+}
+
+// Compute the sets of virtual registers live at the beginning and the
+// end of each block.
+static void compute_liveness(BB **bbs, int nbbs) {
+  uint64_t **use = calloc(nbbs, sizeof(uint64_t *));
+  uint64_t **def = calloc(nbbs, sizeof(uint64_t *));
+
+  for (int i = 0; i < nbbs; i++) {
+    bbs[i]->live_in = new_set();
+    bbs[i]->live_out = new_set();
+    use[i] = new_set();
+    def[i] = new_set();
+
+    for (Ir *ir = bbs[i]->first; ir; ir = ir->next) {
+      Reg **ops[MAX_OPERANDS];
+      int nops = get_operands(ir, ops);
+      for (int j = 0; j < nops; j++)
+        add_use(use[i], def[i], *ops[j]);
+
+      Reg *defs[2];
+      int ndefs = get_defs(ir, defs);
+      for (int j = 0; j < ndefs; j++)
+        set_add(def[i], defs[j]->vn);
+    }
+  }
+
+  // Iterate to a fixed point. Visiting blocks backwards makes this
+  // converge in a few rounds.
+  for (bool changed = true; changed;) {
+    changed = false;
+
+    for (int i = nbbs - 1; i >= 0; i--) {
+      BB *bb = bbs[i];
+      BB *succs[2];
+      int n = get_succs(bb, succs);
+
+      for (int j = 0; j < n; j++)
+        for (int k = 0; k < nwords; k++)
+          bb->live_out[k] |= succs[j]->live_in[k];
+
+      for (int k = 0; k < nwords; k++) {
+        uint64_t in = use[i][k] | (bb->live_out[k] & ~def[i][k]);
+        if (in != bb->live_in[k]) {
+          bb->live_in[k] = in;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+//
+// Live intervals
+//
+
+static Interval *intervals;
+
+static void extend(Reg *r, int pos) {
+  Interval *iv = &intervals[r->vn];
+  iv->reg = r;
+  if (iv->start < 0 || pos < iv->start)
+    iv->start = pos;
+  if (pos > iv->end)
+    iv->end = pos;
+}
+
+// Extend the intervals of all registers in `set` to `pos`.
+static void extend_set(uint64_t *set, int pos) {
+  for (int k = 0; k < nwords; k++)
+    for (uint64_t w = set[k]; w; w &= w - 1)
+      extend(intervals[k * 64 + __builtin_ctzll(w)].reg, pos);
+}
+
+static int cmp_start(const void *a, const void *b) {
+  return (*(Interval **)a)->start - (*(Interval **)b)->start;
+}
+
+static void build_intervals(Obj *fn) {
+  int nbbs = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    nbbs++;
+
+  BB **bbs = calloc(nbbs, sizeof(BB *));
+  int i = 0;
+  for (BB *bb = fn->bbs; bb; bb = bb->next)
+    bbs[i++] = bb;
+
+  nwords = (fn->nregs + 63) / 64;
+  compute_liveness(bbs, nbbs);
+
+  intervals = calloc(fn->nregs, sizeof(Interval));
+  for (int i = 0; i < fn->nregs; i++)
+    intervals[i].start = intervals[i].end = -1;
+
+  // Number instructions by twos. Operands are read at an even
+  // position, and the result is written at the following odd one.
+  int pos = 0;
+  for (int i = 0; i < nbbs; i++)
+    for (Ir *ir = bbs[i]->first; ir; ir = ir->next)
+      pos += 2;
+
+  // calls[p] is the number of calls before position p.
+  int *calls = calloc(pos + 1, sizeof(int));
+  pos = 0;
+
+  for (int i = 0; i < nbbs; i++) {
+    for (Ir *ir = bbs[i]->first; ir; ir = ir->next) {
+      Reg **ops[MAX_OPERANDS];
+      int nops = get_operands(ir, ops);
+      for (int j = 0; j < nops; j++)
+        extend(*ops[j], pos);
+
+      Reg *defs[2];
+      int ndefs = get_defs(ir, defs);
+      for (int j = 0; j < ndefs; j++)
+        extend(defs[j], pos + 1);
+
+      calls[pos + 1] = calls[pos] + (ir->kind == IR_CALL);
+      calls[pos + 2] = calls[pos + 1];
+      pos += 2;
+    }
+  }
+
+  // A register live at the beginning or the end of a block must keep
+  // its value through that part of the block.
+  pos = 0;
+  for (int i = 0; i < nbbs; i++) {
+    extend_set(bbs[i]->live_in, pos);
+    for (Ir *ir = bbs[i]->first; ir; ir = ir->next)
+      pos += 2;
+    extend_set(bbs[i]->live_out, pos);
+  }
+
+  // Arguments of a call end at the call, and the result starts after
+  // it, so neither is considered to live across the call.
+  for (int vn = 0; vn < fn->nregs; vn++) {
+    Interval *iv = &intervals[vn];
+    if (iv->reg && calls[iv->end] > calls[iv->start + 1])
+      iv->across_call = true;
+  }
+}
+
+//
+// Register assignment
+//
+
+static void spill(Obj *fn, Interval *iv) {
+  iv->reg->rn = -1;
+  iv->reg->slot = fn->nspills++;
+}
+
+static void alloc_fn(Obj *fn) {
+  build_intervals(fn);
+
+  Interval **sorted = calloc(fn->nregs, sizeof(Interval *));
+  int n = 0;
+  for (int i = 0; i < fn->nregs; i++)
+    if (intervals[i].reg)
+      sorted[n++] = &intervals[i];
+  qsort(sorted, n, sizeof(Interval *), cmp_start);
+
+  // The interval occupying each machine register, if any.
+  Interval *active[32] = {};
+  Interval *vactive[32] = {};
+
+  for (int i = 0; i < n; i++) {
+    Interval *iv = sorted[i];
+
+    // Expire old intervals.
+    for (int r = 0; r < 32; r++) {
+      if (active[r] && active[r]->end < iv->start)
+        active[r] = NULL;
+      if (vactive[r] && vactive[r]->end < iv->start)
+        vactive[r] = NULL;
+    }
+
+    if (iv->reg->vector) {
+      int rn = -1;
+      for (int j = 0; j < NUM_VECTOR && rn < 0; j++)
+        if (!vactive[vector_regs[j]])
+          rn = vector_regs[j];
+      if (rn < 0 || iv->across_call)
+        error("%s: out of vector registers", fn->name);
+      iv->reg->rn = rn;
+      vactive[rn] = iv;
+      continue;
+    }
+
+    // Prefer a temporary register so that callee-saved registers,
+    // which have to be saved in the prologue, are used only when
+    // needed.
+    int rn = -1;
+    if (!iv->across_call)
+      for (int j = 0; j < NUM_TEMP && rn < 0; j++)
+        if (!active[temp_regs[j]])
+          rn = temp_regs[j];
+    for (int j = 0; j < NUM_CALLEE && rn < 0; j++)
+      if (!active[callee_regs[j]] && (callee_regs[j] != 29 || opt_omit_frame_pointer))
+        rn = callee_regs[j];
+
+    // If all registers are taken, spill the interval that ends last.
+    // Only a callee-saved register can be taken over by an interval
+    // that lives across a call.
+    if (rn < 0) {
+      Interval *victim = NULL;
+      for (int r = 0; r < 32; r++) {
+        if (!active[r] || (iv->across_call && r < 19))
+          continue;
+        if (!victim || active[r]->end > victim->end)
+          victim = active[r];
+      }
+
+      if (!victim || victim->end <= iv->end) {
+        spill(fn, iv);
+        continue;
+      }
+
+      rn = victim->reg->rn;
+      spill(fn, victim);
+      active[rn] = NULL;
+    }
+
+    iv->reg->rn = rn;
+    active[rn] = iv;
+    fn->used_regs |= 1u << rn;
+  }
+}
+
+void alloc_regs(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->bbs)
+      alloc_fn(fn);
+}
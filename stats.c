@@ -0,0 +1,294 @@
+// This file implements -ftime-report and --stats, which tell where the
+// compiler spends its time.
+//
+// Each phase of the compiler is bracketed by phase_begin() and
+// phase_end(). Phases nest (add_type() runs in the middle of parsing,
+// for example), and time is always charged to the innermost phase, so
+// the numbers in the report add up to the total. Where the kernel lets
+// us use perf_event_open(2), CPU cycles and retired instructions are
+// recorded alongside wall-clock time.
+//
+// When the feature is disabled, phase_begin() and phase_end() return
+// immediately, and the only cost left is the counters, which are
+// plain integer increments.
+
+#define _DEFAULT_SOURCE
+#include "chibicc.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+Counters counters;
+
+static StatsFormat format_kind;
+
+// Counters registered by add_counter()
+#define MAX_COUNTERS 64
+
+static char *counter_names[MAX_COUNTERS];
+static int64_t counter_vals[MAX_COUNTERS];
+static int ncounters;
+
+#define MAX_PHASES 64
+
+static char *phase_names[MAX_PHASES] = {
+  [PHASE_READ_FILE] = "read_file",
+  [PHASE_TOKENIZE] = "tokenize",
+  [PHASE_PARSE] = "parse",
+  [PHASE_ADD_TYPE] = "add_type",
+  [PHASE_GEN_IR] = "gen_ir",
+  [PHASE_REGALLOC] = "regalloc",
+  [PHASE_CODEGEN] = "codegen",
+};
+
+static int nphases = PHASE_END;
+
+typedef struct {
+  int64_t ns;
+  int64_t cycles;
+  int64_t insns;
+} Sample;
+
+static Sample phase_time[MAX_PHASES];
+static Sample start;
+static Sample last;
+
+// Stack of currently running phases.
+static int stack[16];
+static int depth;
+
+static int cycles_fd = -1;
+static int insns_fd = -1;
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int open_counter(uint64_t config) {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+  struct perf_event_attr attr = {};
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static int64_t read_counter(int fd) {
+  int64_t val;
+  if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+    return 0;
+  return val;
+}
+
+static Sample sample(void) {
+  return (Sample){now_ns(), read_counter(cycles_fd), read_counter(insns_fd)};
+}
+
+// Charge the time elapsed since the last phase switch to the
+// innermost running phase.
+static void account(void) {
+  Sample s = sample();
+  if (depth > 0) {
+    Sample *p = &phase_time[stack[depth - 1]];
+    p->ns += s.ns - last.ns;
+    p->cycles += s.cycles - last.cycles;
+    p->insns += s.insns - last.insns;
+  }
+  last = s;
+}
+
+void stats_enable(StatsFormat fmt) {
+  format_kind = fmt;
+
+#ifdef __linux__
+  cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+  insns_fd = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+#endif
+
+  start = last = sample();
+}
+
+// Register a new phase and returns its ID. Phases with the same
+// name share the same ID.
+int add_phase(char *name) {
+  for (int i = 0; i < nphases; i++)
+    if (!strcmp(phase_names[i], name))
+      return i;
+
+  if (nphases == MAX_PHASES)
+    unreachable();
+  phase_names[nphases] = name;
+  return nphases++;
+}
+
+// Register a new counter and return a pointer to its value.
+int64_t *add_counter(char *name) {
+  if (ncounters == MAX_COUNTERS)
+    unreachable();
+  counter_names[ncounters] = name;
+  return &counter_vals[ncounters++];
+}
+
+void phase_begin(int phase) {
+  if (!format_kind)
+    return;
+  if (depth == sizeof(stack) / sizeof(*stack))
+    unreachable();
+  account();
+  stack[depth++] = phase;
+}
+
+void phase_end(void) {
+  if (!format_kind)
+    return;
+  account();
+  depth--;
+}
+
+// Returns the peak resident set size of the process in KiB.
+static long max_rss_kb(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+  return ru.ru_maxrss;
+}
+
+static void print_table(FILE *out, Sample total) {
+  bool perf = (cycles_fd >= 0);
+
+  fprintf(out, "Execution times:\n");
+  if (perf)
+    fprintf(out, "  %-16s %12s %6s %16s %16s\n", "phase", "wall (ms)", "%",
+            "cycles", "instructions");
+  else
+    fprintf(out, "  %-16s %12s %6s\n", "phase", "wall (ms)", "%");
+
+  for (int i = 0; i < nphases; i++) {
+    Sample *p = &phase_time[i];
+    double pct = total.ns ? 100.0 * p->ns / total.ns : 0;
+    if (perf)
+      fprintf(out, "  %-16s %12.3f %6.1f %16ld %16ld\n", phase_names[i],
+              p->ns / 1e6, pct, p->cycles, p->insns);
+    else
+      fprintf(out, "  %-16s %12.3f %6.1f\n", phase_names[i], p->ns / 1e6, pct);
+  }
+
+  if (perf)
+    fprintf(out, "  %-16s %12.3f %6.1f %16ld %16ld\n", "total", total.ns / 1e6,
+            100.0, total.cycles, total.insns);
+  else
+    fprintf(out, "  %-16s %12.3f %6.1f\n", "total", total.ns / 1e6, 100.0);
+
+  fprintf(out, "  %-16s %12ld\n", "max_rss_kb", max_rss_kb());
+
+  fprintf(out, "Counters:\n");
+  fprintf(out, "  %-24s %12ld\n", "tokens", counters.tokens);
+  fprintf(out, "  %-24s %12ld\n", "nodes", counters.nodes);
+  fprintf(out, "  %-24s %12ld\n", "types", counters.types);
+  fprintf(out, "  %-24s %12ld\n", "scopes", counters.scopes);
+  fprintf(out, "  %-24s %12ld\n", "insns", counters.insns);
+  fprintf(out, "  %-24s %12ld\n", "asm_bytes", counters.asm_bytes);
+  for (int i = 0; i < ncounters; i++)
+    fprintf(out, "  %-24s %12ld\n", counter_names[i], counter_vals[i]);
+}
+
+static void print_json(FILE *out, Sample total) {
+  bool perf = (cycles_fd >= 0);
+
+  fprintf(out, "{\"phases\":{");
+  for (int i = 0; i < nphases; i++) {
+    Sample *p = &phase_time[i];
+    fprintf(out, "%s\"%s\":{\"wall_ns\":%ld", i ? "," : "", phase_names[i], p->ns);
+    if (perf)
+      fprintf(out, ",\"cycles\":%ld,\"instructions\":%ld", p->cycles, p->insns);
+    else
+      fprintf(out, ",\"cycles\":null,\"instructions\":null");
+    fprintf(out, "}");
+  }
+  fprintf(out, "},\"total\":{\"wall_ns\":%ld", total.ns);
+  if (perf)
+    fprintf(out, ",\"cycles\":%ld,\"instructions\":%ld", total.cycles, total.insns);
+  else
+    fprintf(out, ",\"cycles\":null,\"instructions\":null");
+  fprintf(out, ",\"max_rss_kb\":%ld", max_rss_kb());
+  fprintf(out, "},\"counters\":{");
+  fprintf(out, "\"tokens\":%ld,\"nodes\":%ld,\"types\":%ld,\"scopes\":%ld,"
+          "\"insns\":%ld,\"asm_bytes\":%ld",
+          counters.tokens, counters.nodes, counters.types, counters.scopes,
+          counters.insns, counters.asm_bytes);
+  for (int i = 0; i < ncounters; i++)
+    fprintf(out, ",\"%s\":%ld", counter_names[i], counter_vals[i]);
+  fprintf(out, "}}\n");
+}
+
+static FuncSize size_head;
+static FuncSize *size_tail = &size_head;
+
+FuncSize *new_func_size(char *name) {
+  FuncSize *fs = calloc(1, sizeof(FuncSize));
+  fs->name = name;
+  size_tail = size_tail->next = fs;
+  return fs;
+}
+
+static bool startswith(char *p, char *q) {
+  return strncmp(p, q, strlen(q)) == 0;
+}
+
+// Classify an instruction by its mnemonic.
+void count_insn(FuncSize *fs, char *insn) {
+  fs->insns++;
+
+  if (startswith(insn, "ld"))
+    fs->loads++;
+  else if (startswith(insn, "st"))
+    fs->stores++;
+  else if (startswith(insn, "bl ") || startswith(insn, "blr "))
+    fs->calls++;
+  else if (startswith(insn, "b ") || startswith(insn, "b.") ||
+           startswith(insn, "cb") || startswith(insn, "tb") ||
+           startswith(insn, "ret"))
+    fs->branches++;
+  else
+    fs->alu++;
+}
+
+// Print per-function code size as JSON, one function per line so
+// that reports from two compiler versions can be diffed.
+void print_size_report(FILE *out) {
+  fprintf(out, "{\"functions\":[\n");
+  for (FuncSize *fs = size_head.next; fs; fs = fs->next) {
+    fprintf(out, "  {\"name\":\"%s\",\"insns\":%d,\"bytes\":%d,"
+            "\"stack_size\":%d,\"max_push_depth\":%d,\"loads\":%d,"
+            "\"stores\":%d,\"alu\":%d,\"branches\":%d,\"calls\":%d}%s\n",
+            fs->name, fs->insns, fs->insns * 4, fs->stack_size, fs->max_depth,
+            fs->loads, fs->stores, fs->alu, fs->branches, fs->calls,
+            fs->next ? "," : "");
+  }
+  fprintf(out, "]}\n");
+}
+
+void print_stats(FILE *out) {
+  if (!format_kind)
+    return;
+
+  Sample s = sample();
+  Sample total = {s.ns - start.ns, s.cycles - start.cycles, s.insns - start.insns};
+
+  if (format_kind == STATS_JSON)
+    print_json(out, total);
+  else
+    print_table(out, total);
+}
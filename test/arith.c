@@ -31,6 +31,36 @@ int main() {
   ASSERT(1, 1>=1);
   ASSERT(0, 1>=2);
 
+  ASSERT(1, 5000-4999);
+  ASSERT(4097, 4096+1);
+  ASSERT(3, 12884901891-12884901888);
+  ASSERT(7, 1229782938247303441-1229782938247303434);
+  ASSERT(1, -281470681743361<0);
+
+  ASSERT(0, ({ long x=5; x*0; }));
+  ASSERT(5, ({ long x=5; x*1; }));
+  ASSERT(-5, ({ long x=5; x*-1; }));
+  ASSERT(40, ({ long x=5; x*8; }));
+  ASSERT(-40, ({ long x=5; x*-8; }));
+  ASSERT(15, ({ long x=5; x*3; }));
+  ASSERT(-15, ({ long x=5; x*-3; }));
+  ASSERT(35, ({ long x=5; x*7; }));
+  ASSERT(60, ({ long x=5; x*12; }));
+  ASSERT(-50, ({ long x=-5; x*10; }));
+  ASSERT(-300, ({ long x=-3; x*100; }));
+  ASSERT(3, ({ long x=7; x/2; }));
+  ASSERT(-3, ({ long x=-7; x/2; }));
+  ASSERT(-1, ({ long x=-7; x/4; }));
+  ASSERT(-2, ({ long x=-8; x/4; }));
+  ASSERT(-1, ({ long x=7; x/-4; }));
+  ASSERT(-33, ({ long x=-100; x/3; }));
+  ASSERT(-14, ({ long x=100; x/-7; }));
+  ASSERT(-10, ({ long x=-100; x/10; }));
+  ASSERT(14, ({ long x=99; x/7; }));
+  ASSERT(0, ({ long x=-1; x/3; }));
+  ASSERT(1560, ({ long x=1000000; x/641; }));
+  ASSERT(1, ({ int x=0; if ((0 - 9223372036854775807 - 1) / (0 - 1)) x=1; x; }));
+
   printf("OK\n");
   return 0;
 }
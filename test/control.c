@@ -4,11 +4,70 @@
  * This is a block comment.
  */
 
+int max2(int a, int b) { int x; if (a < b) x = b; else x = a; return x; }
+int clamp(int v, int lo, int hi) { if (v < lo) v = lo; if (v > hi) v = hi; return v; }
+long abs_long(long x) { if (x < 0) x = -x; return x; }
+int is_neg(long x) { int r; if (x < 0) r = 1; else r = 0; return r; }
+int sign(long x) { int s; if (x < 0) s = -1; else { if (x == 0) s = 0; else s = 1; } return s; }
+int sort2(int a, int b) { int t; if (a > b) { t = a; a = b; b = t; } return a * 10 + b; }
+int lt_plus(int a, int b) { int c = a < b; int x = 0; if (c) x = 5; return x + c; }
+int count_zeros(char *p, int n) {
+  int c = 0;
+  int i;
+  for (i = 0; i < n; i = i + 1)
+    if (p[i] == 0)
+      c = c + 1;
+  return c;
+}
+long sum_array(long *a, int n) { long s = 0; int i; for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }
+void fill3(int *a, int n) { int i; for (i = 0; i < n; i = i + 1) a[i] = i * 3; }
+void add_product(long *a, int n, long x, long y) { int i; for (i = 0; i < n; i = i + 1) a[i] = a[i] + x * y; }
+struct pair { long x; char c; };
+long sum_pairs(struct pair *p, int n) { long s = 0; int i; for (i = 0; i < n; i = i + 1) s = s + p[i].x * p[i].c; return s; }
+int find_char(char *s, int n, int c) { int i; for (i = 0; i < n; i = i + 1) if (s[i] == c) return i; return i; }
+int end_index(int *a, int n) { int i; for (i = 0; i < n; i = i + 1) a[i] = 1; return i; }
+long sum_down(long *a, long n) { long s = 0; long i; for (i = n; i > 0; i = i - 2) s = s * 3 + a[i - 1]; return s; }
+long sum_first4(long *a) { long s = 0; int i; for (i = 0; i < 4; i = i + 1) s = s * 10 + a[i]; return s; }
+long sum_by3(long *a, int n) {
+  long s = 0;
+  int i;
+#pragma unroll 3
+  for (i = 0; i < n; i = i + 1)
+    s = s * 2 + a[i];
+  return s;
+}
+long sum_nounroll(long *a, int n) {
+  long s = 0;
+  int i;
+#pragma nounroll
+  for (i = 0; i < n; i = i + 1)
+    s = s + a[i];
+  return s;
+}
+void vadd(int *c, int *a, int *b, int n) { int i; for (i = 0; i < n; i = i + 1) c[i] = a[i] + b[i]; }
+void add3(char *p, int n) { int i; for (i = 0; i < n; i = i + 1) p[i] = p[i] + 3; }
+void sub_long(long *a, int n, long x) { int i; for (i = 0; i < n; i = i + 1) a[i] = a[i] - x; }
+void clamp_into(int *d, int *a, int n, int hi) { int i; int v; for (i = 0; i < n; i = i + 1) { v = a[i]; if (v > hi) v = hi; d[i] = v; } }
+long sum_double(long *a, int n) { long s = 0; long i; for (i = 0; i < n * 2; i = i + 1) s = s + a[i]; return s; }
+long sum_bytes(char *p, int n) { long s = 0; int i; for (i = 0; i < n; i = i + 1) s = s + p[i]; return s; }
+int sum_int(int *a, int n) { int s = 0; int i; for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }
+int max_short(short *a, int n) { int m = 0; int i; for (i = 0; i < n; i = i + 1) if (a[i] > m) m = a[i]; return m; }
+int min_int(int *a, int n) { int m = 1000; int i; for (i = 0; i < n; i = i + 1) if (a[i] < m) m = a[i]; return m; }
+int min_char(char *a, int n) { int m = 1000; int i; for (i = 0; i < n; i = i + 1) if (a[i] < m) m = a[i]; return m; }
+long max_char(char *a, int n, long m) { int i; for (i = 0; i < n; i = i + 1) if (a[i] > m) m = a[i]; return m; }
+int tri(int n) { int a[10][10]; int i; int j; int s = 0; for (i = 0; i < n; i = i + 1) for (j = 0; j < 10; j = j + 1) a[i][j] = i * j; for (i = 0; i < n; i = i + 1) for (j = 0; j <= i; j = j + 1) s = s + a[i][j]; return s; }
+
 int main() {
   ASSERT(3, ({ int x; if (0) x=2; else x=3; x; }));
   ASSERT(3, ({ int x; if (1-1) x=2; else x=3; x; }));
   ASSERT(2, ({ int x; if (1) x=2; else x=3; x; }));
   ASSERT(2, ({ int x; if (2-1) x=2; else x=3; x; }));
+  ASSERT(2, ({ long x=-3; int y; if (x<0) y=2; else y=3; y; }));
+  ASSERT(3, ({ long x=-3; int y; if (x>=0) y=2; else y=3; y; }));
+  ASSERT(2, ({ long x=0; int y; if (x==0) y=2; else y=3; y; }));
+  ASSERT(3, ({ long x=0; int y; if (x!=0) y=2; else y=3; y; }));
+  ASSERT(2, ({ long x=4; int y; if (x>3) y=2; else y=3; y; }));
+  ASSERT(5, ({ int i; int j=0; for (i=5; i!=0; i=i-1) j=j+1; j; }));
 
   ASSERT(55, ({ int i=0; int j=0; for (i=0; i<=10; i=i+1) j=i+j; j; }));
 
@@ -24,6 +83,76 @@ int main() {
   ASSERT(5, ({ int i=2, j=3; (i=5,j)=6; i; }));
   ASSERT(6, ({ int i=2, j=3; (i=5,j)=6; j; }));
 
+  ASSERT(2, ({ int x=0; if (1-1) { x=1; } else x=2; x; }));
+  ASSERT(0, ({ int x=0; for (;0;) x=1; x; }));
+  ASSERT(1, ({ int x=0; for (x=1; 2-2;) x=5; x; }));
+  ASSERT(1, ({ int x=0; int y=0; x=(y=y+1); y; }));
+  ASSERT(3, ({ int i=0; int d=0; for (; i<3; d=i) i=i+1; i; }));
+  ASSERT(2, ({ int a[4]; int i=0; a[i=i+1]=5; a[i=i+1]=6; i; }));
+
+  ASSERT(5, max2(3, 5));
+  ASSERT(5, max2(5, 3));
+  ASSERT(3, max2(0, 3));
+  ASSERT(2, clamp(1, 2, 9));
+  ASSERT(4, clamp(4, 0, 9));
+  ASSERT(9, clamp(12, 0, 9));
+  ASSERT(6, abs_long(-6));
+  ASSERT(6, abs_long(6));
+  ASSERT(1, abs_long(-4294967297) == 4294967297);
+  ASSERT(1, is_neg(-1));
+  ASSERT(0, is_neg(0));
+  ASSERT(-1, sign(-8));
+  ASSERT(0, sign(0));
+  ASSERT(1, sign(8));
+  ASSERT(12, sort2(2, 1));
+  ASSERT(12, sort2(1, 2));
+  ASSERT(6, lt_plus(1, 2));
+  ASSERT(0, lt_plus(2, 1));
+  ASSERT(2, ({ char s[5]; s[0]=0; s[1]=1; s[2]=0; s[3]=3; s[4]=4; count_zeros(s, 5); }));
+  ASSERT(15, ({ long a[5]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; a[4]=5; sum_array(a, 5); }));
+  ASSERT(0, ({ long a[1]; sum_array(a, 0); }));
+  ASSERT(21, ({ int a[8]; fill3(a, 8); a[7]; }));
+  ASSERT(12, ({ int a[8]; fill3(a, 8); a[0]+a[1]+a[3]; }));
+  ASSERT(24, ({ long a[3]; a[0]=1; a[1]=2; a[2]=3; add_product(a, 3, 2, 3); a[0]+a[1]+a[2]; }));
+  ASSERT(23, ({ struct pair p[3]; p[0].x=1; p[0].c=2; p[1].x=3; p[1].c=4; p[2].x=9; p[2].c=1; sum_pairs(p, 3); }));
+  ASSERT(2, find_char("abcd", 4, 99));
+  ASSERT(4, find_char("abcd", 4, 122));
+  ASSERT(6, ({ int a[6]; end_index(a, 6); }));
+  ASSERT(1, ({ int a[6]; end_index(a, 6); a[5]; }));
+  ASSERT(65, tri(5));
+  ASSERT(28, ({ long a[7]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; a[4]=5; a[5]=6; a[6]=7; sum_array(a, 7); }));
+  ASSERT(36, ({ long a[8]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; a[4]=5; a[5]=6; a[6]=7; a[7]=8; sum_array(a, 8); }));
+  ASSERT(3, ({ long a[3]; a[0]=1; a[1]=2; a[2]=3; sum_array(a, 2); }));
+  ASSERT(55, ({ long a[5]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; a[4]=5; sum_down(a, 5); }));
+  ASSERT(14, ({ long a[4]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; sum_down(a, 4); }));
+  ASSERT(1234, ({ long a[4]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; sum_first4(a); }));
+  ASSERT(57, ({ long a[5]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; a[4]=5; sum_by3(a, 5); }));
+  ASSERT(26, ({ long a[4]; a[0]=1; a[1]=2; a[2]=3; a[3]=4; sum_by3(a, 4); }));
+  ASSERT(0, ({ long a[1]; sum_by3(a, 0); }));
+  ASSERT(6, ({ long a[3]; a[0]=1; a[1]=2; a[2]=3; sum_nounroll(a, 3); }));
+  ASSERT(45, ({ long a[10]; long i; for (i=0; i<10; i=i+1) a[i]=i; sum_double(a, 5); }));
+  ASSERT(117, ({ int a[41]; int b[41]; int c[41]; int i; for (i=0; i<41; i=i+1) { a[i]=i; b[i]=2*i; } vadd(c, a, b, 40); c[39]; }));
+  ASSERT(2340, ({ int a[41]; int b[41]; int c[41]; int i; int s=0; for (i=0; i<41; i=i+1) { a[i]=i; b[i]=2*i; c[i]=0; } vadd(c, a, b, 40); for (i=0; i<41; i=i+1) s=s+c[i]; s; }));
+  ASSERT(1024, ({ int a[41]; int i; for (i=0; i<41; i=i+1) a[i]=1; vadd(a+1, a, a, 40); a[10]; }));
+  ASSERT(9, ({ int a[41]; int i; for (i=0; i<41; i=i+1) a[i]=1; vadd(a+1, a, a, 40); a[3]+a[1]-a[0]; }));
+  ASSERT(69, ({ char p[37]; int i; for (i=0; i<37; i=i+1) p[i]=i; add3(p, 35); p[35]+p[34]-p[0]; }));
+  ASSERT(14, ({ long a[9]; int i; for (i=0; i<9; i=i+1) a[i]=10*i; sub_long(a, 8, 3); a[7]-a[0]-a[8]+a[1]+a[2]; }));
+  ASSERT(450, ({ int a[33]; int d[33]; int i; int s=0; for (i=0; i<33; i=i+1) { a[i]=i; d[i]=0; } clamp_into(d, a, 33, 20); for (i=0; i<33; i=i+1) s=s+d[i]; s; }));
+  ASSERT(3570, ({ char p[85]; int i; for (i=0; i<85; i=i+1) p[i]=i; sum_bytes(p, 85); }));
+  ASSERT(9960, ({ char p[85]; int i; for (i=0; i<85; i=i+1) p[i]=120; sum_bytes(p, 83); }));
+  ASSERT(820, ({ int a[41]; int i; for (i=0; i<41; i=i+1) a[i]=i; sum_int(a, 41); }));
+  ASSERT(77, ({ short a[30]; int i; for (i=0; i<30; i=i+1) a[i]=2*i; a[17]=77; max_short(a, 30); }));
+  ASSERT(3, ({ int a[23]; int i; for (i=0; i<23; i=i+1) a[i]=50-i; a[9]=3; min_int(a, 23); }));
+  ASSERT(8, ({ char s[70]; int i; for (i=0; i<70; i=i+1) s[i]=1; for (i=0; i<70; i=i+9) s[i]=0; count_zeros(s, 70); }));
+  ASSERT(1000, ({ char a[40]; min_char(a, 0); }));
+  ASSERT(96, ({ char a[40]; int i; for (i=0; i<40; i=i+1) a[i]=100-i; min_char(a, 5); }));
+  ASSERT(61, ({ char a[40]; int i; for (i=0; i<40; i=i+1) a[i]=100-i; min_char(a, 40); }));
+  ASSERT(-5, ({ char a[40]; max_char(a, 0, 0-5); }));
+  ASSERT(-5, ({ char a[40]; int i; for (i=0; i<40; i=i+1) a[i]=100-i; max_char(a, 0, 0-5); }));
+  ASSERT(100, ({ char a[40]; int i; for (i=0; i<40; i=i+1) a[i]=100-i; max_char(a, 5, 0-5); }));
+  ASSERT(99, ({ char a[40]; int i; for (i=0; i<40; i=i+1) a[i]=100-i; max_char(a+1, 39, 0-5); }));
+  ASSERT(300, ({ char a[40]; int i; for (i=0; i<40; i=i+1) a[i]=100-i; max_char(a, 40, 300); }));
+
   printf("OK\n");
   return 0;
 }
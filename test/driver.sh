@@ -22,4 +22,193 @@ check -o
 ./chibicc --help 2>&1 | grep -q chibicc
 check --help
 
+# -ftime-report
+./chibicc -ftime-report -o $tmp/out $tmp/empty.c 2>&1 | grep -q '^  tokenize '
+check -ftime-report
+
+# --stats=json
+./chibicc --stats=json -o $tmp/out $tmp/empty.c 2>&1 | grep -q '"counters":{"tokens":1,'
+check --stats=json
+
+# --size-report
+echo 'int main() { return 0; }' > $tmp/main.c
+./chibicc --size-report=$tmp/size.json -o $tmp/out $tmp/main.c
+grep -q '{"name":"main","insns":' $tmp/size.json
+check --size-report
+
+# -O
+./chibicc -O2 -o $tmp/out $tmp/main.c
+grep -q 'main:' $tmp/out
+check -O2
+
+# -fpeephole
+echo 'int main() { int x; x = 3; return x; }' > $tmp/peep.c
+./chibicc -fpeephole --stats=json -o $tmp/out $tmp/peep.c 2>&1 | grep -q '"peephole.fold-address":[1-9]'
+check -fpeephole
+
+! ./chibicc -O2 -fno-peephole --stats=json -o $tmp/out $tmp/peep.c 2>&1 | grep -q 'peephole'
+check -fno-peephole
+
+# -fmemcpy-threshold
+echo 'int main() { struct {char a[100];} x, y; x = y; return 0; }' > $tmp/copy.c
+./chibicc -o $tmp/out $tmp/copy.c
+! grep -q 'bl memcpy' $tmp/out
+check 'struct copy'
+
+./chibicc -fmemcpy-threshold=64 -o $tmp/out $tmp/copy.c
+grep -q 'bl memcpy' $tmp/out
+check -fmemcpy-threshold
+
+# Leaf functions and -fomit-frame-pointer
+echo 'int get(int *p) { return *p; }' > $tmp/leaf.c
+./chibicc -O2 -o $tmp/out $tmp/leaf.c
+! grep -q 'stp' $tmp/out
+check 'leaf function'
+
+echo 'int f(int x) { int a[2]; a[0] = x; return a[0]; }' > $tmp/frame.c
+./chibicc -O2 -fomit-frame-pointer -o $tmp/out $tmp/frame.c
+! grep -q 'x29' $tmp/out
+check -fomit-frame-pointer
+
+# Sibling calls
+echo 'int g(int x); int f(int x) { return g(x + 1); }' > $tmp/sibling.c
+./chibicc -O2 -o $tmp/out $tmp/sibling.c
+grep -q 'b g$' $tmp/out && ! grep -qw 'bl g' $tmp/out && ! grep -q 'stp' $tmp/out
+check 'sibling call'
+
+./chibicc -O2 -fno-optimize-sibling-calls -o $tmp/out $tmp/sibling.c
+grep -qw 'bl g' $tmp/out
+check -fno-optimize-sibling-calls
+
+./chibicc -o $tmp/out $tmp/sibling.c
+grep -qw 'bl g' $tmp/out
+check 'no sibling calls at -O0'
+
+./chibicc -foptimize-sibling-calls -o $tmp/out $tmp/sibling.c
+grep -q 'b g$' $tmp/out && ! grep -qw 'bl g' $tmp/out
+check -foptimize-sibling-calls
+
+# Dead code
+echo 'static int unused() { return 1; } int f(int x) { int a[100]; a[0] = x; if (0) return unused(); return x; "dead"; }' > $tmp/dead.c
+./chibicc -O1 -o $tmp/out $tmp/dead.c
+! grep -q 'unused' $tmp/out && ! grep -q 'L\.\.' $tmp/out && ! grep -q 'sub sp' $tmp/out
+check 'dead code'
+
+# If-conversion
+echo 'int f(int a, int b) { int x; if (a < b) x = b; else x = a; return x; }' > $tmp/ifcvt.c
+./chibicc -O1 -o $tmp/out $tmp/ifcvt.c
+grep -q 'csel' $tmp/out && ! grep -q '^  b' $tmp/out
+check 'if-conversion'
+
+./chibicc -O1 -fno-if-conversion -o $tmp/out $tmp/ifcvt.c
+! grep -q 'csel' $tmp/out
+check -fno-if-conversion
+
+echo 'int f(int a, int b) { if (a < b) a = a * b * a; return a; }' > $tmp/ifcvt.c
+./chibicc -O1 -o $tmp/out $tmp/ifcvt.c
+! grep -q 'csel' $tmp/out
+check 'if-conversion cost'
+
+# Loop optimizations
+echo 'void f(long *a, int n, long x, long y) { int i; for (i = 0; i < n; i = i + 1) a[i] = a[i] + x * y; }' > $tmp/loop.c
+./chibicc -O1 -o $tmp/out $tmp/loop.c
+! sed -n '/b\.ge/,$p' $tmp/out | grep -q 'mul'
+check 'loop-invariant code motion'
+
+./chibicc -O2 -o $tmp/out $tmp/loop.c
+grep -q 'str x[0-9]*, \[x[0-9]*\], #8' $tmp/out && ! grep -q 'lsl #3\]' $tmp/out
+check 'strength reduction'
+
+# Loop unrolling
+echo 'long f(long *a) { long s = 0; int i; for (i = 0; i < 4; i = i + 1) s = s + a[i]; return s; }' > $tmp/unroll.c
+./chibicc -O2 -o $tmp/out $tmp/unroll.c
+[ $(grep -c 'ldr' $tmp/out) = 4 ] && ! grep -q '^  b' $tmp/out
+check 'full unrolling'
+
+echo 'long f(long *a, int n) { long s = 0; int i; for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }' > $tmp/unroll.c
+./chibicc -O2 -fno-vectorize -funroll-factor=2 -o $tmp/out $tmp/unroll.c
+[ $(grep -c 'ldr' $tmp/out) = 3 ]
+check -funroll-factor
+
+./chibicc -O2 -fno-vectorize -funroll-factor=1 -o $tmp/out $tmp/unroll.c
+[ $(grep -c 'ldr' $tmp/out) = 1 ]
+check '-funroll-factor=1'
+
+printf 'long f(long *a, int n) { long s = 0; int i;\n#pragma unroll 3\nfor (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }\n' > $tmp/unroll.c
+./chibicc -O2 -fno-vectorize -o $tmp/out $tmp/unroll.c
+[ $(grep -c 'ldr' $tmp/out) = 4 ]
+check '#pragma unroll'
+
+printf 'long f(long *a, int n) { long s = 0; int i;\n#pragma nounroll\nfor (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }\n' > $tmp/unroll.c
+./chibicc -O2 -fno-vectorize -o $tmp/out $tmp/unroll.c
+[ $(grep -c 'ldr' $tmp/out) = 1 ]
+check '#pragma nounroll'
+
+printf 'int f(int n) { int i;\n#pragma unroll -1\nfor (i = 0; i < n; i = i + 1); return i; }\n' > $tmp/unroll.c
+./chibicc -O2 -o $tmp/out $tmp/unroll.c 2>&1 | grep -q 'invalid unroll count'
+check '#pragma unroll -1'
+
+# Register promotion
+echo 'long f(int n) { struct { long a; long b; } s; long t = 0; int i; s.a = 2; for (i = 0; i < n; i = i + 1) t = t + s.a; s.b = t; return s.b; }' > $tmp/promote.c
+./chibicc -O1 -o $tmp/out $tmp/promote.c
+[ $(grep -c 'str' $tmp/out) = 2 ]
+check 'promotion next to a struct'
+
+echo 'long f(long *a, int n) { long s = 0; int i; { long t; long *p = &t; *p = 1; s = t; } for (i = 0; i < n; i = i + 1) s = s + a[i]; return s; }' > $tmp/promote.c
+./chibicc -O1 -o $tmp/out $tmp/promote.c
+[ $(grep -c 'x29, #-' $tmp/out) = 2 ]
+check 'promotion next to an address-taken block'
+
+# Common subexpression elimination
+echo 'long g; long f(long *a, int i, long x) { g = g + x; return a[i] * a[i] + g; }' > $tmp/cse.c
+./chibicc -O1 -o $tmp/out $tmp/cse.c
+[ $(grep -c 'ldr' $tmp/out) = 2 ] && [ $(grep -c 'adrp' $tmp/out) = 1 ]
+check 'common subexpression elimination'
+
+# Vectorization
+echo 'void f(int *c, int *a, int *b, int n) { int i; for (i = 0; i < n; i = i + 1) c[i] = a[i] + b[i]; }' > $tmp/vec.c
+./chibicc -O2 -o $tmp/out $tmp/vec.c
+grep -q 'ld1' $tmp/out && grep -q 'add v[0-9]*\.4s' $tmp/out
+check vectorization
+
+./chibicc -O2 -fno-vectorize -o $tmp/out $tmp/vec.c
+! grep -q 'ld1' $tmp/out
+check -fno-vectorize
+
+echo 'int f(short *a, int n) { int m = 0; int i; for (i = 0; i < n; i = i + 1) if (a[i] > m) m = a[i]; return m; }' > $tmp/vec.c
+./chibicc -O2 -o $tmp/out $tmp/vec.c
+grep -q 'umax v[0-9]*\.8h' $tmp/out
+check 'vectorized maximum'
+
+# Stack slot sharing
+echo 'int f(int x) { { char a[4096]; a[0] = x; x = a[0]; } { char b[4096]; b[0] = x; x = b[0]; } return x; }' > $tmp/slots.c
+./chibicc --size-report=$tmp/size.json -o $tmp/out $tmp/slots.c
+grep -q '"stack_size":4112' $tmp/size.json
+check 'stack slot sharing'
+
+# Variables are sorted by alignment except in a block that takes an address
+echo 'int f(int x) { { char a; long b; char c; long d; char e; a = x; b = x; c = x; d = x; e = x; x = a + b + c + d + e; } { int y; int *p; p = &y; *p = x; x = y; } return x; }' > $tmp/order.c
+./chibicc --size-report=$tmp/size.json -o $tmp/out $tmp/order.c
+grep -q '"stack_size":32' $tmp/size.json
+check 'slot order'
+
+# Inlining
+echo 'int sq(int x) { return x * x; } int main() { return sq(3) + 1; }' > $tmp/inline.c
+./chibicc -O2 --inline-report -o $tmp/out $tmp/inline.c 2> $tmp/report
+grep -q 'inlined sq into main' $tmp/report
+check --inline-report
+! grep -qw 'bl sq' $tmp/out
+check inlining
+
+./chibicc -O2 -finline-limit=0 -o $tmp/out $tmp/inline.c
+grep -qw 'bl sq' $tmp/out
+check -finline-limit
+
+# --dump-ir
+./chibicc -O1 --dump-ir -o $tmp/out $tmp/main.c 2>&1 | grep -q 'ret v'
+check --dump-ir
+
+./chibicc --dump-ir -o $tmp/out $tmp/main.c 2>&1 | grep -q 'requires -O1'
+check '--dump-ir at -O0'
+
 echo OK
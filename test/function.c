@@ -21,6 +21,14 @@ int addx(int *x, int y) {
   return *x + y;
 }
 
+int add10(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) {
+  return a + b*2 + c*3 + d*4 + e*5 + f*6 + g*7 + h*8 + i*9 + j*10;
+}
+
+long sub10(long a, long b, long c, long d, long e, long f, long g, long h, long i, long j) {
+  return a - b - c - d - e - f - g - h - i - j;
+}
+
 int sub_char(char a, char b, char c) {
   return a - b - c;
 }
@@ -39,6 +47,105 @@ int sub_short(short a, short b, short c) {
   return a - b - c;
 }
 
+int trunc_char(int x) {
+  char c;
+  c = x;
+  return c;
+}
+
+int trunc_short(short x) {
+  return x;
+}
+
+long mul_add(long a, long b, long c) {
+  return a * b + c;
+}
+
+long mul_sub(long a, long b, long c) {
+  return c - a * b;
+}
+
+long neg_mul(long a, long b) {
+  return -(a * b);
+}
+
+long hash(long h, char c) {
+  return h * 31 + c;
+}
+
+long index8(long a, long i) {
+  return a + i * 8 - i * 4;
+}
+
+int after_return(int x) {
+  return x;
+  x = 5;
+  return 3;
+}
+
+int const_cond(int x) {
+  if (0)
+    return 1;
+  if (2 == 2)
+    return x;
+  return 0;
+}
+
+long dead_in_comma(long x) {
+  long a;
+  long b;
+  a = x;
+  (a = a + 1, b = 5);
+  return a;
+}
+
+long dead_in_inc(long x) {
+  long a;
+  long b;
+  long i;
+  a = 0;
+  for (i = 0; i < x; i = i + 1, b = 0)
+    a = a + i;
+  return a;
+}
+
+long dead_in_stmt_expr(long x) {
+  long a;
+  long b;
+  a = x;
+  ({ a = a + 2; b = 3; });
+  return a;
+}
+
+int first_arg(int x, int y) {
+  return x;
+}
+
+int dead_arg(int x, int y) {
+  return first_arg(x, y);
+}
+
+static int static_sub(int a, int b) {
+  return a - b;
+}
+
+static int unused_static(int x) {
+  return x;
+}
+
+int sq(int x) {
+  return x * x;
+}
+
+int swap_sub(int a, int b) {
+  return ({ int t = a; a = b; b = t; a - b; });
+}
+
+long set7(long *p) {
+  *p = 7;
+  return 0;
+}
+
 int main() {
   ASSERT(3, ret3());
   ASSERT(8, add2(3, 5));
@@ -47,15 +154,47 @@ int main() {
   ASSERT(66, add6(1,2,add6(3,4,5,6,7,8),9,10,11));
   ASSERT(136, add6(1,2,add6(3,add6(4,5,6,7,8,9),10,11,12,13),14,15,16));
 
+  ASSERT(385, add10(1,2,3,4,5,6,7,8,9,10));
+  ASSERT(395, add10(1,2,3,4,5,6,7,8,add2(4,5),add2(5,6)));
+  ASSERT(855, add10(add6(1,2,3,4,5,6),2,3,4,5,6,7,8,9,add10(1,1,1,1,1,1,1,1,1,1)));
+  ASSERT(-53, sub10(1,2,3,4,5,6,7,8,9,10));
+  ASSERT(-55, ({ long x=10; sub10(x-9,2,3,4,5,6,7,8,x,x+1); }));
+
   ASSERT(7, add2(3,4));
   ASSERT(1, sub2(4,3));
   ASSERT(55, fib(9));
+  ASSERT(300, add2(1,2)+add2(3,4)+add2(5,6)+add2(7,8)+add2(9,10)+add2(11,12)+add2(13,14)+add2(15,16)+add2(17,18)+add2(19,20)+add2(21,22)+add2(23,24));
 
   ASSERT(1, ({ sub_char(7, 3, 3); }));
 
   ASSERT(1, sub_long(7, 3, 3));
   ASSERT(1, sub_short(7, 3, 3));
 
+  ASSERT(44, trunc_char(300));
+  ASSERT(1, trunc_short(65537));
+
+  ASSERT(26, mul_add(3, 7, 5));
+  ASSERT(-16, mul_sub(3, 7, 5));
+  ASSERT(-21, neg_mul(3, 7));
+  ASSERT(3105, hash(hash(0, 97), 98));
+  ASSERT(13, index8(1, 3));
+
+  ASSERT(7, after_return(7));
+  ASSERT(5, const_cond(5));
+  ASSERT(4, static_sub(7, 3));
+  ASSERT(42, dead_in_comma(41));
+  ASSERT(6, dead_in_inc(4));
+  ASSERT(42, dead_in_stmt_expr(40));
+  ASSERT(262, dead_arg(262, 760));
+
+  ASSERT(9, ({ int i=2; sq(i=i+1); }));
+  ASSERT(3, ({ int i=2; sq(i=i+1); i; }));
+  ASSERT(81, sq(sq(3)));
+  ASSERT(-4, ({ int a=2; swap_sub(a, a+1) - swap_sub(1, 3) - 3; }));
+  ASSERT(2, ({ int a=2, b=3; swap_sub(b, a); a; }));
+  ASSERT(17, ({ long x=1; long a=x; set7(&x); a*10+x; }));
+  ASSERT(14, ({ long x=1; long *p=&x; long a=*p; set7(p); a+*p+*p-a; }));
+
   printf("OK\n");
   return 0;
 }
@@ -1,5 +1,20 @@
 #include "test.h"
 
+long escape_block(long n) {
+  long s = 0;
+  long i;
+  {
+    long t = 0;
+    long *p = &t;
+    for (i = 0; i < n; i = i + 1)
+      *p = *p + i;
+    s = t;
+  }
+  for (i = 0; i < n; i = i + 1)
+    s = s + i;
+  return s;
+}
+
 int main() {
   ASSERT(3, ({ int x=3; *&x; }));
   ASSERT(3, ({ int x=3; int *y=&x; int **z=&y; **z; }));
@@ -10,6 +25,8 @@ int main() {
   ASSERT(7, ({ int x=3; int y=5; *(&x+1)=7; y; }));
   ASSERT(7, ({ int x=3; int y=5; *(&y-2+1)=7; x; }));
   ASSERT(5, ({ int x=3; (&x+2)-&x+3; }));
+  ASSERT(20, escape_block(5));
+  ASSERT(7, ({ int x=3; int *p=&x; int y=0; { int z=4; y=z; } *p=x+y; x; }));
   ASSERT(8, ({ int x, y; x=3; y=5; x+y; }));
   ASSERT(8, ({ int x=3, y=5; x+y; }));
 
@@ -39,6 +56,11 @@ int main() {
   ASSERT(4, ({ int x[2][3]; int *y=x; y[4]=4; x[1][1]; }));
   ASSERT(5, ({ int x[2][3]; int *y=x; y[5]=5; x[1][2]; }));
 
+  ASSERT(6, ({ long a[2]; long *p=a; long *q=a; a[0]=1; long s=*p; *q=5; s+*p; }));
+  ASSERT(44, ({ long x=0; char *p=&x; *p=300; *p; }));
+  ASSERT(8, ({ int x[4]; int i=1; x[i]=2; x[i+1]=3; x[i]*x[i+1]+x[i]; }));
+  ASSERT(9, ({ int x[4]; int i=1; int j=2; x[i*j]=4; x[i*j+1]=5; x[2]+x[i*j+1]; }));
+
   printf("OK\n");
   return 0;
 }
@@ -1,5 +1,16 @@
 #include "test.h"
 
+long sum_member(int n) {
+  struct { long a; long b; } s;
+  long t = 0;
+  int i;
+  s.a = 2;
+  for (i = 0; i < n; i = i + 1)
+    t = t + s.a;
+  s.b = t;
+  return s.b;
+}
+
 int main() {
   ASSERT(1, ({ struct {int a; int b;} x; x.a=1; x.b=2; x.a; }));
   ASSERT(2, ({ struct {int a; int b;} x; x.a=1; x.b=2; x.b; }));
@@ -28,6 +39,10 @@ int main() {
   ASSERT(8, ({ struct {char a; int b;} x; sizeof(x); }));
   ASSERT(8, ({ struct {int a; char b;} x; sizeof(x); }));
 
+  ASSERT(9, ({ struct {char a[63];} x, y; x.a[0]=1; x.a[62]=8; y=x; y.a[0]+y.a[62]; }));
+  ASSERT(9, ({ struct {char a[103];} x, y; x.a[0]=1; x.a[102]=8; y=x; y.a[0]+y.a[102]; }));
+  ASSERT(9, ({ struct {long a[512];} x, y; x.a[0]=1; x.a[511]=8; y=x; y.a[0]+y.a[511]; }));
+
   ASSERT(8, ({ struct t {int a; int b;} x; struct t y; sizeof(y); }));
   ASSERT(8, ({ struct t {int a; int b;}; struct t y; sizeof(y); }));
   ASSERT(2, ({ struct t {char a[2];}; { struct t {char a[4];}; } struct t y; sizeof(y); }));
@@ -52,6 +67,10 @@ int main() {
   ASSERT(16, ({ struct {char a; long b;} x; sizeof(x); }));
   ASSERT(4, ({ struct {char a; short b;} x; sizeof(x); }));
 
+  ASSERT(15, ({ struct {long k; struct {long x; long y;} a;} s; s.a.x=3; s.a.y=4; s.a.x*s.a.y+s.a.x; }));
+  ASSERT(16, ({ struct {long k; struct {long x; long y;} a;} s, *p=&s; p->a.x=3; p->a.y=4; p->a.x=p->a.x+1; p->a.x*p->a.y; }));
+  ASSERT(10, sum_member(5));
+
   printf("OK\n");
   return 0;
 }
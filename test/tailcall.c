@@ -0,0 +1,56 @@
+#include "test.h"
+
+// Each of these recursions is a million calls deep. Without sibling
+// calls, that needs tens of megabytes of stack and overflows the
+// default 8 MiB stack.
+
+long count_down(long n, long acc) {
+  if (n == 0)
+    return acc;
+  return count_down(n - 1, acc + 1);
+}
+
+int is_odd(long n);
+
+int is_even(long n) {
+  if (n == 0)
+    return 1;
+  return is_odd(n - 1);
+}
+
+int is_odd(long n) {
+  if (n == 0)
+    return 0;
+  return is_even(n - 1);
+}
+
+long count_local(long n, long acc) {
+  long next = acc + 1;
+  if (n == 0)
+    return acc;
+  return count_local(n - 1, next);
+}
+
+long rotate(long a, long b, long c, long n) {
+  if (n == 0)
+    return a * 100 + b * 10 + c;
+  return rotate(b, c, a, n - 1);
+}
+
+int deref(int *p) { return *p; }
+int pass_addr(int x) { return deref(&x); }
+int pass_array() { int a[2]; a[0]=7; a[1]=8; return deref(a) + deref(a+1); }
+
+int main() {
+  ASSERT(1000000, count_down(1000000, 0));
+  ASSERT(1, is_even(1000000));
+  ASSERT(0, is_odd(1000000));
+  ASSERT(1000000, count_local(1000000, 0));
+  ASSERT(231, rotate(1, 2, 3, 1000000));
+
+  ASSERT(5, pass_addr(5));
+  ASSERT(15, pass_array());
+
+  printf("OK\n");
+  return 0;
+}
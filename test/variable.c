@@ -1,6 +1,7 @@
 #include "test.h"
 
 int g1, g2[4];
+static int g3;
 
 int main() {
   ASSERT(3, ({ int a; a=3; a; }));
@@ -33,6 +34,8 @@ int main() {
   ASSERT(2, ({ g2[0]=0; g2[1]=1; g2[2]=2; g2[3]=3; g2[2]; }));
   ASSERT(3, ({ g2[0]=0; g2[1]=1; g2[2]=2; g2[3]=3; g2[3]; }));
 
+  ASSERT(5, ({ g3=5; g3; }));
+
   ASSERT(4, sizeof(g1));
   ASSERT(16, sizeof(g2));
 
@@ -64,6 +67,11 @@ int main() {
 
   { void *x; }
 
+  ASSERT(3, ({ int x=1; { char a[10]; a[9]=2; x=x+a[9]; } { char b[10]; b[0]=0; x=x+b[0]; } x; }));
+  ASSERT(5, ({ int x=2; { long a=3; x=x+a; } { char b=4; { long c=5; b=c; } x=b; } x; }));
+  ASSERT(7, ({ char a=1; long b=2; char c=4; a+b+c; }));
+  ASSERT(9, ({ int x=({ int y=4; y; }) + ({ int z=5; z; }); x; }));
+
   printf("OK\n");
   return 0;
 }
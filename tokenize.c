@@ -19,7 +19,7 @@ void error(char *fmt, ...) {
 //
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
-static void verror_at(int line_no, char *loc, char *fmt, va_list ap) {
+static noreturn void verror_at(int line_no, char *loc, char *fmt, va_list ap) {
   // Find a line containing `loc`.
   char *line = loc;
   while (current_input < line && line[-1] != '\n')
@@ -84,6 +84,7 @@ bool consume(Token **rest, Token *tok, char *str) {
 // Create a new token.
 static Token *new_token(TokenKind kind, char *start, char *end) {
   Token *tok = calloc(1, sizeof(Token));
+  counters.tokens++;
   tok->kind = kind;
   tok->loc = start;
   tok->len = end - start;
@@ -126,7 +127,7 @@ static int read_punct(char *p) {
 static bool is_keyword(Token *tok) {
   static char *kw[] = {
     "return", "if", "else", "for", "while", "int", "sizeof", "char",
-    "struct", "union", "short", "long", "void", "typedef",
+    "struct", "union", "short", "long", "void", "typedef", "static",
   };
 
   for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
@@ -264,6 +265,16 @@ static Token *tokenize(char *filename, char *p) {
       continue;
     }
 
+    // The input is preprocessed, but #pragma lines are kept for the
+    // parser. Each becomes a single token.
+    if (startswith(p, "#pragma")) {
+      char *start = p;
+      while (*p != '\n')
+        p++;
+      cur = cur->next = new_token(TK_PRAGMA, start, p);
+      continue;
+    }
+
     // Skip whitespace characters.
     if (isspace(*p)) {
       p++;
@@ -352,5 +363,12 @@ static char *read_file(char *path) {
 }
 
 Token *tokenize_file(char *path) {
-  return tokenize(path, read_file(path));
+  phase_begin(PHASE_READ_FILE);
+  char *p = read_file(path);
+  phase_end();
+
+  phase_begin(PHASE_TOKENIZE);
+  Token *tok = tokenize(path, p);
+  phase_end();
+  return tok;
 }
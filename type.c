@@ -9,6 +9,7 @@ Type *ty_long = &(Type){TY_LONG, 8, 8};
 
 static Type *new_type(TypeKind kind, int size, int align) {
   Type *ty = calloc(1, sizeof(Type));
+  counters.types++;
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
@@ -23,6 +24,7 @@ bool is_integer(Type *ty) {
 
 Type *copy_type(Type *ty) {
   Type *ret = calloc(1, sizeof(Type));
+  counters.types++;
   *ret = *ty;
   return ret;
 }
@@ -35,6 +37,7 @@ Type *pointer_to(Type *base) {
 
 Type *func_type(Type *return_ty) {
   Type *ty = calloc(1, sizeof(Type));
+  counters.types++;
   ty->kind = TY_FUNC;
   ty->return_ty = return_ty;
   return ty;
@@ -47,22 +50,22 @@ Type *array_of(Type *base, int len) {
   return ty;
 }
 
-void add_type(Node *node) {
+static void type_node(Node *node) {
   if (!node || node->ty)
     return;
 
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
+  type_node(node->lhs);
+  type_node(node->rhs);
+  type_node(node->cond);
+  type_node(node->then);
+  type_node(node->els);
+  type_node(node->init);
+  type_node(node->inc);
 
   for (Node *n = node->body; n; n = n->next)
-    add_type(n);
+    type_node(n);
   for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+    type_node(n);
 
   switch (node->kind) {
   case ND_ADD:
@@ -122,3 +125,9 @@ void add_type(Node *node) {
     return;
   }
 }
+
+void add_type(Node *node) {
+  phase_begin(PHASE_ADD_TYPE);
+  type_node(node);
+  phase_end();
+}